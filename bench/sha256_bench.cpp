@@ -0,0 +1,170 @@
+// Throughput of the SHA-256 paths in common/crypto against the previous
+// SHA256_* / ifstream / ostringstream implementation.
+//
+//   onlinetalk_sha256_bench [megabytes] [threads]
+
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <openssl/sha.h>
+
+#include "common/crypto/merkle.h"
+#include "common/crypto/sha256.h"
+
+namespace {
+
+using onlinetalk::common::kManifestBlockSize;
+
+std::string legacyHex(const unsigned char* digest, size_t size) {
+  std::ostringstream ss;
+  ss << std::hex << std::setfill('0');
+  for (size_t i = 0; i < size; ++i) {
+    ss << std::setw(2) << static_cast<int>(digest[i]);
+  }
+  return ss.str();
+}
+
+std::string legacyBuffer(const std::vector<uint8_t>& data) {
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  SHA256_Update(&ctx, data.data(), data.size());
+  SHA256_Final(digest, &ctx);
+  return legacyHex(digest, SHA256_DIGEST_LENGTH);
+}
+
+std::string legacyFile(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  std::vector<char> buffer(64 * 1024);
+  while (file.good()) {
+    file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    if (file.gcount() > 0) {
+      SHA256_Update(&ctx, buffer.data(), static_cast<size_t>(file.gcount()));
+    }
+  }
+  unsigned char digest[SHA256_DIGEST_LENGTH];
+  SHA256_Final(digest, &ctx);
+  return legacyHex(digest, SHA256_DIGEST_LENGTH);
+}
+
+void legacyBlocks(const std::vector<uint8_t>& data) {
+  const uint8_t prefix = 0x00;
+  for (size_t done = 0; done < data.size(); done += kManifestBlockSize) {
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &prefix, 1);
+    SHA256_Update(&ctx, data.data() + done, std::min<size_t>(kManifestBlockSize, data.size() - done));
+    SHA256_Final(digest, &ctx);
+  }
+}
+
+void legacyManifest(const std::string& path) {
+  std::ifstream file(path, std::ios::binary);
+  std::vector<uint8_t> block(kManifestBlockSize);
+  const uint8_t prefix = 0x00;
+  while (file.good()) {
+    file.read(reinterpret_cast<char*>(block.data()), static_cast<std::streamsize>(block.size()));
+    if (file.gcount() <= 0) {
+      break;
+    }
+    unsigned char digest[SHA256_DIGEST_LENGTH];
+    SHA256_CTX ctx;
+    SHA256_Init(&ctx);
+    SHA256_Update(&ctx, &prefix, 1);
+    SHA256_Update(&ctx, block.data(), static_cast<size_t>(file.gcount()));
+    SHA256_Final(digest, &ctx);
+  }
+}
+
+double seconds(const std::function<void()>& fn) {
+  fn();
+  const auto start = std::chrono::steady_clock::now();
+  fn();
+  return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+void report(const char* name, double bytes, double legacy, double current) {
+  std::printf("%-22s legacy %9.1f MB/s   current %9.1f MB/s   x%.2f\n", name, bytes / legacy / 1e6,
+              bytes / current / 1e6, legacy / current);
+}
+
+}  // namespace
+
+int main(int argc, char** argv) {
+  const size_t megabytes = argc > 1 ? std::strtoul(argv[1], nullptr, 10) : 256;
+  const unsigned threads = argc > 2 ? static_cast<unsigned>(std::strtoul(argv[2], nullptr, 10))
+                                    : std::max(1u, std::thread::hardware_concurrency());
+
+  std::vector<uint8_t> data(megabytes * 1024 * 1024);
+  std::mt19937_64 rng(42);
+  for (auto& byte : data) {
+    byte = static_cast<uint8_t>(rng());
+  }
+  const auto bytes = static_cast<double>(data.size());
+
+  if (legacyBuffer(data) != onlinetalk::common::sha256Hex(data)) {
+    std::fprintf(stderr, "buffer digests differ\n");
+    return 1;
+  }
+  report("buffer", bytes, seconds([&] { legacyBuffer(data); }),
+         seconds([&] { onlinetalk::common::sha256Hex(data); }));
+
+  const std::string path = "onlinetalk_sha256_bench.tmp";
+  {
+    std::ofstream out(path, std::ios::binary);
+    out.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
+  }
+  std::string error;
+  if (legacyFile(path) != onlinetalk::common::sha256HexFile(path, &error)) {
+    std::fprintf(stderr, "file digests differ\n");
+    std::remove(path.c_str());
+    return 1;
+  }
+  report("file (cached)", bytes, seconds([&] { legacyFile(path); }),
+         seconds([&] { onlinetalk::common::sha256HexFile(path, &error); }));
+  report("file (cached, mmap)", bytes, seconds([&] { legacyFile(path); }),
+         seconds([&] { onlinetalk::common::sha256HexFile(path, &error, true); }));
+
+  std::vector<onlinetalk::common::ManifestDigest> leaves;
+  report("manifest file", bytes, seconds([&] { legacyManifest(path); }),
+         seconds([&] { onlinetalk::common::buildManifest(path, threads, &leaves, &error); }));
+  report("manifest file (mmap)", bytes, seconds([&] { legacyManifest(path); }),
+         seconds([&] { onlinetalk::common::buildManifest(path, threads, &leaves, &error, true); }));
+  std::remove(path.c_str());
+
+  std::vector<onlinetalk::common::Sha256Input> inputs;
+  for (size_t done = 0; done < data.size(); done += kManifestBlockSize) {
+    inputs.push_back({data.data() + done, std::min<size_t>(kManifestBlockSize, data.size() - done)});
+  }
+  report("blocks, 1 thread", bytes, seconds([&] { legacyBlocks(data); }),
+         seconds([&] { onlinetalk::common::sha256Many(inputs, 1, {0x00}); }));
+  report("blocks, all threads", bytes, seconds([&] { legacyBlocks(data); }),
+         seconds([&] { onlinetalk::common::sha256Many(inputs, threads, {0x00}); }));
+
+  const size_t digests = 1 << 20;
+  const auto hex_bytes = static_cast<double>(digests * SHA256_DIGEST_LENGTH);
+  report("hex encode", hex_bytes,
+         seconds([&] {
+           for (size_t i = 0; i < digests; ++i) {
+             legacyHex(data.data() + (i % 1024) * 32, SHA256_DIGEST_LENGTH);
+           }
+         }),
+         seconds([&] {
+           for (size_t i = 0; i < digests; ++i) {
+             onlinetalk::common::hexEncode(data.data() + (i % 1024) * 32, SHA256_DIGEST_LENGTH);
+           }
+         }));
+  return 0;
+}
@@ -1,9 +1,13 @@
 #include "client/file_transfer/file_transfer_manager.h"
 
 #include <algorithm>
+#include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <thread>
 
+#include "common/compress/deflate.h"
+#include "common/crypto/merkle.h"
 #include "common/crypto/sha256.h"
 #include "common/fs.h"
 
@@ -11,6 +15,45 @@ namespace onlinetalk::client {
 
 namespace {
 
+// Upload chunks requested in flight; the server may grant fewer.
+constexpr int kUploadWindow = 16;
+// Bytes a streaming download may have in flight. Credit is returned once
+// half of it has been written to disk.
+constexpr int64_t kDownloadCredit = 2 * 1024 * 1024;
+// A chunk that fails its manifest hash is sent or fetched again this many
+// times before the transfer gives up.
+constexpr int kMaxChunkRetries = 3;
+// Previews are held in memory, so they stay small.
+constexpr int64_t kMaxPreviewBytes = 1024 * 1024;
+
+// Checks a downloaded chunk against the manifest leaves the server sent with
+// it; chunks without leaves (older files) are left to the whole-file check.
+bool chunkMatchesBlocks(const nlohmann::json& meta, const std::vector<uint8_t>& data) {
+  const auto it = meta.find("block_hashes");
+  if (it == meta.end() || !it->is_array()) {
+    return true;
+  }
+  size_t done = 0;
+  for (const auto& hex : *it) {
+    onlinetalk::common::ManifestDigest expected{};
+    if (!hex.is_string() || done >= data.size() ||
+        !onlinetalk::common::manifestDigestFromHex(hex.get<std::string>(), &expected)) {
+      return false;
+    }
+    const auto size = std::min(data.size() - done, static_cast<size_t>(onlinetalk::common::kManifestBlockSize));
+    if (onlinetalk::common::manifestLeaf(data.data() + done, size) != expected) {
+      return false;
+    }
+    done += size;
+  }
+  return done == data.size();
+}
+
+int64_t steadyMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
 bool parseJson(const std::string& text, nlohmann::json* out, std::string* error) {
   try {
     *out = nlohmann::json::parse(text);
@@ -29,7 +72,10 @@ bool sendFileOffer(NetClient& net,
                    const std::string& file_name,
                    int64_t file_size,
                    const std::string& sha256,
+                   const std::vector<uint8_t>& manifest,
+                   const std::string& manifest_root,
                    const std::string& file_id,
+                   int64_t chunk_size,
                    uint64_t request_id,
                    std::string* error) {
   nlohmann::json meta;
@@ -38,10 +84,18 @@ bool sendFileOffer(NetClient& net,
   meta["file_name"] = file_name;
   meta["file_size"] = file_size;
   meta["sha256"] = sha256;
+  meta["window"] = kUploadWindow;
+  if (chunk_size > 0) {
+    meta["chunk_size"] = chunk_size;
+  }
   if (!file_id.empty()) {
     meta["file_id"] = file_id;
   }
-  if (!net.sendJson(onlinetalk::common::PacketType::FileOffer, request_id, meta, nullptr)) {
+  // The manifest rides in the binary part: 32 bytes per block.
+  if (!manifest.empty()) {
+    meta["manifest_root"] = manifest_root;
+  }
+  if (!net.sendJson(onlinetalk::common::PacketType::FileOffer, request_id, meta, manifest.empty() ? nullptr : &manifest)) {
     if (error) {
       *error = "failed to send file offer";
     }
@@ -86,14 +140,28 @@ bool FileTransferManager::beginUpload(NetClient& net,
     return false;
   }
 
+  // The whole-file digest is one sequential pass; the manifest leaves are
+  // independent, so they are spread over the remaining cores meanwhile.
   std::string hash_error;
-  const auto sha256 = onlinetalk::common::sha256HexFile(request.file_path, &hash_error);
+  std::string sha256;
+  std::thread whole_file([&] { sha256 = onlinetalk::common::sha256HexFile(request.file_path, &hash_error); });
+  std::vector<onlinetalk::common::ManifestDigest> leaves;
+  std::string manifest_error;
+  const unsigned cores = std::max(2u, std::thread::hardware_concurrency());
+  const bool have_manifest = onlinetalk::common::buildManifest(request.file_path, cores - 1, &leaves, &manifest_error);
+  whole_file.join();
   if (!hash_error.empty()) {
     if (error) {
       *error = hash_error;
     }
     return false;
   }
+  std::vector<uint8_t> manifest;
+  std::string manifest_root;
+  if (have_manifest) {
+    manifest = onlinetalk::common::packManifest(leaves);
+    manifest_root = onlinetalk::common::manifestDigestHex(onlinetalk::common::manifestRoot(leaves));
+  }
 
   const auto file_name = std::filesystem::path(request.file_path).filename().string();
   const auto req_id = net.nextRequestId();
@@ -103,7 +171,10 @@ bool FileTransferManager::beginUpload(NetClient& net,
                      file_name,
                      static_cast<int64_t>(size),
                      sha256,
+                     manifest,
+                     manifest_root,
                      request.file_id,
+                     preferred_chunk_size_,
                      req_id,
                      error)) {
     return false;
@@ -117,6 +188,8 @@ bool FileTransferManager::beginUpload(NetClient& net,
   task.file_path = request.file_path;
   task.file_name = file_name;
   task.sha256 = sha256;
+  task.manifest = std::move(manifest);
+  task.manifest_root = manifest_root;
   task.file_size = static_cast<int64_t>(size);
   pending_offers_[req_id] = task;
   if (request_id) {
@@ -146,7 +219,10 @@ bool FileTransferManager::resumeTransfers(NetClient& net, std::string* error) {
                        task.file_name,
                        task.file_size,
                        task.sha256,
+                       task.manifest,
+                       task.manifest_root,
                        task.file_id,
+                       preferred_chunk_size_,
                        req_id,
                        error)) {
       return false;
@@ -169,7 +245,10 @@ bool FileTransferManager::resumeTransfers(NetClient& net, std::string* error) {
                        task.file_name,
                        task.file_size,
                        task.sha256,
+                       task.manifest,
+                       task.manifest_root,
                        task.file_id,
+                       preferred_chunk_size_,
                        req_id,
                        error)) {
       return false;
@@ -184,11 +263,23 @@ bool FileTransferManager::resumeTransfers(NetClient& net, std::string* error) {
     if (task.failed || task.done) {
       continue;
     }
+    // Restart from the first chunk still missing.
+    for (const auto& refetch : task.refetches) {
+      task.next_offset = std::min(task.next_offset, refetch.second.offset);
+    }
+    task.refetches.clear();
     const auto req_id = net.nextRequestId();
     if (!sendDownloadRequest(net, task, req_id, error)) {
       return false;
     }
   }
+
+  preview_request_map_.clear();
+  for (auto& entry : preview_tasks_) {
+    if (!sendPreviewRequest(net, entry.first, entry.second, error)) {
+      return false;
+    }
+  }
   return true;
 }
 
@@ -229,7 +320,8 @@ bool FileTransferManager::beginDownload(NetClient& net,
   if (std::filesystem::exists(temp_path, ec)) {
     const auto existing = std::filesystem::file_size(temp_path, ec);
     if (!ec && existing > 0) {
-      offset = static_cast<int64_t>(existing);
+      // Resume on a block boundary so every chunk can be checked.
+      offset = static_cast<int64_t>(existing) - static_cast<int64_t>(existing) % onlinetalk::common::kManifestBlockSize;
       if (offset >= request.file_size) {
         offset = 0;
       }
@@ -274,6 +366,48 @@ bool FileTransferManager::beginDownload(NetClient& net,
   return true;
 }
 
+bool FileTransferManager::beginPreview(NetClient& net,
+                                       const DownloadRequest& request,
+                                       int64_t offset,
+                                       int64_t length,
+                                       uint64_t* request_id,
+                                       std::string* error) {
+  if (request.file_id.empty()) {
+    if (error) {
+      *error = "file_id required";
+    }
+    return false;
+  }
+  if (offset < 0 || offset >= request.file_size || length <= 0) {
+    if (error) {
+      *error = "invalid preview range";
+    }
+    return false;
+  }
+  auto existing = preview_tasks_.find(request.file_id);
+  if (existing != preview_tasks_.end()) {
+    preview_request_map_.erase(existing->second.request_id);
+  }
+  PreviewTask task;
+  task.offset = offset;
+  task.end = offset + std::min({length, request.file_size - offset, kMaxPreviewBytes});
+  task.next_offset = offset - offset % onlinetalk::common::kManifestBlockSize;
+  FilePreview preview;
+  preview.file_id = request.file_id;
+  preview.file_name = request.file_name;
+  preview.offset = offset;
+  previews_[request.file_id] = preview;
+  auto& stored = preview_tasks_[request.file_id];
+  stored = task;
+  if (!sendPreviewRequest(net, request.file_id, stored, error)) {
+    return false;
+  }
+  if (request_id) {
+    *request_id = stored.request_id;
+  }
+  return true;
+}
+
 bool FileTransferManager::handlePacket(NetClient& net, const onlinetalk::common::Packet& packet) {
   const auto type = static_cast<onlinetalk::common::PacketType>(packet.header.type);
   if (type != onlinetalk::common::PacketType::FileOffer &&
@@ -282,6 +416,7 @@ bool FileTransferManager::handlePacket(NetClient& net, const onlinetalk::common:
       type != onlinetalk::common::PacketType::FileUploadDone &&
       type != onlinetalk::common::PacketType::FileDownloadRequest &&
       type != onlinetalk::common::PacketType::FileDownloadChunk &&
+      type != onlinetalk::common::PacketType::FileDownloadCredit &&
       type != onlinetalk::common::PacketType::FileDone) {
     return false;
   }
@@ -320,11 +455,26 @@ bool FileTransferManager::handlePacket(NetClient& net, const onlinetalk::common:
       }
       return true;
     }
+    if (type == onlinetalk::common::PacketType::FileDownloadRequest) {
+      auto it = preview_request_map_.find(packet.header.request_id);
+      if (it != preview_request_map_.end()) {
+        markPreviewFailed(it->second, message);
+        return true;
+      }
+    }
+    if (type == onlinetalk::common::PacketType::FileDownloadCredit) {
+      // The server drops a stream once its last chunk is queued, so credit
+      // sent while that chunk is on the way finds no stream. A stream that
+      // really fails reports it on the request itself.
+      last_error_ = message;
+      return true;
+    }
     if (type == onlinetalk::common::PacketType::FileDownloadRequest) {
       auto it = download_request_map_.find(packet.header.request_id);
       if (it != download_request_map_.end()) {
-        markDownloadFailed(it->second, message);
+        const auto file_id = it->second;
         download_request_map_.erase(it);
+        markDownloadFailed(file_id, message);
       } else {
         last_error_ = message;
       }
@@ -337,12 +487,34 @@ bool FileTransferManager::handlePacket(NetClient& net, const onlinetalk::common:
       return handleFileAccept(net, packet.header.request_id, meta);
     case onlinetalk::common::PacketType::FileUploadChunk:
       return handleUploadAck(net, packet.header.request_id, meta);
-    case onlinetalk::common::PacketType::FileDownloadChunk:
-      return handleDownloadChunk(net, packet, meta);
+    case onlinetalk::common::PacketType::FileDownloadChunk: {
+      const bool preview = preview_request_map_.count(packet.header.request_id) > 0;
+      if ((packet.header.flags & onlinetalk::common::PacketHeader::kFlagCompressed) == 0) {
+        return preview ? handlePreviewChunk(net, packet, meta) : handleDownloadChunk(net, packet, meta);
+      }
+      // Offsets, credit and block hashes all count the file's own bytes.
+      onlinetalk::common::Packet inflated;
+      inflated.header = packet.header;
+      const auto length = meta.value("length", static_cast<int64_t>(0));
+      if (length <= 0 ||
+          !onlinetalk::common::inflateRaw(packet.binary.data(), packet.binary.size(), {}, static_cast<size_t>(length),
+                                          &inflated.binary, &error) ||
+          static_cast<int64_t>(inflated.binary.size()) != length) {
+        if (preview) {
+          const auto file_id = preview_request_map_[packet.header.request_id];
+          markPreviewFailed(file_id, "chunk inflate failed");
+        } else {
+          markDownloadFailed(meta.value("file_id", ""), "chunk inflate failed");
+        }
+        return true;
+      }
+      return preview ? handlePreviewChunk(net, inflated, meta) : handleDownloadChunk(net, inflated, meta);
+    }
     case onlinetalk::common::PacketType::FileDone: {
       const auto file_id = meta.value("file_id", "");
       auto it = uploads_.find(file_id);
       if (it != uploads_.end()) {
+        preferred_chunk_size_ = it->second.sizer.size();
         it->second.done = true;
         it->second.stream.reset();
         auto state_it = upload_states_.find(file_id);
@@ -367,6 +539,10 @@ const std::unordered_map<std::string, TransferState>& FileTransferManager::downl
   return download_states_;
 }
 
+const std::unordered_map<std::string, FilePreview>& FileTransferManager::previews() const {
+  return previews_;
+}
+
 const std::string& FileTransferManager::lastError() const {
   return last_error_;
 }
@@ -391,11 +567,20 @@ bool FileTransferManager::handleFileAccept(NetClient& net, uint64_t request_id,
 
   task.file_id = meta.value("file_id", task.file_id);
   task.next_offset = meta.value("next_offset", static_cast<int64_t>(0));
-  task.chunk_size = meta.value("chunk_size", 0);
-  if (task.file_id.empty() || task.chunk_size <= 0) {
+  task.send_offset = task.next_offset;
+  const auto chunk_size = meta.value("chunk_size", static_cast<int64_t>(0));
+  task.window = std::max(1, meta.value("window", 1));
+  task.compress = meta.value("compression", false);
+  task.compressor = onlinetalk::common::ChunkCompressor();
+  task.done_sent = false;
+  if (task.file_id.empty() || chunk_size <= 0) {
     last_error_ = "invalid file accept response";
     return true;
   }
+  // Servers without bounds keep every chunk at chunk_size.
+  const auto min_chunk = meta.value("min_chunk_size", chunk_size);
+  task.sizer = onlinetalk::common::ChunkSizer(min_chunk, min_chunk, meta.value("max_chunk_size", chunk_size), chunk_size);
+  task.in_flight.clear();
   uploads_[task.file_id] = task;
   upload_request_map_[task.request_id] = task.file_id;
 
@@ -407,7 +592,7 @@ bool FileTransferManager::handleFileAccept(NetClient& net, uint64_t request_id,
   upload_states_[task.file_id] = state;
 
   std::string error;
-  if (!sendNextChunk(net, uploads_[task.file_id], &error)) {
+  if (!fillUploadWindow(net, uploads_[task.file_id], &error)) {
     last_error_ = error;
   }
   return true;
@@ -425,6 +610,37 @@ bool FileTransferManager::handleUploadAck(NetClient& net, uint64_t request_id, c
   }
 
   UploadTask& task = upload_it->second;
+  // Acks may come back over the control and data connections in either
+  // order, so the chunk is found by the offset the server reports.
+  SentChunk acked;
+  acked.offset = task.next_offset;
+  acked.length = task.sizer.size();
+  acked.sent_ms = -1;
+  if (meta.contains("offset")) {
+    const auto offset = meta.value("offset", static_cast<int64_t>(-1));
+    const auto chunk = std::find_if(task.in_flight.begin(), task.in_flight.end(),
+                                    [&](const SentChunk& sent) { return sent.offset == offset; });
+    if (chunk == task.in_flight.end()) {
+      markUploadFailed(task.file_id, "ack for a chunk that is not in flight");
+      return true;
+    }
+    acked = *chunk;
+    task.in_flight.erase(chunk);
+  } else if (status.empty() || status == "ok") {
+    markUploadFailed(task.file_id, "chunk ack without offset");
+    return true;
+  }
+  if (meta.value("code", "") == "CHUNK_CORRUPT" && task.chunk_retries < kMaxChunkRetries && !task.failed) {
+    ++task.chunk_retries;
+    task.sizer.onLoss();
+    // The resend has to cover exactly the bytes the bad chunk did.
+    int64_t sent = 0;
+    std::string error;
+    if (!sendChunk(net, task, acked.offset, acked.length, &sent, &error)) {
+      last_error_ = error;
+    }
+    return true;
+  }
   if (!status.empty() && status != "ok") {
     task.failed = true;
     auto state_it = upload_states_.find(task.file_id);
@@ -439,20 +655,18 @@ bool FileTransferManager::handleUploadAck(NetClient& net, uint64_t request_id, c
     return true;
   }
 
-  task.next_offset = meta.value("next_offset", task.next_offset);
+  const auto now = steadyMs();
+  task.sizer.onAck(acked.length, acked.sent_ms >= 0 ? now - acked.sent_ms : -1, now);
+  // Acks are cumulative and may arrive for chunks past a gap, so only ever
+  // move forward.
+  task.next_offset = std::max(task.next_offset, meta.value("next_offset", task.next_offset));
   auto state_it = upload_states_.find(task.file_id);
   if (state_it != upload_states_.end()) {
     state_it->second.transferred = task.next_offset;
   }
 
   std::string error;
-  if (task.next_offset >= task.file_size) {
-    if (!sendUploadDone(net, task, &error)) {
-      last_error_ = error;
-    }
-    return true;
-  }
-  if (!sendNextChunk(net, task, &error)) {
+  if (!fillUploadWindow(net, task, &error)) {
     last_error_ = error;
   }
   return true;
@@ -461,16 +675,23 @@ bool FileTransferManager::handleUploadAck(NetClient& net, uint64_t request_id, c
 bool FileTransferManager::handleDownloadChunk(NetClient& net,
                                               const onlinetalk::common::Packet& packet,
                                               const nlohmann::json& meta) {
-  download_request_map_.erase(packet.header.request_id);
   const auto file_id = meta.value("file_id", "");
   auto it = downloads_.find(file_id);
   if (it == downloads_.end()) {
     return true;
   }
   DownloadTask& task = it->second;
+  if (task.failed || task.done) {
+    return true;
+  }
+  const auto refetch = task.refetches.find(packet.header.request_id);
+  const bool refetched = refetch != task.refetches.end();
+  if (!refetched && packet.header.request_id != task.request_id) {
+    return true;  // left over from a stream that has been replaced
+  }
 
   const auto offset = meta.value("offset", task.next_offset);
-  if (offset != task.next_offset) {
+  if (offset != (refetched ? refetch->second.offset : task.next_offset)) {
     markDownloadFailed(task.file_id, "download offset mismatch");
     return true;
   }
@@ -478,74 +699,191 @@ bool FileTransferManager::handleDownloadChunk(NetClient& net,
     markDownloadFailed(task.file_id, "download chunk empty");
     return true;
   }
-
-  std::fstream stream;
-  if (offset == 0) {
-    stream.open(task.temp_path, std::ios::binary | std::ios::out | std::ios::trunc);
+  auto length = static_cast<int64_t>(packet.binary.size());
+  bool complete = true;
+  if (refetched) {
+    // A short reply would leave a hole; it counts as another failed try.
+    complete = length == refetch->second.length;
+    length = refetch->second.length;
+    download_request_map_.erase(refetch->first);
+    task.refetches.erase(refetch);
   } else {
-    stream.open(task.temp_path, std::ios::binary | std::ios::in | std::ios::out);
+    task.next_offset = offset + length;
+    task.unacked_bytes += length;
   }
-  if (!stream.is_open()) {
-    markDownloadFailed(task.file_id, "failed to open temp file");
-    return true;
-  }
-  stream.seekp(offset, std::ios::beg);
-  if (!packet.binary.empty()) {
+
+  std::string error;
+  if (!complete || !chunkMatchesBlocks(meta, packet.binary)) {
+    // Fetch just this chunk again; the stream keeps going meanwhile.
+    if (++task.chunk_retries > kMaxChunkRetries) {
+      markDownloadFailed(task.file_id, complete ? "chunk hash mismatch" : "refetched chunk incomplete");
+      return true;
+    }
+    ++task.lost_chunks;
+    if (!refetchChunk(net, task, offset, length, &error)) {
+      last_error_ = error;
+    }
+  } else if (!packet.binary.empty()) {
+    std::fstream stream(task.temp_path, std::ios::binary | std::ios::in | std::ios::out);
+    if (!stream.is_open()) {
+      markDownloadFailed(task.file_id, "failed to open temp file");
+      return true;
+    }
+    stream.seekp(offset, std::ios::beg);
     stream.write(reinterpret_cast<const char*>(packet.binary.data()),
                  static_cast<std::streamsize>(packet.binary.size()));
+    stream.flush();
   }
-  stream.flush();
-  const int64_t next_offset = offset + static_cast<int64_t>(packet.binary.size());
-  task.next_offset = next_offset;
 
   auto state_it = download_states_.find(task.file_id);
   if (state_it != download_states_.end()) {
-    state_it->second.transferred = next_offset;
+    state_it->second.transferred = task.next_offset;
+  }
+  if (task.next_offset >= task.file_size) {
+    if (task.refetches.empty()) {
+      finishDownload(task);
+    }
+    return true;
   }
 
-  const bool done = meta.value("done", false);
-  if (done || next_offset >= task.file_size) {
-    std::string hash_error;
-    const auto computed = onlinetalk::common::sha256HexFile(task.temp_path, &hash_error);
-    if (!hash_error.empty() || computed != task.sha256) {
-      markDownloadFailed(task.file_id, hash_error.empty() ? "sha256 mismatch" : hash_error);
-      return true;
+  if (task.unacked_bytes >= kDownloadCredit / 2) {
+    if (!sendDownloadCredit(net, task, &error)) {
+      last_error_ = error;
     }
-    std::error_code ec;
-    std::filesystem::rename(task.temp_path, task.final_path, ec);
-    if (ec) {
-      markDownloadFailed(task.file_id, "failed to move download");
+  }
+  return true;
+}
+
+bool FileTransferManager::handlePreviewChunk(NetClient& net,
+                                             const onlinetalk::common::Packet& packet,
+                                             const nlohmann::json& meta) {
+  const auto file_id = preview_request_map_[packet.header.request_id];
+  auto it = preview_tasks_.find(file_id);
+  if (it == preview_tasks_.end()) {
+    return true;
+  }
+  PreviewTask& task = it->second;
+  if (meta.value("offset", task.next_offset) != task.next_offset || packet.binary.empty()) {
+    markPreviewFailed(file_id, "preview offset mismatch");
+    return true;
+  }
+  if (!chunkMatchesBlocks(meta, packet.binary)) {
+    if (++task.chunk_retries > kMaxChunkRetries) {
+      markPreviewFailed(file_id, "chunk hash mismatch");
       return true;
     }
-    task.done = true;
-    if (state_it != download_states_.end()) {
-      state_it->second.done = true;
-      state_it->second.transferred = task.file_size;
+    // Ask again from this chunk; whatever the old request still sends is
+    // dropped.
+    std::string error;
+    if (!sendPreviewRequest(net, file_id, task, &error)) {
+      markPreviewFailed(file_id, error);
     }
     return true;
   }
-
-  std::string error;
-  const auto req_id = net.nextRequestId();
-  if (!sendDownloadRequest(net, task, req_id, &error)) {
-    last_error_ = error;
+  task.data.insert(task.data.end(), packet.binary.begin(), packet.binary.end());
+  task.next_offset += static_cast<int64_t>(packet.binary.size());
+  if (task.next_offset < task.end) {
+    return true;
   }
+  // Drop the block padding the server added around the range.
+  const int64_t start = task.offset - task.offset % onlinetalk::common::kManifestBlockSize;
+  auto& preview = previews_[file_id];
+  preview.data.assign(task.data.begin() + (task.offset - start), task.data.begin() + (task.end - start));
+  preview.done = true;
+  preview_request_map_.erase(task.request_id);
+  preview_tasks_.erase(it);
   return true;
 }
 
-bool FileTransferManager::sendNextChunk(NetClient& net, UploadTask& task, std::string* error) {
-  if (task.chunk_size <= 0) {
+void FileTransferManager::finishDownload(DownloadTask& task) {
+  std::string hash_error;
+  const auto computed = onlinetalk::common::sha256HexFile(task.temp_path, &hash_error);
+  if (!hash_error.empty() || computed != task.sha256) {
+    markDownloadFailed(task.file_id, hash_error.empty() ? "sha256 mismatch" : hash_error);
+    return;
+  }
+  std::error_code ec;
+  std::filesystem::rename(task.temp_path, task.final_path, ec);
+  if (ec) {
+    markDownloadFailed(task.file_id, "failed to move download");
+    return;
+  }
+  task.done = true;
+  download_request_map_.erase(task.request_id);
+  auto state_it = download_states_.find(task.file_id);
+  if (state_it != download_states_.end()) {
+    state_it->second.done = true;
+    state_it->second.transferred = task.file_size;
+  }
+}
+
+bool FileTransferManager::refetchChunk(NetClient& net,
+                                      DownloadTask& task,
+                                      int64_t offset,
+                                      int64_t length,
+                                      std::string* error) {
+  // Chunk sizes vary over a stream and need not fit the chunk size
+  // negotiation, so ask for the failed bytes as a range.
+  nlohmann::json meta;
+  meta["file_id"] = task.file_id;
+  meta["offset"] = offset;
+  meta["length"] = length;
+  meta["compress"] = true;
+  const auto request_id = net.nextRequestId();
+  if (!net.sendJson(onlinetalk::common::PacketType::FileDownloadRequest, request_id, meta, nullptr)) {
     if (error) {
-      *error = "invalid chunk size";
+      *error = "failed to send download request";
     }
     return false;
   }
+  task.refetches[request_id] = ChunkRange{offset, length};
+  download_request_map_[request_id] = task.file_id;
+  return true;
+}
+
+bool FileTransferManager::fillUploadWindow(NetClient& net, UploadTask& task, std::string* error) {
   if (task.next_offset >= task.file_size) {
+    if (task.done_sent) {
+      return true;
+    }
+    task.done_sent = true;
     return sendUploadDone(net, task, error);
   }
+  // The server also caps the chunks in flight, which matters once the
+  // chunk size shrinks.
+  const int64_t limit = task.next_offset + static_cast<int64_t>(task.window) * task.sizer.size();
+  while (task.send_offset < task.file_size && task.send_offset < limit &&
+         task.in_flight.size() < static_cast<size_t>(task.window)) {
+    if (!sendNextChunk(net, task, error)) {
+      return false;
+    }
+  }
+  return true;
+}
 
-  const int64_t remaining = task.file_size - task.next_offset;
-  const int64_t to_read = std::min<int64_t>(remaining, task.chunk_size);
+bool FileTransferManager::sendNextChunk(NetClient& net, UploadTask& task, std::string* error) {
+  int64_t sent = 0;
+  if (!sendChunk(net, task, task.send_offset, task.sizer.size(), &sent, error)) {
+    return false;
+  }
+  task.send_offset += sent;
+  return true;
+}
+
+bool FileTransferManager::sendChunk(NetClient& net,
+                                    UploadTask& task,
+                                    int64_t offset,
+                                    int64_t length,
+                                    int64_t* sent,
+                                    std::string* error) {
+  const int64_t remaining = task.file_size - offset;
+  const int64_t to_read = std::min<int64_t>(remaining, length);
+  if (to_read <= 0) {
+    if (error) {
+      *error = "chunk offset out of range";
+    }
+    return false;
+  }
   std::vector<uint8_t> data(static_cast<size_t>(to_read));
 
   if (!task.stream) {
@@ -558,7 +896,7 @@ bool FileTransferManager::sendNextChunk(NetClient& net, UploadTask& task, std::s
     return false;
   }
   task.stream->clear();
-  task.stream->seekg(task.next_offset, std::ios::beg);
+  task.stream->seekg(offset, std::ios::beg);
   task.stream->read(reinterpret_cast<char*>(data.data()), static_cast<std::streamsize>(to_read));
   const auto read_size = task.stream->gcount();
   if (read_size <= 0) {
@@ -569,15 +907,26 @@ bool FileTransferManager::sendNextChunk(NetClient& net, UploadTask& task, std::s
   }
   data.resize(static_cast<size_t>(read_size));
 
+  // Offsets and the ack's next_offset stay in the file's own bytes.
+  std::vector<uint8_t> deflated;
+  const std::vector<uint8_t>* payload = &data;
+  uint32_t flags = 0;
+  if (task.compress && task.compressor.compress(data.data(), data.size(), &deflated)) {
+    payload = &deflated;
+    flags = onlinetalk::common::PacketHeader::kFlagCompressed;
+  }
+
   nlohmann::json meta;
   meta["file_id"] = task.file_id;
-  meta["offset"] = task.next_offset;
-  if (!net.sendJson(onlinetalk::common::PacketType::FileUploadChunk, task.request_id, meta, &data)) {
+  meta["offset"] = offset;
+  if (!net.sendJson(onlinetalk::common::PacketType::FileUploadChunk, task.request_id, meta, payload, flags)) {
     if (error) {
       *error = "failed to send upload chunk";
     }
     return false;
   }
+  task.in_flight.push_back({offset, static_cast<int64_t>(read_size), steadyMs()});
+  *sent = read_size;
   return true;
 }
 
@@ -594,19 +943,69 @@ bool FileTransferManager::sendUploadDone(NetClient& net, const UploadTask& task,
 }
 
 bool FileTransferManager::sendDownloadRequest(NetClient& net,
-                                              const DownloadTask& task,
+                                              DownloadTask& task,
                                               uint64_t request_id,
                                               std::string* error) {
   nlohmann::json meta;
   meta["file_id"] = task.file_id;
   meta["offset"] = task.next_offset;
+  meta["stream"] = true;
+  meta["credit"] = kDownloadCredit;
+  meta["compress"] = true;
   if (!net.sendJson(onlinetalk::common::PacketType::FileDownloadRequest, request_id, meta, nullptr)) {
     if (error) {
       *error = "failed to send download request";
     }
     return false;
   }
+  download_request_map_.erase(task.request_id);
   download_request_map_[request_id] = task.file_id;
+  task.request_id = request_id;
+  task.unacked_bytes = 0;
+  return true;
+}
+
+bool FileTransferManager::sendDownloadCredit(NetClient& net, DownloadTask& task, std::string* error) {
+  nlohmann::json meta;
+  meta["file_id"] = task.file_id;
+  meta["credit"] = task.unacked_bytes;
+  if (task.lost_chunks > 0) {
+    meta["lost_chunks"] = task.lost_chunks;
+  }
+  if (!net.sendJson(onlinetalk::common::PacketType::FileDownloadCredit, task.request_id, meta, nullptr)) {
+    if (error) {
+      *error = "failed to send download credit";
+    }
+    return false;
+  }
+  task.unacked_bytes = 0;
+  task.lost_chunks = 0;
+  return true;
+}
+
+bool FileTransferManager::sendPreviewRequest(NetClient& net,
+                                             const std::string& file_id,
+                                             PreviewTask& task,
+                                             std::string* error) {
+  const int64_t length = task.end - task.next_offset;
+  nlohmann::json meta;
+  meta["file_id"] = file_id;
+  meta["offset"] = task.next_offset;
+  meta["length"] = length;
+  meta["stream"] = true;
+  meta["compress"] = true;
+  // The server rounds the end up to a whole block.
+  meta["credit"] = length + onlinetalk::common::kManifestBlockSize;
+  const auto request_id = net.nextRequestId();
+  if (!net.sendJson(onlinetalk::common::PacketType::FileDownloadRequest, request_id, meta, nullptr)) {
+    if (error) {
+      *error = "failed to send download request";
+    }
+    return false;
+  }
+  preview_request_map_.erase(task.request_id);
+  preview_request_map_[request_id] = file_id;
+  task.request_id = request_id;
   return true;
 }
 
@@ -628,6 +1027,7 @@ void FileTransferManager::markDownloadFailed(const std::string& file_id, const s
   auto download_it = downloads_.find(file_id);
   if (download_it != downloads_.end()) {
     download_it->second.failed = true;
+    download_request_map_.erase(download_it->second.request_id);
   }
   auto state_it = download_states_.find(file_id);
   if (state_it != download_states_.end()) {
@@ -635,6 +1035,19 @@ void FileTransferManager::markDownloadFailed(const std::string& file_id, const s
   }
 }
 
+void FileTransferManager::markPreviewFailed(const std::string& file_id, const std::string& message) {
+  last_error_ = message;
+  auto task_it = preview_tasks_.find(file_id);
+  if (task_it != preview_tasks_.end()) {
+    preview_request_map_.erase(task_it->second.request_id);
+    preview_tasks_.erase(task_it);
+  }
+  auto preview_it = previews_.find(file_id);
+  if (preview_it != previews_.end()) {
+    preview_it->second.failed = true;
+  }
+}
+
 void FileTransferManager::eraseUploadMapping(const std::string& file_id) {
   for (auto it = upload_request_map_.begin(); it != upload_request_map_.end();) {
     if (it->second == file_id) {
@@ -1,6 +1,7 @@
 #pragma once
 
 #include <cstdint>
+#include <deque>
 #include <fstream>
 #include <memory>
 #include <string>
@@ -11,6 +12,8 @@
 
 #include "client/file_transfer/transfer_state.h"
 #include "client/net/net_client.h"
+#include "common/compress/chunk_compressor.h"
+#include "common/net/chunk_sizer.h"
 
 namespace onlinetalk::client {
 
@@ -43,14 +46,30 @@ class FileTransferManager {
                      uint64_t* request_id,
                      std::string* error);
 
+  // Fetches [offset, offset + length) into memory, checking each chunk
+  // against the file's manifest; length is capped at a megabyte.
+  bool beginPreview(NetClient& net,
+                    const DownloadRequest& request,
+                    int64_t offset,
+                    int64_t length,
+                    uint64_t* request_id,
+                    std::string* error);
+
   bool handlePacket(NetClient& net, const onlinetalk::common::Packet& packet);
   bool resumeTransfers(NetClient& net, std::string* error);
 
   const std::unordered_map<std::string, TransferState>& uploadStates() const;
   const std::unordered_map<std::string, TransferState>& downloadStates() const;
+  const std::unordered_map<std::string, FilePreview>& previews() const;
   const std::string& lastError() const;
 
  private:
+  struct SentChunk {
+    int64_t offset = 0;
+    int64_t length = 0;
+    int64_t sent_ms = 0;
+  };
+
   struct UploadTask {
     uint64_t request_id = 0;
     std::string file_id;
@@ -60,13 +79,29 @@ class FileTransferManager {
     std::string file_name;
     std::string sha256;
     int64_t file_size = 0;
-    int64_t next_offset = 0;
-    int chunk_size = 0;
+    int64_t next_offset = 0;  // acknowledged by the server
+    int64_t send_offset = 0;  // next chunk to put on the wire
+    // Chunk sizes within the bounds from FileAccept, adapted to ack latency
+    // and throughput as the upload runs.
+    onlinetalk::common::ChunkSizer sizer;
+    std::deque<SentChunk> in_flight;  // sent, not yet acked; acks name the offset
+    int window = 1;  // chunks allowed in flight, negotiated in FileAccept
+    bool compress = false;  // the server takes deflated chunks
+    onlinetalk::common::ChunkCompressor compressor;
+    std::vector<uint8_t> manifest;  // packed leaf hashes, sent with every offer
+    std::string manifest_root;
+    int chunk_retries = 0;
     std::shared_ptr<std::ifstream> stream;
+    bool done_sent = false;
     bool done = false;
     bool failed = false;
   };
 
+  struct ChunkRange {
+    int64_t offset = 0;
+    int64_t length = 0;
+  };
+
   struct DownloadTask {
     std::string file_id;
     std::string conversation_type;
@@ -75,28 +110,52 @@ class FileTransferManager {
     std::string sha256;
     int64_t file_size = 0;
     int64_t next_offset = 0;
+    uint64_t request_id = 0;   // the server pushes every chunk under this id
+    int64_t unacked_bytes = 0;  // written since credit was last returned
+    std::unordered_map<uint64_t, ChunkRange> refetches;  // request id -> chunk that failed its hash
+    int chunk_retries = 0;
+    int lost_chunks = 0;  // reported with the next credit so the server sends smaller chunks
     std::string temp_path;
     std::string final_path;
     bool done = false;
     bool failed = false;
   };
 
+  struct PreviewTask {
+    uint64_t request_id = 0;
+    int64_t offset = 0;       // first byte wanted
+    int64_t end = 0;          // one past the last byte wanted
+    int64_t next_offset = 0;  // block aligned; the server widens ranges
+    std::vector<uint8_t> data;  // bytes from the aligned start
+    int chunk_retries = 0;
+  };
+
   bool handleFileAccept(NetClient& net, uint64_t request_id, const nlohmann::json& meta);
   bool handleUploadAck(NetClient& net, uint64_t request_id, const nlohmann::json& meta);
   bool handleDownloadChunk(NetClient& net, const onlinetalk::common::Packet& packet, const nlohmann::json& meta);
+  bool handlePreviewChunk(NetClient& net, const onlinetalk::common::Packet& packet, const nlohmann::json& meta);
 
   void markUploadFailed(const std::string& file_id, const std::string& message);
   void markDownloadFailed(const std::string& file_id, const std::string& message);
   void eraseUploadMapping(const std::string& file_id);
 
+  bool fillUploadWindow(NetClient& net, UploadTask& task, std::string* error);
   bool sendNextChunk(NetClient& net, UploadTask& task, std::string* error);
+  bool sendChunk(NetClient& net, UploadTask& task, int64_t offset, int64_t length, int64_t* sent, std::string* error);
+  bool refetchChunk(NetClient& net, DownloadTask& task, int64_t offset, int64_t length, std::string* error);
+  void finishDownload(DownloadTask& task);
   bool sendUploadDone(NetClient& net, const UploadTask& task, std::string* error);
-  bool sendDownloadRequest(NetClient& net, const DownloadTask& task, uint64_t request_id, std::string* error);
+  bool sendDownloadRequest(NetClient& net, DownloadTask& task, uint64_t request_id, std::string* error);
+  bool sendDownloadCredit(NetClient& net, DownloadTask& task, std::string* error);
+  bool sendPreviewRequest(NetClient& net, const std::string& file_id, PreviewTask& task, std::string* error);
+  void markPreviewFailed(const std::string& file_id, const std::string& message);
 
   static std::string sanitizeFileName(const std::string& name);
   std::string downloadDir(const std::string& conversation_type, const std::string& conversation_id) const;
 
   std::string data_dir_;
+  // Where the last upload's chunk size settled; the next one starts there.
+  int64_t preferred_chunk_size_ = 0;
   std::unordered_map<uint64_t, UploadTask> pending_offers_;
   std::unordered_map<uint64_t, std::string> upload_request_map_;
   std::unordered_map<uint64_t, std::string> download_request_map_;
@@ -104,6 +163,9 @@ class FileTransferManager {
   std::unordered_map<std::string, DownloadTask> downloads_;
   std::unordered_map<std::string, TransferState> upload_states_;
   std::unordered_map<std::string, TransferState> download_states_;
+  std::unordered_map<uint64_t, std::string> preview_request_map_;
+  std::unordered_map<std::string, PreviewTask> preview_tasks_;
+  std::unordered_map<std::string, FilePreview> previews_;
   std::string last_error_;
 };
 
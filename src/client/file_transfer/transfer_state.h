@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <string>
+#include <vector>
 
 namespace onlinetalk::client {
 
@@ -28,4 +29,15 @@ struct TransferState {
   }
 };
 
+// Bytes [offset, offset + data.size()) of a file, fetched without
+// downloading the rest of it.
+struct FilePreview {
+  std::string file_id;
+  std::string file_name;
+  int64_t offset = 0;
+  std::vector<uint8_t> data;
+  bool done = false;
+  bool failed = false;
+};
+
 }  // namespace onlinetalk::client
@@ -47,6 +47,24 @@ uint64_t ClientApi::sendMessage(const std::string& conversation_type,
   return request_id;
 }
 
+uint64_t ClientApi::sendEphemeralMessage(const std::string& conversation_type,
+                                         const std::string& conversation_id,
+                                         const std::string& content,
+                                         int64_t ttl_seconds,
+                                         std::string* error) {
+  nlohmann::json meta;
+  meta["conversation_type"] = conversation_type;
+  meta["conversation_id"] = conversation_id;
+  meta["content"] = content;
+  meta["ephemeral"] = true;
+  meta["ttl_seconds"] = ttl_seconds;
+  uint64_t request_id = 0;
+  if (!sendJson(onlinetalk::common::PacketType::MessageSend, meta, &request_id, error)) {
+    return 0;
+  }
+  return request_id;
+}
+
 uint64_t ClientApi::fetchHistory(const std::string& conversation_type,
                                  const std::string& conversation_id,
                                  int64_t before_message_id,
@@ -64,6 +82,43 @@ uint64_t ClientApi::fetchHistory(const std::string& conversation_type,
   return request_id;
 }
 
+uint64_t ClientApi::fetchHistoryBatch(const std::vector<HistoryRequest>& requests, std::string* error) {
+  nlohmann::json items = nlohmann::json::array();
+  for (const auto& request : requests) {
+    nlohmann::json item;
+    item["conversation_type"] = request.conversation_type;
+    item["conversation_id"] = request.conversation_id;
+    item["before_message_id"] = request.before_message_id;
+    item["limit"] = request.limit;
+    items.push_back(std::move(item));
+  }
+  nlohmann::json meta;
+  meta["conversations"] = std::move(items);
+  uint64_t request_id = 0;
+  if (!sendJson(onlinetalk::common::PacketType::HistoryBatchFetch, meta, &request_id, error)) {
+    return 0;
+  }
+  return request_id;
+}
+
+uint64_t ClientApi::syncConversations(const std::vector<SyncCursor>& cursors, std::string* error) {
+  nlohmann::json items = nlohmann::json::array();
+  for (const auto& cursor : cursors) {
+    nlohmann::json item;
+    item["conversation_type"] = cursor.conversation_type;
+    item["conversation_id"] = cursor.conversation_id;
+    item["last_seq"] = cursor.last_seq;
+    items.push_back(std::move(item));
+  }
+  nlohmann::json meta;
+  meta["conversations"] = std::move(items);
+  uint64_t request_id = 0;
+  if (!sendJson(onlinetalk::common::PacketType::SyncRequest, meta, &request_id, error)) {
+    return 0;
+  }
+  return request_id;
+}
+
 uint64_t ClientApi::createGroup(const std::string& name, std::string* error) {
   nlohmann::json meta;
   meta["name"] = name;
@@ -74,6 +129,18 @@ uint64_t ClientApi::createGroup(const std::string& name, std::string* error) {
   return request_id;
 }
 
+uint64_t ClientApi::createEphemeralGroup(const std::string& name, int64_t message_ttl, std::string* error) {
+  nlohmann::json meta;
+  meta["name"] = name;
+  meta["ephemeral"] = true;
+  meta["message_ttl"] = message_ttl;
+  uint64_t request_id = 0;
+  if (!sendJson(onlinetalk::common::PacketType::GroupCreate, meta, &request_id, error)) {
+    return 0;
+  }
+  return request_id;
+}
+
 uint64_t ClientApi::joinGroup(const std::string& group_id, std::string* error) {
   nlohmann::json meta;
   meta["group_id"] = group_id;
@@ -6,9 +6,17 @@
 #include <nlohmann/json.hpp>
 
 #include "client/net/net_client.h"
+#include "client/state/client_state.h"
 
 namespace onlinetalk::client {
 
+struct HistoryRequest {
+  std::string conversation_type;
+  std::string conversation_id;
+  int64_t before_message_id = 0;
+  int limit = 0;
+};
+
 class ClientApi {
  public:
   explicit ClientApi(NetClient& net);
@@ -24,12 +32,20 @@ class ClientApi {
                        const std::string& conversation_id,
                        const std::string& content,
                        std::string* error);
+  uint64_t sendEphemeralMessage(const std::string& conversation_type,
+                                const std::string& conversation_id,
+                                const std::string& content,
+                                int64_t ttl_seconds,
+                                std::string* error);
   uint64_t fetchHistory(const std::string& conversation_type,
                         const std::string& conversation_id,
                         int64_t before_message_id,
                         int limit,
                         std::string* error);
+  uint64_t fetchHistoryBatch(const std::vector<HistoryRequest>& requests, std::string* error);
+  uint64_t syncConversations(const std::vector<SyncCursor>& cursors, std::string* error);
   uint64_t createGroup(const std::string& name, std::string* error);
+  uint64_t createEphemeralGroup(const std::string& name, int64_t message_ttl, std::string* error);
   uint64_t joinGroup(const std::string& group_id, std::string* error);
   uint64_t leaveGroup(const std::string& group_id, std::string* error);
   uint64_t renameGroup(const std::string& group_id, const std::string& name, std::string* error);
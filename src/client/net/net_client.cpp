@@ -139,22 +139,7 @@ bool tryDecodePacket(onlinetalk::common::ByteBuffer& buffer,
   return true;
 }
 
-}  // namespace
-
-NetClient::NetClient() = default;
-
-NetClient::~NetClient() {
-  stop();
-}
-
-bool NetClient::connectTo(const std::string& host, uint16_t port, std::string* error) {
-  if (socket_fd_ >= 0) {
-    if (error) {
-      *error = "already connected";
-    }
-    return false;
-  }
-
+bool connectSocket(const std::string& host, uint16_t port, int* out_fd, std::string* error) {
   addrinfo hints{};
   hints.ai_family = AF_UNSPEC;
   hints.ai_socktype = SOCK_STREAM;
@@ -201,13 +186,71 @@ bool NetClient::connectTo(const std::string& host, uint16_t port, std::string* e
     }
     return false;
   }
+  *out_fd = fd;
+  return true;
+}
 
-  socket_fd_ = fd;
+bool isFileTraffic(onlinetalk::common::PacketType type) {
+  return type == onlinetalk::common::PacketType::FileOffer ||
+         type == onlinetalk::common::PacketType::FileUploadChunk ||
+         type == onlinetalk::common::PacketType::FileUploadDone ||
+         type == onlinetalk::common::PacketType::FileDownloadRequest ||
+         type == onlinetalk::common::PacketType::FileDownloadCredit;
+}
+
+}  // namespace
+
+NetClient::NetClient() = default;
+
+NetClient::~NetClient() {
+  stop();
+}
+
+bool NetClient::connectTo(const std::string& host, uint16_t port, std::string* error) {
+  if (control_.fd >= 0) {
+    if (error) {
+      *error = "already connected";
+    }
+    return false;
+  }
+  return connectSocket(host, port, &control_.fd, error);
+}
+
+bool NetClient::openDataChannel(const std::string& host,
+                                uint16_t port,
+                                const std::string& token,
+                                std::string* error) {
+  {
+    std::lock_guard<std::mutex> lock(write_mutex_);
+    if (control_.fd < 0 || data_.fd >= 0) {
+      if (error) {
+        *error = control_.fd < 0 ? "not connected" : "data channel already open";
+      }
+      return false;
+    }
+  }
+  int fd = -1;
+  if (!connectSocket(host, port, &fd, error)) {
+    return false;
+  }
+  onlinetalk::common::Packet packet;
+  packet.header.type = static_cast<uint16_t>(onlinetalk::common::PacketType::DataAttach);
+  packet.header.request_id = nextRequestId();
+  packet.meta_json = nlohmann::json{{"token", token}}.dump();
+  auto encoded = onlinetalk::common::Codec::encode(packet);
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  data_.fd = fd;
+  data_.write_buffer.assign(encoded.begin(), encoded.end());
+  data_.write_offset = 0;
   return true;
 }
 
+bool NetClient::takeDataChannelLost() {
+  return data_lost_.exchange(false);
+}
+
 void NetClient::start() {
-  if (running_ || socket_fd_ < 0) {
+  if (running_ || control_.fd < 0) {
     return;
   }
   running_ = true;
@@ -216,15 +259,17 @@ void NetClient::start() {
 
 void NetClient::stop() {
   running_ = false;
-  if (socket_fd_ >= 0) {
-    ::shutdown(socket_fd_, SHUT_RDWR);
+  if (control_.fd >= 0) {
+    ::shutdown(control_.fd, SHUT_RDWR);
   }
   if (io_thread_.joinable()) {
     io_thread_.join();
   }
-  if (socket_fd_ >= 0) {
-    ::close(socket_fd_);
-    socket_fd_ = -1;
+  closeDataChannel();
+  data_lost_ = false;
+  if (control_.fd >= 0) {
+    ::close(control_.fd);
+    control_.fd = -1;
   }
 }
 
@@ -239,12 +284,14 @@ uint64_t NetClient::nextRequestId() {
 bool NetClient::sendPacket(onlinetalk::common::PacketType type,
                            uint64_t request_id,
                            const std::string& meta_json,
-                           const std::vector<uint8_t>* binary) {
-  if (socket_fd_ < 0) {
+                           const std::vector<uint8_t>* binary,
+                           uint32_t flags) {
+  if (control_.fd < 0) {
     return false;
   }
   onlinetalk::common::Packet packet;
   packet.header.type = static_cast<uint16_t>(type);
+  packet.header.flags = flags;
   packet.header.request_id = request_id;
   packet.meta_json = meta_json;
   if (binary) {
@@ -253,7 +300,8 @@ bool NetClient::sendPacket(onlinetalk::common::PacketType type,
   auto encoded = onlinetalk::common::Codec::encode(packet);
   {
     std::lock_guard<std::mutex> lock(write_mutex_);
-    write_buffer_.insert(write_buffer_.end(), encoded.begin(), encoded.end());
+    auto& channel = data_attached_ && isFileTraffic(type) ? data_ : control_;
+    channel.write_buffer.insert(channel.write_buffer.end(), encoded.begin(), encoded.end());
   }
   return true;
 }
@@ -261,8 +309,9 @@ bool NetClient::sendPacket(onlinetalk::common::PacketType type,
 bool NetClient::sendJson(onlinetalk::common::PacketType type,
                          uint64_t request_id,
                          const nlohmann::json& meta,
-                         const std::vector<uint8_t>* binary) {
-  return sendPacket(type, request_id, meta.dump(), binary);
+                         const std::vector<uint8_t>* binary,
+                         uint32_t flags) {
+  return sendPacket(type, request_id, meta.dump(), binary, flags);
 }
 
 bool NetClient::pollPacket(onlinetalk::common::Packet* out) {
@@ -285,18 +334,26 @@ std::string NetClient::lastError() const {
 
 void NetClient::runLoop() {
   while (running_) {
-    short events = POLLIN;
+    pollfd pfds[2]{};
+    nfds_t count = 1;
     {
       std::lock_guard<std::mutex> lock(write_mutex_);
-      if (write_offset_ < write_buffer_.size()) {
-        events |= POLLOUT;
+      pfds[0].fd = control_.fd;
+      pfds[0].events = POLLIN;
+      if (control_.write_offset < control_.write_buffer.size()) {
+        pfds[0].events |= POLLOUT;
+      }
+      if (data_.fd >= 0) {
+        pfds[1].fd = data_.fd;
+        pfds[1].events = POLLIN;
+        if (data_.write_offset < data_.write_buffer.size()) {
+          pfds[1].events |= POLLOUT;
+        }
+        count = 2;
       }
     }
 
-    pollfd pfd{};
-    pfd.fd = socket_fd_;
-    pfd.events = events;
-    const int rc = ::poll(&pfd, 1, kPollTimeoutMs);
+    const int rc = ::poll(pfds, count, kPollTimeoutMs);
     if (rc < 0) {
       if (errno == EINTR) {
         continue;
@@ -307,20 +364,42 @@ void NetClient::runLoop() {
     if (rc == 0) {
       continue;
     }
-    if (pfd.revents & (POLLERR | POLLHUP | POLLNVAL)) {
+    // A broken data channel only costs the bulk path; file traffic falls
+    // back to the control connection.
+    if (count == 2 && pfds[1].revents != 0) {
+      std::string error;
+      bool ok = !(pfds[1].revents & (POLLERR | POLLHUP | POLLNVAL));
+      if (ok && (pfds[1].revents & POLLIN)) {
+        ok = readAvailable(data_, &error);
+      }
+      if (ok && (pfds[1].revents & POLLOUT)) {
+        ok = flushWrite(data_, &error);
+      }
+      if (!ok) {
+        onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                        "data channel closed: " + (error.empty() ? "socket error" : error));
+        const bool was_attached = data_attached_;
+        closeDataChannel();
+        if (was_attached) {
+          data_lost_ = true;
+        }
+      }
+    }
+    const short revents = pfds[0].revents;
+    if (revents & (POLLERR | POLLHUP | POLLNVAL)) {
       setLastError("socket error");
       break;
     }
-    if (pfd.revents & POLLIN) {
+    if (revents & POLLIN) {
       std::string error;
-      if (!readAvailable(&error)) {
+      if (!readAvailable(control_, &error)) {
         setLastError(error.empty() ? "read failed" : error);
         break;
       }
     }
-    if (pfd.revents & POLLOUT) {
+    if (revents & POLLOUT) {
       std::string error;
-      if (!flushWrite(&error)) {
+      if (!flushWrite(control_, &error)) {
         setLastError(error.empty() ? "write failed" : error);
         break;
       }
@@ -329,21 +408,21 @@ void NetClient::runLoop() {
   running_ = false;
 }
 
-bool NetClient::flushWrite(std::string* error) {
+bool NetClient::flushWrite(Channel& channel, std::string* error) {
   std::lock_guard<std::mutex> lock(write_mutex_);
-  while (write_offset_ < write_buffer_.size()) {
-    const auto remaining = write_buffer_.size() - write_offset_;
+  while (channel.write_offset < channel.write_buffer.size()) {
+    const auto remaining = channel.write_buffer.size() - channel.write_offset;
 #ifdef MSG_NOSIGNAL
     const int flags = MSG_NOSIGNAL;
 #else
     const int flags = 0;
 #endif
-    const auto sent = ::send(socket_fd_,
-                             write_buffer_.data() + write_offset_,
+    const auto sent = ::send(channel.fd,
+                             channel.write_buffer.data() + channel.write_offset,
                              remaining,
                              flags);
     if (sent > 0) {
-      write_offset_ += static_cast<size_t>(sent);
+      channel.write_offset += static_cast<size_t>(sent);
       continue;
     }
     if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
@@ -354,19 +433,19 @@ bool NetClient::flushWrite(std::string* error) {
     }
     return false;
   }
-  if (write_offset_ >= write_buffer_.size()) {
-    write_buffer_.clear();
-    write_offset_ = 0;
+  if (channel.write_offset >= channel.write_buffer.size()) {
+    channel.write_buffer.clear();
+    channel.write_offset = 0;
   }
   return true;
 }
 
-bool NetClient::readAvailable(std::string* error) {
+bool NetClient::readAvailable(Channel& channel, std::string* error) {
   while (true) {
     uint8_t buffer[4096];
-    const auto bytes = ::recv(socket_fd_, buffer, sizeof(buffer), 0);
+    const auto bytes = ::recv(channel.fd, buffer, sizeof(buffer), 0);
     if (bytes > 0) {
-      read_buffer_.append(buffer, static_cast<size_t>(bytes));
+      channel.read_buffer.append(buffer, static_cast<size_t>(bytes));
       continue;
     }
     if (bytes == 0) {
@@ -387,7 +466,7 @@ bool NetClient::readAvailable(std::string* error) {
   while (true) {
     onlinetalk::common::Packet packet;
     std::string decode_error;
-    if (!tryDecodePacket(read_buffer_, &packet, &decode_error)) {
+    if (!tryDecodePacket(channel.read_buffer, &packet, &decode_error)) {
       if (!decode_error.empty()) {
         if (error) {
           *error = decode_error;
@@ -396,11 +475,34 @@ bool NetClient::readAvailable(std::string* error) {
       }
       break;
     }
+    if (packet.header.type == static_cast<uint16_t>(onlinetalk::common::PacketType::DataAttach)) {
+      const auto meta = nlohmann::json::parse(packet.meta_json, nullptr, false);
+      if (meta.is_discarded() || meta.value("status", "") != "ok") {
+        if (error) {
+          *error = "data attach rejected";
+        }
+        return false;
+      }
+      data_attached_ = true;
+      continue;
+    }
     queuePacket(std::move(packet));
   }
   return true;
 }
 
+void NetClient::closeDataChannel() {
+  std::lock_guard<std::mutex> lock(write_mutex_);
+  data_attached_ = false;
+  if (data_.fd >= 0) {
+    ::close(data_.fd);
+    data_.fd = -1;
+  }
+  data_.write_buffer.clear();
+  data_.write_offset = 0;
+  data_.read_buffer = onlinetalk::common::ByteBuffer();
+}
+
 void NetClient::queuePacket(onlinetalk::common::Packet&& packet) {
   std::lock_guard<std::mutex> lock(read_mutex_);
   incoming_.push_back(std::move(packet));
@@ -22,6 +22,13 @@ class NetClient {
   ~NetClient();
 
   bool connectTo(const std::string& host, uint16_t port, std::string* error);
+  // Opens a second connection bound to the session by the login token. Once
+  // the server acknowledges it, file traffic moves there so bulk transfers do
+  // not queue behind (or ahead of) chat on the control connection.
+  bool openDataChannel(const std::string& host, uint16_t port, const std::string& token, std::string* error);
+  // True once after the data connection drops; file traffic has fallen back
+  // to the control connection and in-flight transfers need resuming.
+  bool takeDataChannelLost();
   void start();
   void stop();
   bool isRunning() const;
@@ -30,23 +37,32 @@ class NetClient {
   bool sendPacket(onlinetalk::common::PacketType type,
                   uint64_t request_id,
                   const std::string& meta_json,
-                  const std::vector<uint8_t>* binary);
+                  const std::vector<uint8_t>* binary,
+                  uint32_t flags = 0);
   bool sendJson(onlinetalk::common::PacketType type,
                 uint64_t request_id,
                 const nlohmann::json& meta,
-                const std::vector<uint8_t>* binary);
+                const std::vector<uint8_t>* binary,
+                uint32_t flags = 0);
 
   bool pollPacket(onlinetalk::common::Packet* out);
   std::string lastError() const;
 
  private:
+  struct Channel {
+    int fd = -1;
+    std::vector<uint8_t> write_buffer;
+    size_t write_offset = 0;
+    onlinetalk::common::ByteBuffer read_buffer;
+  };
+
   void runLoop();
-  bool flushWrite(std::string* error);
-  bool readAvailable(std::string* error);
+  bool flushWrite(Channel& channel, std::string* error);
+  bool readAvailable(Channel& channel, std::string* error);
+  void closeDataChannel();
   void queuePacket(onlinetalk::common::Packet&& packet);
   void setLastError(const std::string& error);
 
-  int socket_fd_ = -1;
   std::atomic<bool> running_{false};
   std::thread io_thread_;
 
@@ -55,13 +71,16 @@ class NetClient {
   mutable std::mutex error_mutex_;
   std::string last_error_;
 
+  // Guards both channels' fds and write buffers; read buffers belong to the
+  // io thread.
   std::mutex write_mutex_;
-  std::vector<uint8_t> write_buffer_;
-  size_t write_offset_ = 0;
+  Channel control_;
+  Channel data_;
+  std::atomic<bool> data_attached_{false};
+  std::atomic<bool> data_lost_{false};
 
   std::mutex read_mutex_;
   std::deque<onlinetalk::common::Packet> incoming_;
-  onlinetalk::common::ByteBuffer read_buffer_;
 };
 
 }  // namespace onlinetalk::client
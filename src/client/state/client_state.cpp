@@ -1,6 +1,7 @@
 #include "client/state/client_state.h"
 
 #include <algorithm>
+#include <iterator>
 
 namespace onlinetalk::client {
 
@@ -18,12 +19,16 @@ MessageRecord parseMessage(const nlohmann::json& item,
                            const std::string& conversation_id) {
   MessageRecord record;
   record.message_id = item.value("message_id", static_cast<int64_t>(0));
+  record.seq = item.value("seq", static_cast<int64_t>(0));
   record.conversation_type = conversation_type;
   record.conversation_id = conversation_id;
   record.sender_id = item.value("sender_id", "");
   record.sender_nickname = item.value("sender_nickname", "");
   record.content = item.value("content", "");
   record.created_at = item.value("created_at", static_cast<int64_t>(0));
+  record.ephemeral = item.value("ephemeral", false);
+  record.ephemeral_id = item.value("ephemeral_id", static_cast<int64_t>(0));
+  record.expires_at = item.value("expires_at", static_cast<int64_t>(0));
   return record;
 }
 
@@ -105,9 +110,18 @@ void ClientState::applyPacket(const onlinetalk::common::Packet& packet) {
     case onlinetalk::common::PacketType::MessageDeliver:
       applyMessageDeliver(meta);
       break;
+    case onlinetalk::common::PacketType::MessageSend:
+      applyMessageSendAck(packet.header.request_id, meta);
+      break;
     case onlinetalk::common::PacketType::HistoryResponse:
       applyHistoryResponse(meta);
       break;
+    case onlinetalk::common::PacketType::HistoryBatchResponse:
+      applyHistoryBatchResponse(meta);
+      break;
+    case onlinetalk::common::PacketType::SyncResponse:
+      applySyncResponse(meta);
+      break;
     case onlinetalk::common::PacketType::FileDone:
       applyFileNotice(meta);
       break;
@@ -131,6 +145,31 @@ void ClientState::resetHistoryCursor(const std::string& conversation_type,
   history_manager_.reset(conversationKey(conversation_type, conversation_id));
 }
 
+std::vector<SyncCursor> ClientState::syncCursors() const {
+  std::vector<SyncCursor> cursors;
+  for (const auto& entry : conversations_) {
+    const auto& conversation = entry.second;
+    if (conversation.last_seq <= 0) {
+      continue;
+    }
+    cursors.push_back({conversation.conversation_type, conversation.conversation_id, conversation.last_seq});
+  }
+  return cursors;
+}
+
+std::vector<SyncCursor> ClientState::takePendingSyncs() {
+  std::vector<SyncCursor> cursors;
+  for (auto& entry : conversations_) {
+    auto& conversation = entry.second;
+    if (!conversation.sync_pending) {
+      continue;
+    }
+    conversation.sync_pending = false;
+    cursors.push_back({conversation.conversation_type, conversation.conversation_id, conversation.last_seq});
+  }
+  return cursors;
+}
+
 std::string ClientState::conversationKey(const std::string& type, const std::string& id) {
   return type + ":" + id;
 }
@@ -161,6 +200,48 @@ ConversationState& ClientState::ensureConversation(const std::string& conversati
   return inserted.first->second;
 }
 
+void ClientState::insertMessage(ConversationState& conversation, MessageRecord&& record) {
+  // Ephemeral messages have no server id; they are appended in arrival order
+  // and never take part in the id-ordered walk below.
+  if (record.ephemeral) {
+    const auto duplicate = std::find_if(conversation.messages.begin(), conversation.messages.end(),
+                                        [&](const MessageRecord& msg) {
+                                          return msg.ephemeral && msg.ephemeral_id == record.ephemeral_id;
+                                        });
+    if (duplicate == conversation.messages.end()) {
+      conversation.messages.push_back(std::move(record));
+    }
+    return;
+  }
+  auto it = conversation.messages.end();
+  while (it != conversation.messages.begin()) {
+    const auto prev = std::prev(it);
+    if (prev->ephemeral) {
+      it = prev;
+      continue;
+    }
+    if (prev->message_id == record.message_id) {
+      return;
+    }
+    if (prev->message_id < record.message_id) {
+      break;
+    }
+    it = prev;
+  }
+  conversation.messages.insert(it, std::move(record));
+}
+
+void ClientState::noteSeq(ConversationState& conversation, int64_t seq) {
+  if (seq <= 0 || seq <= conversation.last_seq) {
+    return;
+  }
+  if (conversation.last_seq == 0 || seq == conversation.last_seq + 1) {
+    conversation.last_seq = seq;
+    return;
+  }
+  conversation.sync_pending = true;
+}
+
 void ClientState::applyAuthOk(const nlohmann::json& meta) {
   logged_in_ = meta.value("logged_in", false);
   user_id_ = meta.value("user_id", "");
@@ -202,7 +283,38 @@ void ClientState::applyMessageDeliver(const nlohmann::json& meta) {
   }
   auto& conversation = ensureConversation(conversation_type, conversation_id);
   MessageRecord record = parseMessage(meta, conversation_type, conversation_id);
-  conversation.messages.push_back(std::move(record));
+  noteSeq(conversation, record.seq);
+  insertMessage(conversation, std::move(record));
+}
+
+void ClientState::trackSentMessage(uint64_t request_id,
+                                   const std::string& conversation_type,
+                                   const std::string& conversation_id,
+                                   const std::string& content) {
+  sent_messages_[request_id] = {conversation_type, conversation_id, content};
+}
+
+void ClientState::applyMessageSendAck(uint64_t request_id, const nlohmann::json& meta) {
+  auto it = sent_messages_.find(request_id);
+  if (it == sent_messages_.end()) {
+    return;
+  }
+  const SentMessage sent = std::move(it->second);
+  sent_messages_.erase(it);
+  const auto status = meta.value("status", "");
+  if (!status.empty() && status != "ok") {
+    return;
+  }
+  MessageRecord record = parseMessage(meta, sent.conversation_type, sent.conversation_id);
+  if (record.seq <= 0) {
+    return;  // ephemeral; those carry no seq
+  }
+  record.sender_id = user_id_;
+  record.sender_nickname = nickname_;
+  record.content = sent.content;
+  auto& conversation = ensureConversation(sent.conversation_type, sent.conversation_id);
+  noteSeq(conversation, record.seq);
+  insertMessage(conversation, std::move(record));
 }
 
 void ClientState::applyHistoryResponse(const nlohmann::json& meta) {
@@ -228,17 +340,18 @@ void ClientState::applyHistoryResponse(const nlohmann::json& meta) {
     }
   }
 
-  if (conversation.messages.empty()) {
-    for (auto& msg : batch) {
-      conversation.messages.push_back(std::move(msg));
-    }
-  } else if (!batch.empty() && batch.back().message_id < conversation.messages.front().message_id) {
+  if (!batch.empty() && !conversation.messages.empty() &&
+      batch.back().message_id < conversation.messages.front().message_id) {
     for (auto it = batch.rbegin(); it != batch.rend(); ++it) {
       conversation.messages.push_front(*it);
     }
   } else {
+    if (!batch.empty() && batch.back().seq > conversation.last_seq) {
+      conversation.last_seq = batch.back().seq;
+    }
+    conversation.history_loaded = true;
     for (auto& msg : batch) {
-      conversation.messages.push_back(std::move(msg));
+      insertMessage(conversation, std::move(msg));
     }
   }
 
@@ -247,6 +360,58 @@ void ClientState::applyHistoryResponse(const nlohmann::json& meta) {
   history_manager_.update(key, next_before, count);
 }
 
+void ClientState::applyHistoryBatchResponse(const nlohmann::json& meta) {
+  const auto status = meta.value("status", "");
+  if (!status.empty() && status != "ok") {
+    const auto code = meta.value("code", "");
+    const auto message = meta.value("message", "");
+    last_error_ = code.empty() ? message : code + ": " + message;
+    return;
+  }
+  if (!meta.contains("conversations") || !meta["conversations"].is_array()) {
+    return;
+  }
+  // Each entry has the same shape as a single HistoryResponse.
+  for (const auto& entry : meta["conversations"]) {
+    applyHistoryResponse(entry);
+  }
+}
+
+void ClientState::applySyncResponse(const nlohmann::json& meta) {
+  const auto status = meta.value("status", "");
+  if (!status.empty() && status != "ok") {
+    const auto code = meta.value("code", "");
+    const auto message = meta.value("message", "");
+    last_error_ = code.empty() ? message : code + ": " + message;
+    return;
+  }
+  if (!meta.contains("conversations") || !meta["conversations"].is_array()) {
+    return;
+  }
+  for (const auto& entry : meta["conversations"]) {
+    const auto conversation_type = entry.value("conversation_type", "");
+    const auto conversation_id = entry.value("conversation_id", "");
+    if (conversation_type.empty() || conversation_id.empty()) {
+      continue;
+    }
+    if (entry.value("status", "") != "ok") {
+      const auto code = entry.value("code", "");
+      const auto message = entry.value("message", "");
+      last_error_ = code.empty() ? message : code + ": " + message;
+      continue;
+    }
+    auto& conversation = ensureConversation(conversation_type, conversation_id);
+    if (entry.contains("messages") && entry["messages"].is_array()) {
+      for (const auto& item : entry["messages"]) {
+        insertMessage(conversation, parseMessage(item, conversation_type, conversation_id));
+      }
+    }
+    const auto synced_seq = entry.value("synced_seq", static_cast<int64_t>(0));
+    conversation.last_seq = std::max(conversation.last_seq, synced_seq);
+    conversation.sync_pending = entry.value("has_more", false);
+  }
+}
+
 void ClientState::applyFileNotice(const nlohmann::json& meta) {
   FileNotice notice = parseFileNotice(meta);
   if (notice.file_id.empty()) {
@@ -20,12 +20,16 @@ struct UserSummary {
 
 struct MessageRecord {
   int64_t message_id = 0;
+  int64_t seq = 0;
   std::string conversation_type;
   std::string conversation_id;
   std::string sender_id;
   std::string sender_nickname;
   std::string content;
   int64_t created_at = 0;
+  bool ephemeral = false;
+  int64_t ephemeral_id = 0;
+  int64_t expires_at = 0;
 };
 
 struct FileNotice {
@@ -45,6 +49,18 @@ struct ConversationState {
   std::string conversation_id;
   std::deque<MessageRecord> messages;
   std::deque<FileNotice> files;
+  // Highest sequence number up to which the local copy has no holes; 0 until
+  // the newest page of history or a sync response establishes a baseline.
+  int64_t last_seq = 0;
+  bool sync_pending = false;
+  // Set once the newest history page has been applied, e.g. by a prefetch.
+  bool history_loaded = false;
+};
+
+struct SyncCursor {
+  std::string conversation_type;
+  std::string conversation_id;
+  int64_t last_seq = 0;
 };
 
 class ClientState {
@@ -67,8 +83,22 @@ class ClientState {
                       const std::string& conversation_id) const;
   void resetHistoryCursor(const std::string& conversation_type,
                           const std::string& conversation_id);
+  std::vector<SyncCursor> syncCursors() const;
+  std::vector<SyncCursor> takePendingSyncs();
+  // The server does not echo a sender's own messages; the MessageSend ack
+  // carries their seq, and the message is added from what was sent.
+  void trackSentMessage(uint64_t request_id,
+                        const std::string& conversation_type,
+                        const std::string& conversation_id,
+                        const std::string& content);
 
  private:
+  struct SentMessage {
+    std::string conversation_type;
+    std::string conversation_id;
+    std::string content;
+  };
+
   static std::string conversationKey(const std::string& type, const std::string& id);
   static bool parseJson(const std::string& text, nlohmann::json* out, std::string* error);
 
@@ -76,11 +106,16 @@ class ClientState {
   void applyAuthError(const nlohmann::json& meta);
   void applyUserList(const nlohmann::json& meta);
   void applyMessageDeliver(const nlohmann::json& meta);
+  void applyMessageSendAck(uint64_t request_id, const nlohmann::json& meta);
   void applyHistoryResponse(const nlohmann::json& meta);
+  void applyHistoryBatchResponse(const nlohmann::json& meta);
+  void applySyncResponse(const nlohmann::json& meta);
   void applyFileNotice(const nlohmann::json& meta);
 
   ConversationState& ensureConversation(const std::string& conversation_type,
                                         const std::string& conversation_id);
+  static void insertMessage(ConversationState& conversation, MessageRecord&& record);
+  void noteSeq(ConversationState& conversation, int64_t seq);
 
   bool logged_in_ = false;
   std::string user_id_;
@@ -88,6 +123,7 @@ class ClientState {
   std::vector<UserSummary> online_users_;
   std::string last_error_;
   std::unordered_map<std::string, ConversationState> conversations_;
+  std::unordered_map<uint64_t, SentMessage> sent_messages_;  // by request id
   HistoryManager history_manager_;
 };
 
@@ -177,6 +177,9 @@ constexpr int kPadding = 10;
 constexpr int kRowHeight = 24;
 constexpr int kScrollStep = 24;
 constexpr uint32_t kStatusDurationMs = 5000;
+constexpr size_t kMaxSyncBatch = 64;
+constexpr size_t kWarmConversations = 8;
+constexpr int64_t kPreviewBytes = 16 * 1024;
 
 void popBackUtf8(std::string* text) {
   if (!text || text->empty()) {
@@ -512,6 +515,56 @@ void UiApp::processNetwork() {
     state_.applyPacket(packet);
     handlePacket(packet);
   }
+  if (net_.takeDataChannelLost()) {
+    std::string error;
+    transfers_.resumeTransfers(net_, &error);
+  }
+  const auto pending = state_.takePendingSyncs();
+  if (!pending.empty()) {
+    requestSync(pending);
+  }
+}
+
+void UiApp::requestSync(const std::vector<SyncCursor>& cursors) {
+  for (size_t begin = 0; begin < cursors.size(); begin += kMaxSyncBatch) {
+    const auto end = std::min(cursors.size(), begin + kMaxSyncBatch);
+    const std::vector<SyncCursor> batch(cursors.begin() + static_cast<long>(begin),
+                                        cursors.begin() + static_cast<long>(end));
+    std::string error;
+    if (api_.syncConversations(batch, &error) == 0) {
+      setStatusMessage("Sync failed: " + error, theme_.danger, kStatusDurationMs);
+      return;
+    }
+  }
+}
+
+void UiApp::warmConversations() {
+  std::vector<HistoryRequest> requests;
+  auto add = [&](const std::string& type, const std::string& id) {
+    if (requests.size() >= kWarmConversations) {
+      return;
+    }
+    const auto* conversation = state_.getConversation(type, id);
+    if (conversation && conversation->history_loaded) {
+      return;
+    }
+    requests.push_back({type, id, 0, config_.history_page_size});
+  };
+  for (const auto& group : groups_) {
+    add("group", group.group_id);
+  }
+  for (const auto& user : state_.onlineUsers()) {
+    if (user.user_id != state_.userId()) {
+      add("private", user.user_id);
+    }
+  }
+  if (requests.empty()) {
+    return;
+  }
+  std::string error;
+  if (api_.fetchHistoryBatch(requests, &error) == 0) {
+    setStatusMessage("History prefetch failed: " + error, theme_.danger, kStatusDurationMs);
+  }
 }
 
 void UiApp::handlePacket(const onlinetalk::common::Packet& packet) {
@@ -527,6 +580,14 @@ void UiApp::handlePacket(const onlinetalk::common::Packet& packet) {
       setStatusMessage("Registered. Please login.", theme_.ok, kStatusDurationMs);
     } else if (logged_in) {
       setStatusMessage("Login success.", theme_.ok, kStatusDurationMs);
+      const auto token = meta.value("data_token", "");
+      std::string error;
+      if (!token.empty() &&
+          !net_.openDataChannel(config_.server_host, config_.server_port, token, &error)) {
+        onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                        "data channel unavailable: " + error);
+      }
+      warmConversations();
     }
     return;
   }
@@ -635,7 +696,12 @@ void UiApp::updateConnection() {
     if (!saved_user_id_.empty() && !saved_password_.empty()) {
       api_.sendLogin(saved_user_id_, saved_password_, &error);
     }
-    if (!active_type_.empty() && !active_id_.empty()) {
+    const auto cursors = state_.syncCursors();
+    if (!cursors.empty()) {
+      requestSync(cursors);
+    }
+    const auto* active = state_.getConversation(active_type_, active_id_);
+    if (!active_type_.empty() && !active_id_.empty() && (!active || active->last_seq == 0)) {
       state_.resetHistoryCursor(active_type_, active_id_);
       api_.fetchHistory(active_type_, active_id_, 0, config_.history_page_size, &error);
     }
@@ -1321,6 +1387,12 @@ void UiApp::renderInputArea(const UiRect& bounds, const UiInput& input) {
 }
 
 void UiApp::renderFileList(const UiRect& bounds, const UiInput& input) {
+  const auto& previews = transfers_.previews();
+  const auto preview = previews.find(preview_file_id_);
+  if (preview != previews.end()) {
+    renderPreview(bounds, input, preview->second);
+    return;
+  }
   const auto* conversation = state_.getConversation(active_type_, active_id_);
   if (!conversation || conversation->files.empty()) {
     if (auto entry = text_cache_small_->get("No files", theme_.text_muted, 0)) {
@@ -1347,7 +1419,7 @@ void UiApp::renderFileList(const UiRect& bounds, const UiInput& input) {
     }
 
     const std::string label = notice.file_name + " (" + formatBytes(notice.file_size) + ")";
-    if (auto entry = text_cache_small_->get(label, theme_.text, bounds.w - 80)) {
+    if (auto entry = text_cache_small_->get(label, theme_.text, bounds.w - 130)) {
       SDL_Rect dst{row.x + 4, row.y + 4, entry->w, entry->h};
       SDL_RenderCopy(renderer_, entry->texture, nullptr, &dst);
     }
@@ -1372,10 +1444,71 @@ void UiApp::renderFileList(const UiRect& bounds, const UiInput& input) {
         onDownloadFile(notice);
       }
     }
+
+    UiRect peek{btn.x - 50, btn.y, 46, btn.h};
+    SDL_SetRenderDrawColor(renderer_, theme_.button.r, theme_.button.g, theme_.button.b, theme_.button.a);
+    SDL_Rect peek_rect = peek.toSdl();
+    SDL_RenderFillRect(renderer_, &peek_rect);
+    if (auto entry = text_cache_small_->get("Peek", theme_.text, 0)) {
+      SDL_Rect dst{peek.x + 6, peek.y + 4, entry->w, entry->h};
+      SDL_RenderCopy(renderer_, entry->texture, nullptr, &dst);
+    }
+    if (input.mouse_clicked && peek.contains(input.mouse_x, input.mouse_y)) {
+      onPreviewFile(notice);
+    }
     y += kRowHeight;
   }
 }
 
+void UiApp::renderPreview(const UiRect& bounds, const UiInput& input, const FilePreview& preview) {
+  SDL_SetRenderDrawColor(renderer_, theme_.panel_alt.r, theme_.panel_alt.g, theme_.panel_alt.b, theme_.panel_alt.a);
+  SDL_Rect panel = bounds.toSdl();
+  SDL_RenderFillRect(renderer_, &panel);
+  std::string title = preview.file_name;
+  SDL_Color title_color = theme_.text_muted;
+  if (preview.failed) {
+    title += " - preview failed";
+    title_color = theme_.danger;
+  } else if (!preview.done) {
+    title += " - loading...";
+  }
+  int y = bounds.y + 4;
+  if (auto entry = text_cache_small_->get(title, title_color, bounds.w - 8)) {
+    SDL_Rect dst{bounds.x + 4, y, entry->w, entry->h};
+    SDL_RenderCopy(renderer_, entry->texture, nullptr, &dst);
+  }
+  y += 18;
+  // One line of text per row; control bytes are shown as '.' so binary files
+  // still render.
+  std::string line;
+  auto flush = [&] {
+    if (!line.empty() && y + 16 <= bounds.y + bounds.h) {
+      if (auto entry = text_cache_small_->get(line, theme_.text, bounds.w - 8)) {
+        SDL_Rect dst{bounds.x + 4, y, entry->w, entry->h};
+        SDL_RenderCopy(renderer_, entry->texture, nullptr, &dst);
+      }
+    }
+    y += 16;
+    line.clear();
+  };
+  for (const auto byte : preview.data) {
+    if (y + 16 > bounds.y + bounds.h) {
+      break;
+    }
+    if (byte == '\n') {
+      flush();
+    } else if (byte == '\t') {
+      line += "  ";
+    } else if (byte != '\r') {
+      line.push_back(byte < 0x20 || byte == 0x7f ? '.' : static_cast<char>(byte));
+    }
+  }
+  flush();
+  if (input.mouse_clicked && bounds.contains(input.mouse_x, input.mouse_y)) {
+    preview_file_id_.clear();
+  }
+}
+
 void UiApp::renderTransfers(const UiRect& bounds, const UiInput& input) {
   int y = bounds.y;
   const int bar_w = bounds.w - 8;
@@ -1431,6 +1564,10 @@ void UiApp::selectConversation(const std::string& type, const std::string& id) {
   message_scroll_y_ = 0;
   stick_to_bottom_ = true;
   last_message_count_ = 0;
+  const auto* conversation = state_.getConversation(type, id);
+  if (conversation && conversation->history_loaded) {
+    return;
+  }
   state_.resetHistoryCursor(type, id);
   std::string error;
   if (api_.fetchHistory(type, id, 0, config_.history_page_size, &error) == 0) {
@@ -1483,10 +1620,12 @@ void UiApp::onSendMessage() {
     return;
   }
   std::string error;
-  if (api_.sendMessage(active_type_, active_id_, chat_input_.value, &error) == 0) {
+  const auto request_id = api_.sendMessage(active_type_, active_id_, chat_input_.value, &error);
+  if (request_id == 0) {
     setStatusMessage("Send failed: " + error, theme_.danger, kStatusDurationMs);
     return;
   }
+  state_.trackSentMessage(request_id, active_type_, active_id_, chat_input_.value);
   chat_input_.value.clear();
 }
 
@@ -1592,6 +1731,22 @@ void UiApp::onDownloadFile(const FileNotice& notice) {
   setStatusMessage("Download started.", theme_.ok, kStatusDurationMs);
 }
 
+void UiApp::onPreviewFile(const FileNotice& notice) {
+  DownloadRequest req;
+  req.conversation_type = notice.conversation_type;
+  req.conversation_id = notice.conversation_id;
+  req.file_id = notice.file_id;
+  req.file_name = notice.file_name;
+  req.file_size = notice.file_size;
+  req.sha256 = notice.sha256;
+  std::string error;
+  if (!transfers_.beginPreview(net_, req, 0, kPreviewBytes, nullptr, &error)) {
+    setStatusMessage("Preview failed: " + error, theme_.danger, kStatusDurationMs);
+    return;
+  }
+  preview_file_id_ = notice.file_id;
+}
+
 bool UiApp::hasFocus(const TextInput& input) const {
   return focused_input_ == &input;
 }
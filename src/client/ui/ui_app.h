@@ -43,6 +43,8 @@ class UiApp {
   bool handleKeyDown(SDL_Keycode key);
   void processNetwork();
   void handlePacket(const onlinetalk::common::Packet& packet);
+  void requestSync(const std::vector<SyncCursor>& cursors);
+  void warmConversations();
   void updateConnection();
   void renderFrame(const UiInput& input);
 
@@ -65,6 +67,8 @@ class UiApp {
   void onSendFile();
   void onGroupAction(const PendingGroupAction& action);
   void onDownloadFile(const FileNotice& notice);
+  void onPreviewFile(const FileNotice& notice);
+  void renderPreview(const UiRect& bounds, const UiInput& input, const FilePreview& preview);
 
   bool hasFocus(const TextInput& input) const;
   void setFocus(TextInput* input);
@@ -109,6 +113,7 @@ class UiApp {
   int user_scroll_y_ = 0;
   int group_scroll_y_ = 0;
   int file_scroll_y_ = 0;
+  std::string preview_file_id_;
 
   std::vector<GroupEntry> groups_;
   std::unordered_map<uint64_t, PendingGroupAction> group_requests_;
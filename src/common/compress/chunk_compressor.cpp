@@ -0,0 +1,81 @@
+#include "common/compress/chunk_compressor.h"
+
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <string>
+
+#include <zlib.h>
+
+#include "common/compress/deflate.h"
+
+namespace onlinetalk::common {
+
+namespace {
+
+constexpr size_t kSampleBytes = 16 * 1024;
+// Already-compressed formats sit close to 8 bits per byte; text, CSV and
+// source are well below 6.
+constexpr double kMaxEntropyBits = 7.2;
+// A compressed chunk has to save at least 1/8 of its size to be sent.
+constexpr size_t kMinSavingShift = 3;
+constexpr int kMaxMisses = 4;
+
+}  // namespace
+
+double sampleEntropy(const uint8_t* data, size_t size) {
+  const size_t sample = std::min(size, kSampleBytes);
+  if (sample == 0) {
+    return 0.0;
+  }
+  std::array<uint32_t, 256> counts{};
+  for (size_t i = 0; i < sample; ++i) {
+    ++counts[data[i]];
+  }
+  double bits = 0.0;
+  for (const auto count : counts) {
+    if (count > 0) {
+      const double p = static_cast<double>(count) / static_cast<double>(sample);
+      bits -= p * std::log2(p);
+    }
+  }
+  return bits;
+}
+
+ChunkCompressor::ChunkCompressor(const ChunkCompressor& other)
+    : verdict_(other.verdict_.load(std::memory_order_relaxed)), misses_(other.misses_) {}
+
+ChunkCompressor& ChunkCompressor::operator=(const ChunkCompressor& other) {
+  verdict_.store(other.verdict_.load(std::memory_order_relaxed), std::memory_order_relaxed);
+  misses_ = other.misses_;
+  return *this;
+}
+
+bool ChunkCompressor::active() const {
+  return verdict_.load(std::memory_order_relaxed) != Verdict::Skip;
+}
+
+bool ChunkCompressor::compress(const uint8_t* data, size_t size, std::vector<uint8_t>* out) {
+  auto verdict = verdict_.load(std::memory_order_relaxed);
+  if (verdict == Verdict::Unknown) {
+    verdict = sampleEntropy(data, size) <= kMaxEntropyBits ? Verdict::Compress : Verdict::Skip;
+    verdict_.store(verdict, std::memory_order_relaxed);
+  }
+  if (verdict == Verdict::Skip || size == 0) {
+    return false;
+  }
+  std::string error;
+  if (!deflateRaw(data, size, {}, Z_BEST_SPEED, out, &error)) {
+    return false;
+  }
+  if (out->size() > size - (size >> kMinSavingShift)) {
+    if (++misses_ >= kMaxMisses) {
+      verdict_.store(Verdict::Skip, std::memory_order_relaxed);
+    }
+    return false;
+  }
+  misses_ = 0;
+  return true;
+}
+
+}  // namespace onlinetalk::common
@@ -0,0 +1,41 @@
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace onlinetalk::common {
+
+// Decides, for one transfer, which file chunks go over the wire deflated.
+// The byte entropy of the first chunk settles whether the transfer is worth
+// compressing at all, so JPEGs, archives and video are skipped without
+// spending a deflate pass on them. After that each chunk is sent deflated
+// only when it shrinks enough, and a run of chunks that do not shrink turns
+// compression off for the rest of the transfer.
+// compress() is not thread-safe; a transfer's chunks are compressed in order.
+// active() may be read from another thread.
+class ChunkCompressor {
+ public:
+  ChunkCompressor() = default;
+  ChunkCompressor(const ChunkCompressor& other);
+  ChunkCompressor& operator=(const ChunkCompressor& other);
+
+  // Fills `out` with a raw DEFLATE stream of the chunk and returns true when
+  // it should be sent compressed.
+  bool compress(const uint8_t* data, size_t size, std::vector<uint8_t>* out);
+  // False once compression is off for good; later chunks can skip the
+  // compressor entirely.
+  bool active() const;
+
+ private:
+  enum class Verdict { Unknown, Compress, Skip };
+
+  std::atomic<Verdict> verdict_{Verdict::Unknown};
+  int misses_ = 0;  // chunks in a row that did not shrink
+};
+
+// Bits of entropy per byte over a sample from the start of `data`.
+double sampleEntropy(const uint8_t* data, size_t size);
+
+}  // namespace onlinetalk::common
@@ -0,0 +1,118 @@
+#include "common/compress/deflate.h"
+
+#include <algorithm>
+
+#include <zlib.h>
+
+namespace onlinetalk::common {
+
+namespace {
+
+constexpr int kRawWindowBits = -15;
+constexpr size_t kInflateStep = 16 * 1024;
+
+}  // namespace
+
+bool deflateRaw(const uint8_t* data,
+                size_t size,
+                const std::string& dictionary,
+                int level,
+                std::vector<uint8_t>* out,
+                std::string* error) {
+  if (!out) {
+    if (error) {
+      *error = "output is null";
+    }
+    return false;
+  }
+  z_stream stream{};
+  if (deflateInit2(&stream, level, Z_DEFLATED, kRawWindowBits, 8, Z_DEFAULT_STRATEGY) != Z_OK) {
+    if (error) {
+      *error = "deflateInit2 failed";
+    }
+    return false;
+  }
+  if (!dictionary.empty() &&
+      deflateSetDictionary(&stream,
+                           reinterpret_cast<const Bytef*>(dictionary.data()),
+                           static_cast<uInt>(dictionary.size())) != Z_OK) {
+    deflateEnd(&stream);
+    if (error) {
+      *error = "deflateSetDictionary failed";
+    }
+    return false;
+  }
+  out->resize(deflateBound(&stream, static_cast<uLong>(size)));
+  stream.next_in = const_cast<Bytef*>(data);
+  stream.avail_in = static_cast<uInt>(size);
+  stream.next_out = out->data();
+  stream.avail_out = static_cast<uInt>(out->size());
+  const int rc = deflate(&stream, Z_FINISH);
+  const auto written = stream.total_out;
+  deflateEnd(&stream);
+  if (rc != Z_STREAM_END) {
+    if (error) {
+      *error = "deflate failed";
+    }
+    return false;
+  }
+  out->resize(written);
+  return true;
+}
+
+bool inflateRaw(const uint8_t* data,
+                size_t size,
+                const std::string& dictionary,
+                size_t max_size,
+                std::vector<uint8_t>* out,
+                std::string* error) {
+  if (!out) {
+    if (error) {
+      *error = "output is null";
+    }
+    return false;
+  }
+  z_stream stream{};
+  if (inflateInit2(&stream, kRawWindowBits) != Z_OK) {
+    if (error) {
+      *error = "inflateInit2 failed";
+    }
+    return false;
+  }
+  if (!dictionary.empty() &&
+      inflateSetDictionary(&stream,
+                           reinterpret_cast<const Bytef*>(dictionary.data()),
+                           static_cast<uInt>(dictionary.size())) != Z_OK) {
+    inflateEnd(&stream);
+    if (error) {
+      *error = "inflateSetDictionary failed";
+    }
+    return false;
+  }
+  stream.next_in = const_cast<Bytef*>(data);
+  stream.avail_in = static_cast<uInt>(size);
+  out->clear();
+  int rc = Z_OK;
+  while (rc == Z_OK) {
+    const size_t used = out->size();
+    if (used >= max_size) {
+      rc = Z_BUF_ERROR;
+      break;
+    }
+    out->resize(std::min(max_size, used + std::max(kInflateStep, size * 4)));
+    stream.next_out = out->data() + used;
+    stream.avail_out = static_cast<uInt>(out->size() - used);
+    rc = inflate(&stream, Z_NO_FLUSH);
+    out->resize(out->size() - stream.avail_out);
+  }
+  inflateEnd(&stream);
+  if (rc != Z_STREAM_END) {
+    if (error) {
+      *error = rc == Z_BUF_ERROR ? "inflated data exceeds limit or is truncated" : "inflate failed";
+    }
+    return false;
+  }
+  return true;
+}
+
+}  // namespace onlinetalk::common
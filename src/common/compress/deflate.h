@@ -0,0 +1,25 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace onlinetalk::common {
+
+// Raw DEFLATE streams (no zlib header or checksum) with an optional preset
+// dictionary. The same dictionary must be supplied to inflate.
+bool deflateRaw(const uint8_t* data,
+                size_t size,
+                const std::string& dictionary,
+                int level,
+                std::vector<uint8_t>* out,
+                std::string* error);
+bool inflateRaw(const uint8_t* data,
+                size_t size,
+                const std::string& dictionary,
+                size_t max_size,
+                std::vector<uint8_t>* out,
+                std::string* error);
+
+}  // namespace onlinetalk::common
@@ -63,13 +63,37 @@ ServerConfig loadServerConfig(const std::string& path) {
   cfg.db_path = readRequired<std::string>(json, "db_path");
   cfg.log_level = readOptional<std::string>(json, "log_level", "info");
   cfg.thread_pool_size = readOptional<int>(json, "thread_pool_size", 4);
+  cfg.auth_queue_size = readOptional<int>(json, "auth_queue_size", 64);
+  cfg.file_io_threads = readOptional<int>(json, "file_io_threads", 2);
+  cfg.file_io_queue_bytes = readOptional<int64_t>(json, "file_io_queue_bytes", 64 * 1024 * 1024);
+  cfg.bcrypt_target_ms = readOptional<int>(json, "bcrypt_target_ms", 250);
   cfg.max_clients = readOptional<int>(json, "max_clients", 1000);
   cfg.history_page_size = readOptional<int>(json, "history_page_size", 100);
   cfg.file_chunk_size = readOptional<int>(json, "file_chunk_size", 65536);
+  cfg.file_chunk_size_max = readOptional<int>(json, "file_chunk_size_max", 1024 * 1024);
+  cfg.upload_window_chunks = readOptional<int>(json, "upload_window_chunks", 16);
+  cfg.file_compression = readOptional<bool>(json, "file_compression", true);
+  cfg.upload_checkpoint_bytes = readOptional<int64_t>(json, "upload_checkpoint_bytes", 8 * 1024 * 1024);
+  cfg.upload_ttl_seconds = readOptional<int64_t>(json, "upload_ttl_seconds", 7 * 24 * 3600);
+  cfg.user_quota_bytes = readOptional<int64_t>(json, "user_quota_bytes", 10LL * 1024 * 1024 * 1024);
+  cfg.group_quota_bytes = readOptional<int64_t>(json, "group_quota_bytes", 50LL * 1024 * 1024 * 1024);
+  cfg.disk_reserve_bytes = readOptional<int64_t>(json, "disk_reserve_bytes", 1024LL * 1024 * 1024);
+  cfg.purge_batch_size = readOptional<int>(json, "purge_batch_size", 500);
+  cfg.message_compression = readOptional<bool>(json, "message_compression", false);
+  cfg.ephemeral_backlog_size = readOptional<int>(json, "ephemeral_backlog_size", 100);
 
   if (cfg.thread_pool_size <= 0) {
     throw ConfigError("thread_pool_size must be positive");
   }
+  if (cfg.auth_queue_size <= 0) {
+    throw ConfigError("auth_queue_size must be positive");
+  }
+  if (cfg.file_io_threads <= 0) {
+    throw ConfigError("file_io_threads must be positive");
+  }
+  if (cfg.bcrypt_target_ms <= 0) {
+    throw ConfigError("bcrypt_target_ms must be positive");
+  }
   if (cfg.max_clients <= 0) {
     throw ConfigError("max_clients must be positive");
   }
@@ -79,6 +103,36 @@ ServerConfig loadServerConfig(const std::string& path) {
   if (cfg.file_chunk_size <= 0) {
     throw ConfigError("file_chunk_size must be positive");
   }
+  if (cfg.file_chunk_size_max < cfg.file_chunk_size) {
+    throw ConfigError("file_chunk_size_max must be at least file_chunk_size");
+  }
+  if (cfg.upload_window_chunks <= 0) {
+    throw ConfigError("upload_window_chunks must be positive");
+  }
+  if (cfg.file_io_queue_bytes < cfg.file_chunk_size_max) {
+    throw ConfigError("file_io_queue_bytes must be at least file_chunk_size_max");
+  }
+  if (cfg.upload_checkpoint_bytes <= 0) {
+    throw ConfigError("upload_checkpoint_bytes must be positive");
+  }
+  if (cfg.upload_ttl_seconds <= 0) {
+    throw ConfigError("upload_ttl_seconds must be positive");
+  }
+  if (cfg.user_quota_bytes <= 0) {
+    throw ConfigError("user_quota_bytes must be positive");
+  }
+  if (cfg.group_quota_bytes <= 0) {
+    throw ConfigError("group_quota_bytes must be positive");
+  }
+  if (cfg.disk_reserve_bytes <= 0) {
+    throw ConfigError("disk_reserve_bytes must be positive");
+  }
+  if (cfg.purge_batch_size <= 0) {
+    throw ConfigError("purge_batch_size must be positive");
+  }
+  if (cfg.ephemeral_backlog_size <= 0) {
+    throw ConfigError("ephemeral_backlog_size must be positive");
+  }
   return cfg;
 }
 
@@ -13,9 +13,24 @@ struct ServerConfig {
   std::string db_path;
   std::string log_level;
   int thread_pool_size = 4;
+  int auth_queue_size = 64;
+  int file_io_threads = 2;
+  int64_t file_io_queue_bytes = 64 * 1024 * 1024;
+  int bcrypt_target_ms = 250;
   int max_clients = 1000;
   int history_page_size = 100;
   int file_chunk_size = 65536;
+  int file_chunk_size_max = 1024 * 1024;
+  int upload_window_chunks = 16;
+  bool file_compression = true;
+  int64_t upload_checkpoint_bytes = 8 * 1024 * 1024;
+  int64_t upload_ttl_seconds = 7 * 24 * 3600;
+  int64_t user_quota_bytes = 10LL * 1024 * 1024 * 1024;
+  int64_t group_quota_bytes = 50LL * 1024 * 1024 * 1024;
+  int64_t disk_reserve_bytes = 1024LL * 1024 * 1024;
+  int purge_batch_size = 500;
+  bool message_compression = false;
+  int ephemeral_backlog_size = 100;
 };
 
 struct ClientConfig {
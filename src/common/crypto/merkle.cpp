@@ -0,0 +1,153 @@
+#include "common/crypto/merkle.h"
+
+#include <algorithm>
+#include <cstring>
+#include <fstream>
+
+#include "common/crypto/sha256.h"
+#include "common/fs.h"
+
+namespace onlinetalk::common {
+
+namespace {
+
+// Blocks read per pass when the file cannot be mapped.
+constexpr size_t kStreamBlocks = 256;
+
+ManifestDigest hashNode(const ManifestDigest& left, const ManifestDigest& right) {
+  const uint8_t prefix = 0x01;
+  return sha256Digest({{&prefix, 1}, {left.data(), left.size()}, {right.data(), right.size()}});
+}
+
+std::vector<Sha256Input> blockInputs(const uint8_t* data, size_t size) {
+  std::vector<Sha256Input> inputs;
+  inputs.reserve(manifestLeafCount(static_cast<int64_t>(size)));
+  for (size_t done = 0; done < size; done += static_cast<size_t>(kManifestBlockSize)) {
+    inputs.push_back({data + done, std::min(static_cast<size_t>(kManifestBlockSize), size - done)});
+  }
+  return inputs;
+}
+
+int hexValue(char ch) {
+  if (ch >= '0' && ch <= '9') {
+    return ch - '0';
+  }
+  if (ch >= 'a' && ch <= 'f') {
+    return ch - 'a' + 10;
+  }
+  if (ch >= 'A' && ch <= 'F') {
+    return ch - 'A' + 10;
+  }
+  return -1;
+}
+
+}  // namespace
+
+size_t manifestLeafCount(int64_t file_size) {
+  if (file_size <= 0) {
+    return 0;
+  }
+  return static_cast<size_t>((file_size + kManifestBlockSize - 1) / kManifestBlockSize);
+}
+
+ManifestDigest manifestLeaf(const uint8_t* data, size_t size) {
+  const uint8_t prefix = 0x00;
+  return sha256Digest({{&prefix, 1}, {data, size}});
+}
+
+ManifestDigest manifestRoot(const std::vector<ManifestDigest>& leaves) {
+  if (leaves.empty()) {
+    return manifestLeaf(nullptr, 0);
+  }
+  std::vector<ManifestDigest> level = leaves;
+  while (level.size() > 1) {
+    std::vector<ManifestDigest> next;
+    next.reserve((level.size() + 1) / 2);
+    for (size_t i = 0; i + 1 < level.size(); i += 2) {
+      next.push_back(hashNode(level[i], level[i + 1]));
+    }
+    if (level.size() % 2 == 1) {
+      next.push_back(level.back());
+    }
+    level.swap(next);
+  }
+  return level.front();
+}
+
+bool buildManifest(const std::string& path,
+                   unsigned threads,
+                   std::vector<ManifestDigest>* leaves,
+                   std::string* error,
+                   bool map_file) {
+  const std::vector<uint8_t> prefix{0x00};
+  MappedFile mapped;
+  if (map_file && mapped.open(path, nullptr)) {
+    *leaves = sha256Many(blockInputs(mapped.data(), mapped.size()), threads, prefix);
+    return true;
+  }
+
+  std::ifstream file(path, std::ios::binary);
+  if (!file.is_open()) {
+    if (error) {
+      *error = "failed to open file: " + path;
+    }
+    return false;
+  }
+  leaves->clear();
+  std::vector<char> buffer(kStreamBlocks * static_cast<size_t>(kManifestBlockSize));
+  while (file.good()) {
+    file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+    const auto read_size = static_cast<size_t>(file.gcount());
+    const auto digests =
+        sha256Many(blockInputs(reinterpret_cast<const uint8_t*>(buffer.data()), read_size), threads, prefix);
+    leaves->insert(leaves->end(), digests.begin(), digests.end());
+  }
+  if (file.bad()) {
+    if (error) {
+      *error = "failed while reading file: " + path;
+    }
+    return false;
+  }
+  return true;
+}
+
+std::string manifestDigestHex(const ManifestDigest& digest) {
+  return hexEncode(digest.data(), digest.size());
+}
+
+bool manifestDigestFromHex(const std::string& hex, ManifestDigest* digest) {
+  if (hex.size() != digest->size() * 2) {
+    return false;
+  }
+  for (size_t i = 0; i < digest->size(); ++i) {
+    const int high = hexValue(hex[i * 2]);
+    const int low = hexValue(hex[i * 2 + 1]);
+    if (high < 0 || low < 0) {
+      return false;
+    }
+    (*digest)[i] = static_cast<uint8_t>((high << 4) | low);
+  }
+  return true;
+}
+
+std::vector<uint8_t> packManifest(const std::vector<ManifestDigest>& leaves) {
+  std::vector<uint8_t> out;
+  out.reserve(leaves.size() * sizeof(ManifestDigest));
+  for (const auto& leaf : leaves) {
+    out.insert(out.end(), leaf.begin(), leaf.end());
+  }
+  return out;
+}
+
+bool unpackManifest(const uint8_t* data, size_t size, std::vector<ManifestDigest>* leaves) {
+  if (size % sizeof(ManifestDigest) != 0) {
+    return false;
+  }
+  leaves->resize(size / sizeof(ManifestDigest));
+  for (size_t i = 0; i < leaves->size(); ++i) {
+    std::memcpy((*leaves)[i].data(), data + i * sizeof(ManifestDigest), sizeof(ManifestDigest));
+  }
+  return true;
+}
+
+}  // namespace onlinetalk::common
@@ -0,0 +1,37 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace onlinetalk::common {
+
+// Leaf size of a file manifest. Transfer chunks that are a multiple of it
+// can be checked as soon as they arrive.
+constexpr int64_t kManifestBlockSize = 64 * 1024;
+
+using ManifestDigest = std::array<uint8_t, 32>;
+
+size_t manifestLeafCount(int64_t file_size);
+// SHA-256 over 0x00 || block.
+ManifestDigest manifestLeaf(const uint8_t* data, size_t size);
+// Root of the binary tree over `leaves`. Interior nodes hash
+// 0x01 || left || right; an unpaired node moves up unchanged.
+ManifestDigest manifestRoot(const std::vector<ManifestDigest>& leaves);
+// Hashes every block of a file, splitting the blocks across up to `threads`
+// workers. `map_file` as for sha256HexFile().
+bool buildManifest(const std::string& path,
+                   unsigned threads,
+                   std::vector<ManifestDigest>* leaves,
+                   std::string* error,
+                   bool map_file = false);
+
+std::string manifestDigestHex(const ManifestDigest& digest);
+bool manifestDigestFromHex(const std::string& hex, ManifestDigest* digest);
+// Leaves back to back, 32 bytes each, as sent on the wire and stored.
+std::vector<uint8_t> packManifest(const std::vector<ManifestDigest>& leaves);
+bool unpackManifest(const uint8_t* data, size_t size, std::vector<ManifestDigest>* leaves);
+
+}  // namespace onlinetalk::common
@@ -1,67 +1,260 @@
 #include "common/crypto/sha256.h"
 
+#include <algorithm>
+#include <atomic>
+#include <cstring>
 #include <fstream>
-#include <iomanip>
-#include <sstream>
+#include <memory>
+#include <thread>
 
+#include <openssl/crypto.h>
+#include <openssl/evp.h>
 #include <openssl/sha.h>
 
+#include "common/fs.h"
+
 namespace onlinetalk::common {
 
 namespace {
 
-std::string digestToHex(const unsigned char* digest, size_t size) {
-  std::ostringstream ss;
-  ss << std::hex << std::setfill('0');
-  for (size_t i = 0; i < size; ++i) {
-    ss << std::setw(2) << static_cast<int>(digest[i]);
+// Below this much input a single thread is faster than starting workers.
+constexpr size_t kMinBytesPerWorker = 4 * 1024 * 1024;
+constexpr size_t kFileReadSize = 1024 * 1024;
+// Saved hasher state: version, eight chaining words and the byte count, all
+// big-endian, then the bytes of the unfinished block.
+constexpr uint8_t kHasherStateVersion = 1;
+constexpr size_t kHasherBlockSize = 64;
+constexpr size_t kHasherStateHeader = 1 + 8 * 4 + 8;
+
+using DigestContext = std::unique_ptr<EVP_MD_CTX, decltype(&EVP_MD_CTX_free)>;
+
+DigestContext newContext() {
+  return DigestContext(EVP_MD_CTX_new(), &EVP_MD_CTX_free);
+}
+
+constexpr std::array<char, 512> makeHexTable() {
+  constexpr char kDigits[] = "0123456789abcdef";
+  std::array<char, 512> table{};
+  for (size_t i = 0; i < 256; ++i) {
+    table[i * 2] = kDigits[i >> 4];
+    table[i * 2 + 1] = kDigits[i & 0x0f];
   }
-  return ss.str();
+  return table;
 }
 
+constexpr std::array<char, 512> kHexTable = makeHexTable();
+
 }  // namespace
 
+std::string hexEncode(const uint8_t* data, size_t size) {
+  std::string out(size * 2, '0');
+  for (size_t i = 0; i < size; ++i) {
+    std::memcpy(&out[i * 2], &kHexTable[static_cast<size_t>(data[i]) * 2], 2);
+  }
+  return out;
+}
+
 std::string sha256Hex(const std::vector<uint8_t>& data) {
-  unsigned char digest[SHA256_DIGEST_LENGTH];
-  SHA256_CTX ctx;
-  SHA256_Init(&ctx);
-  if (!data.empty()) {
-    SHA256_Update(&ctx, data.data(), data.size());
+  const auto digest = sha256Digest({{data.data(), data.size()}});
+  return hexEncode(digest.data(), digest.size());
+}
+
+Sha256Digest sha256Digest(std::initializer_list<Sha256Input> parts) {
+  Sha256Digest out{};
+  auto ctx = newContext();
+  EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr);
+  for (const auto& part : parts) {
+    EVP_DigestUpdate(ctx.get(), part.data, part.size);
   }
-  SHA256_Final(digest, &ctx);
-  return digestToHex(digest, SHA256_DIGEST_LENGTH);
+  EVP_DigestFinal_ex(ctx.get(), out.data(), nullptr);
+  return out;
 }
 
-std::string sha256HexFile(const std::string& path, std::string* error) {
-  std::ifstream file(path, std::ios::binary);
-  if (!file.is_open()) {
-    if (error) {
-      *error = "failed to open file: " + path;
+std::string sha256HexFile(const std::string& path, std::string* error, bool map_file) {
+  auto ctx = newContext();
+  EVP_DigestInit_ex(ctx.get(), EVP_sha256(), nullptr);
+
+  MappedFile mapped;
+  if (map_file && mapped.open(path, nullptr)) {
+    EVP_DigestUpdate(ctx.get(), mapped.data(), mapped.size());
+  } else {
+    std::ifstream file(path, std::ios::binary);
+    if (!file.is_open()) {
+      if (error) {
+        *error = "failed to open file: " + path;
+      }
+      return {};
+    }
+    std::vector<char> buffer(kFileReadSize);
+    while (file.good()) {
+      file.read(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+      const auto read_size = file.gcount();
+      if (read_size > 0) {
+        EVP_DigestUpdate(ctx.get(), buffer.data(), static_cast<size_t>(read_size));
+      }
+    }
+    if (file.bad()) {
+      if (error) {
+        *error = "failed while reading file: " + path;
+      }
+      return {};
     }
-    return {};
   }
 
-  SHA256_CTX ctx;
-  SHA256_Init(&ctx);
+  Sha256Digest digest{};
+  EVP_DigestFinal_ex(ctx.get(), digest.data(), nullptr);
+  return hexEncode(digest.data(), digest.size());
+}
 
-  std::vector<char> buffer(64 * 1024);
-  while (file.good()) {
-    file.read(buffer.data(), buffer.size());
-    const auto read_size = file.gcount();
-    if (read_size > 0) {
-      SHA256_Update(&ctx, buffer.data(), static_cast<size_t>(read_size));
-    }
+std::vector<Sha256Digest> sha256Many(const std::vector<Sha256Input>& inputs,
+                                     unsigned threads,
+                                     const std::vector<uint8_t>& prefix) {
+  std::vector<Sha256Digest> out(inputs.size());
+  size_t total = 0;
+  for (const auto& input : inputs) {
+    total += input.size;
   }
-  if (file.bad()) {
-    if (error) {
-      *error = "failed while reading file: " + path;
+  const size_t workers = std::max<size_t>(
+      1, std::min<size_t>({std::max(1u, threads), inputs.size(), total / kMinBytesPerWorker}));
+
+  // Workers claim inputs one at a time so uneven sizes still balance. Each
+  // starts from a context that has already absorbed the prefix.
+  std::atomic<size_t> next{0};
+  auto work = [&] {
+    auto base = newContext();
+    auto ctx = newContext();
+    EVP_DigestInit_ex(base.get(), EVP_sha256(), nullptr);
+    EVP_DigestUpdate(base.get(), prefix.data(), prefix.size());
+    for (size_t i = next++; i < inputs.size(); i = next++) {
+      EVP_MD_CTX_copy_ex(ctx.get(), base.get());
+      EVP_DigestUpdate(ctx.get(), inputs[i].data, inputs[i].size);
+      EVP_DigestFinal_ex(ctx.get(), out[i].data(), nullptr);
     }
-    return {};
+  };
+
+  std::vector<std::thread> pool;
+  for (size_t w = 1; w < workers; ++w) {
+    pool.emplace_back(work);
+  }
+  work();
+  for (auto& thread : pool) {
+    thread.join();
+  }
+  return out;
+}
+
+bool sha256HexEqual(const std::string& lhs, const std::string& rhs) {
+  if (lhs.size() != rhs.size()) {
+    return false;
   }
+  return CRYPTO_memcmp(lhs.data(), rhs.data(), lhs.size()) == 0;
+}
 
+// Everything below uses the deprecated SHA256_* API on purpose: EVP
+// contexts are opaque, so their state cannot be saved for a resumed upload.
+// Nothing else in the tree calls these functions.
+#if defined(_MSC_VER)
+#pragma warning(push)
+#pragma warning(disable : 4996)
+#else
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wdeprecated-declarations"
+#endif
+
+namespace {
+
+SHA256_CTX* context(unsigned char* buffer) {
+  return reinterpret_cast<SHA256_CTX*>(buffer);
+}
+
+const SHA256_CTX* context(const unsigned char* buffer) {
+  return reinterpret_cast<const SHA256_CTX*>(buffer);
+}
+
+void putBigEndian(uint64_t value, size_t bytes, std::vector<uint8_t>* out) {
+  for (size_t i = bytes; i > 0; --i) {
+    out->push_back(static_cast<uint8_t>(value >> ((i - 1) * 8)));
+  }
+}
+
+uint64_t getBigEndian(const uint8_t* data, size_t bytes) {
+  uint64_t value = 0;
+  for (size_t i = 0; i < bytes; ++i) {
+    value = (value << 8) | data[i];
+  }
+  return value;
+}
+
+}  // namespace
+
+Sha256Hasher::Sha256Hasher() {
+  static_assert(sizeof(SHA256_CTX) <= kContextSize && alignof(SHA256_CTX) <= 8, "context buffer too small");
+  SHA256_Init(new (ctx_) SHA256_CTX);
+}
+
+void Sha256Hasher::update(const uint8_t* data, size_t size) {
+  if (size > 0) {
+    SHA256_Update(context(ctx_), data, size);
+  }
+}
+
+uint64_t Sha256Hasher::bytesHashed() const {
+  const auto* ctx = context(ctx_);
+  return ((static_cast<uint64_t>(ctx->Nh) << 32) | ctx->Nl) / 8;
+}
+
+std::string Sha256Hasher::finishHex() const {
+  SHA256_CTX copy = *context(ctx_);
   unsigned char digest[SHA256_DIGEST_LENGTH];
-  SHA256_Final(digest, &ctx);
-  return digestToHex(digest, SHA256_DIGEST_LENGTH);
+  SHA256_Final(digest, &copy);
+  return hexEncode(digest, SHA256_DIGEST_LENGTH);
 }
 
+std::vector<uint8_t> Sha256Hasher::saveState() const {
+  const auto* ctx = context(ctx_);
+  const uint64_t count = bytesHashed();
+  const size_t pending = static_cast<size_t>(count % kHasherBlockSize);
+  std::vector<uint8_t> state;
+  state.reserve(kHasherStateHeader + pending);
+  state.push_back(kHasherStateVersion);
+  for (const auto word : ctx->h) {
+    putBigEndian(word, 4, &state);
+  }
+  putBigEndian(count, 8, &state);
+  // The library keeps the unfinished block as raw bytes at the start of
+  // `data`.
+  const auto* block = reinterpret_cast<const uint8_t*>(ctx->data);
+  state.insert(state.end(), block, block + pending);
+  return state;
+}
+
+bool Sha256Hasher::loadState(const std::vector<uint8_t>& state) {
+  if (state.size() < kHasherStateHeader || state[0] != kHasherStateVersion) {
+    return false;
+  }
+  const uint64_t count = getBigEndian(state.data() + 1 + 8 * 4, 8);
+  const size_t pending = static_cast<size_t>(count % kHasherBlockSize);
+  if (count > (UINT64_MAX >> 3) || state.size() != kHasherStateHeader + pending) {
+    return false;
+  }
+  SHA256_CTX ctx;
+  SHA256_Init(&ctx);
+  for (size_t i = 0; i < 8; ++i) {
+    ctx.h[i] = static_cast<SHA_LONG>(getBigEndian(state.data() + 1 + i * 4, 4));
+  }
+  const uint64_t bits = count << 3;
+  ctx.Nl = static_cast<SHA_LONG>(bits & 0xffffffffu);
+  ctx.Nh = static_cast<SHA_LONG>(bits >> 32);
+  std::memcpy(ctx.data, state.data() + kHasherStateHeader, pending);
+  ctx.num = static_cast<unsigned int>(pending);
+  *context(ctx_) = ctx;
+  return true;
+}
+
+#if defined(_MSC_VER)
+#pragma warning(pop)
+#else
+#pragma GCC diagnostic pop
+#endif
+
 }  // namespace onlinetalk::common
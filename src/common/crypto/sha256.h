@@ -1,12 +1,55 @@
 #pragma once
 
+#include <array>
+#include <cstddef>
 #include <cstdint>
+#include <initializer_list>
 #include <string>
 #include <vector>
 
 namespace onlinetalk::common {
 
+using Sha256Digest = std::array<uint8_t, 32>;
+
+struct Sha256Input {
+  const uint8_t* data;
+  size_t size;
+};
+
 std::string sha256Hex(const std::vector<uint8_t>& data);
-std::string sha256HexFile(const std::string& path, std::string* error);
+// Digest of the parts hashed back to back.
+Sha256Digest sha256Digest(std::initializer_list<Sha256Input> parts);
+// Streams the file. With `map_file` it is mapped where possible instead;
+// see MappedFile for which files are safe to map.
+std::string sha256HexFile(const std::string& path, std::string* error, bool map_file = false);
+// Hashes each input on its own, spreading the inputs over up to `threads`
+// workers. `prefix` is hashed ahead of every input.
+std::vector<Sha256Digest> sha256Many(const std::vector<Sha256Input>& inputs,
+                                     unsigned threads,
+                                     const std::vector<uint8_t>& prefix = {});
+// Compares two hex digests without an early exit on the first difference.
+bool sha256HexEqual(const std::string& lhs, const std::string& rhs);
+std::string hexEncode(const uint8_t* data, size_t size);
+
+// Incremental SHA-256 whose intermediate state can be saved and restored,
+// so a long upload can be hashed chunk by chunk across restarts. Saved state
+// is a versioned record of the chaining words, the byte count and the
+// partial block, independent of how the hash library lays out its context.
+class Sha256Hasher {
+ public:
+  Sha256Hasher();
+
+  void update(const uint8_t* data, size_t size);
+  uint64_t bytesHashed() const;
+  std::string finishHex() const;
+  std::vector<uint8_t> saveState() const;
+  // Fails, leaving the hasher unchanged, on a record it does not recognise.
+  bool loadState(const std::vector<uint8_t>& state);
+
+ private:
+  // Holds the library's context; only sha256.cpp knows its type.
+  static constexpr size_t kContextSize = 128;
+  alignas(8) unsigned char ctx_[kContextSize];
+};
 
 }  // namespace onlinetalk::common
@@ -1,8 +1,17 @@
 #include "common/fs.h"
 
+#include <cerrno>
+#include <cstring>
 #include <filesystem>
 #include <system_error>
 
+#if !defined(_WIN32)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
 namespace onlinetalk::common {
 
 bool ensureDirectory(const std::string& path, std::string* error) {
@@ -32,4 +41,63 @@ bool ensureDirectory(const std::string& path, std::string* error) {
   return false;
 }
 
+MappedFile::~MappedFile() {
+  close();
+}
+
+bool MappedFile::open(const std::string& path, std::string* error) {
+  close();
+#if defined(_WIN32)
+  if (error) {
+    *error = "file mapping is not supported: " + path;
+  }
+  return false;
+#else
+  const int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    if (error) {
+      *error = "failed to open file: " + path;
+    }
+    return false;
+  }
+  struct stat info {};
+  if (::fstat(fd, &info) != 0 || !S_ISREG(info.st_mode)) {
+    ::close(fd);
+    if (error) {
+      *error = "not a regular file: " + path;
+    }
+    return false;
+  }
+  size_ = static_cast<size_t>(info.st_size);
+  if (size_ == 0) {
+    ::close(fd);
+    return true;
+  }
+  void* view = ::mmap(nullptr, size_, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (view == MAP_FAILED) {
+    size_ = 0;
+    if (error) {
+      *error = "failed to map file: " + path + ": " + std::strerror(errno);
+    }
+    return false;
+  }
+  ::madvise(view, size_, MADV_SEQUENTIAL);
+  data_ = static_cast<const uint8_t*>(view);
+  mapped_ = true;
+  return true;
+#endif
+}
+
+void MappedFile::close() {
+#if !defined(_WIN32)
+  if (mapped_) {
+    ::munmap(const_cast<uint8_t*>(data_), size_);
+  }
+#endif
+  data_ = nullptr;
+  size_ = 0;
+  mapped_ = false;
+}
+
 }  // namespace onlinetalk::common
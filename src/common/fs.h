@@ -1,9 +1,33 @@
 #pragma once
 
+#include <cstddef>
+#include <cstdint>
 #include <string>
 
 namespace onlinetalk::common {
 
 bool ensureDirectory(const std::string& path, std::string* error);
 
+// Read-only view of a whole file through mmap. open() fails where mapping
+// is unavailable, so callers keep a streaming fallback. Only map files this
+// process owns: if another process truncates the file, touching the lost
+// pages raises SIGBUS instead of returning an error.
+class MappedFile {
+ public:
+  MappedFile() = default;
+  ~MappedFile();
+  MappedFile(const MappedFile&) = delete;
+  MappedFile& operator=(const MappedFile&) = delete;
+
+  bool open(const std::string& path, std::string* error);
+  void close();
+  const uint8_t* data() const { return data_; }
+  size_t size() const { return size_; }
+
+ private:
+  const uint8_t* data_ = nullptr;
+  size_t size_ = 0;
+  bool mapped_ = false;
+};
+
 }  // namespace onlinetalk::common
@@ -0,0 +1,72 @@
+#include "common/net/chunk_sizer.h"
+
+#include <algorithm>
+
+namespace onlinetalk::common {
+
+namespace {
+
+// A chunk should take about this long to cross the link: long enough that
+// framing and per-chunk bookkeeping stay small, short enough that a resend
+// is cheap.
+constexpr int64_t kTargetChunkMs = 10;
+constexpr int64_t kPeriodMs = 200;
+// Round trips scale with the bytes a window holds, so only a jump past
+// twice the last period's, plus this, counts as trouble.
+constexpr int64_t kRttSlackMs = 20;
+
+}  // namespace
+
+ChunkSizer::ChunkSizer(int64_t unit, int64_t min_size, int64_t max_size, int64_t initial)
+    : unit_(std::max<int64_t>(1, unit)),
+      min_(std::max(min_size, unit_)),
+      max_(std::max(max_size, min_)) {
+  resize(initial);
+}
+
+int64_t ChunkSizer::size() const {
+  return size_;
+}
+
+void ChunkSizer::onAck(int64_t bytes, int64_t rtt_ms, int64_t now_ms) {
+  if (period_start_ms_ < 0) {
+    period_start_ms_ = now_ms;
+  }
+  period_bytes_ += bytes;
+  if (rtt_ms >= 0) {
+    rtt_sum_ms_ += rtt_ms;
+    ++rtt_samples_;
+  }
+  const int64_t elapsed = now_ms - period_start_ms_;
+  if (elapsed < kPeriodMs) {
+    return;
+  }
+  const int64_t per_target = period_bytes_ * kTargetChunkMs / elapsed;
+  const int64_t rtt = rtt_samples_ > 0 ? rtt_sum_ms_ / rtt_samples_ : -1;
+  const bool rtt_jump = rtt >= 0 && last_rtt_ms_ >= 0 && rtt > 2 * last_rtt_ms_ + kRttSlackMs;
+  if (rtt_jump || per_target < size_ / 2) {
+    resize(size_ / 2);
+  } else if (!lost_ && per_target >= size_ * 2) {
+    resize(size_ * 2);
+  }
+  last_rtt_ms_ = rtt;
+  period_start_ms_ = now_ms;
+  period_bytes_ = 0;
+  rtt_sum_ms_ = 0;
+  rtt_samples_ = 0;
+  lost_ = false;
+}
+
+void ChunkSizer::onLoss() {
+  // Back off at once; a lossy link should not wait out the period.
+  if (!lost_) {
+    resize(size_ / 2);
+  }
+  lost_ = true;
+}
+
+void ChunkSizer::resize(int64_t size) {
+  size_ = std::clamp(size - size % unit_, min_, max_);
+}
+
+}  // namespace onlinetalk::common
@@ -0,0 +1,40 @@
+#pragma once
+
+#include <cstdint>
+
+namespace onlinetalk::common {
+
+// Picks the chunk size for one transfer from what the sending side sees.
+// Sizes are multiples of `unit` within [min_size, max_size]. Once per period
+// the size doubles when the link moves more than two chunks per target
+// interval, and halves when it moves less than half of one or when the round
+// trip jumps well past the previous period's (loss and retransmission).
+// A chunk reported lost halves it at once.
+class ChunkSizer {
+ public:
+  ChunkSizer() = default;
+  ChunkSizer(int64_t unit, int64_t min_size, int64_t max_size, int64_t initial);
+
+  int64_t size() const;
+  // `bytes` were acknowledged `rtt_ms` after they were sent; a negative
+  // rtt means the sender cannot tell.
+  void onAck(int64_t bytes, int64_t rtt_ms, int64_t now_ms);
+  // A chunk was corrupted or dropped and has to be sent again.
+  void onLoss();
+
+ private:
+  void resize(int64_t size);
+
+  int64_t unit_ = 1;
+  int64_t min_ = 1;
+  int64_t max_ = 1;
+  int64_t size_ = 1;
+  int64_t period_start_ms_ = -1;
+  int64_t period_bytes_ = 0;
+  int64_t rtt_sum_ms_ = 0;
+  int rtt_samples_ = 0;
+  int64_t last_rtt_ms_ = -1;  // average over the previous period
+  bool lost_ = false;
+};
+
+}  // namespace onlinetalk::common
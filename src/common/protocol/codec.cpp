@@ -46,19 +46,26 @@ uint64_t readU64(const uint8_t* data) {
 }  // namespace
 
 std::vector<uint8_t> Codec::encode(const Packet& packet) {
+  auto out = encodePrefix(packet.header, packet.meta_json, static_cast<uint32_t>(packet.binary.size()));
+  out.insert(out.end(), packet.binary.begin(), packet.binary.end());
+  return out;
+}
+
+std::vector<uint8_t> Codec::encodePrefix(const PacketHeader& header,
+                                         const std::string& meta_json,
+                                         uint32_t bin_len) {
   std::vector<uint8_t> out;
-  out.reserve(kHeaderSize + packet.meta_json.size() + packet.binary.size());
+  out.reserve(kHeaderSize + meta_json.size() + bin_len);
 
-  writeU32(out, packet.header.magic);
-  writeU16(out, packet.header.version);
-  writeU16(out, packet.header.type);
-  writeU32(out, packet.header.flags);
-  writeU64(out, packet.header.request_id);
-  writeU32(out, static_cast<uint32_t>(packet.meta_json.size()));
-  writeU32(out, static_cast<uint32_t>(packet.binary.size()));
+  writeU32(out, header.magic);
+  writeU16(out, header.version);
+  writeU16(out, header.type);
+  writeU32(out, header.flags);
+  writeU64(out, header.request_id);
+  writeU32(out, static_cast<uint32_t>(meta_json.size()));
+  writeU32(out, bin_len);
 
-  out.insert(out.end(), packet.meta_json.begin(), packet.meta_json.end());
-  out.insert(out.end(), packet.binary.begin(), packet.binary.end());
+  out.insert(out.end(), meta_json.begin(), meta_json.end());
   return out;
 }
 
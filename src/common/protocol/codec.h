@@ -2,6 +2,7 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <string>
 #include <vector>
 
 #include "common/net/byte_buffer.h"
@@ -12,6 +13,10 @@ namespace onlinetalk::common {
 class Codec {
  public:
   static std::vector<uint8_t> encode(const Packet& packet);
+  // Header and meta only; the caller sends bin_len bytes of binary after it.
+  static std::vector<uint8_t> encodePrefix(const PacketHeader& header,
+                                           const std::string& meta_json,
+                                           uint32_t bin_len);
   static bool decode(ByteBuffer& buffer, Packet* out_packet);
 
   static constexpr size_t kHeaderSize = 28;
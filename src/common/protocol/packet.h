@@ -27,12 +27,20 @@ enum class PacketType : uint16_t {
   FileUploadDone = 18,
   FileDownloadRequest = 19,
   FileDownloadChunk = 20,
-  FileDone = 21
+  FileDone = 21,
+  SyncRequest = 22,
+  SyncResponse = 23,
+  HistoryBatchFetch = 24,
+  HistoryBatchResponse = 25,
+  FileDownloadCredit = 26,
+  DataAttach = 27
 };
 
 struct PacketHeader {
   static constexpr uint32_t kMagic = 0x4F4C544B;  // "OLTK"
   static constexpr uint16_t kVersion = 1;
+  // The binary part is a raw DEFLATE stream of the payload.
+  static constexpr uint32_t kFlagCompressed = 0x1;
 
   uint32_t magic = kMagic;
   uint16_t version = kVersion;
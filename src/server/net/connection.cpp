@@ -1,16 +1,35 @@
 #include "server/net/connection.h"
 
 #include <cerrno>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <utility>
 
 namespace onlinetalk::server {
 
-Connection::Connection(int fd) : fd_(fd) {}
+Connection::Connection(int fd, uint64_t id, std::string peer_address)
+    : fd_(fd), id_(id), peer_address_(std::move(peer_address)) {}
 
 int Connection::fd() const {
   return fd_;
 }
 
+uint64_t Connection::id() const {
+  return id_;
+}
+
+const std::string& Connection::peerAddress() const {
+  return peer_address_;
+}
+
+bool Connection::authPending() const {
+  return auth_pending_;
+}
+
+void Connection::setAuthPending(bool pending) {
+  auth_pending_ = pending;
+}
+
 onlinetalk::common::ByteBuffer& Connection::readBuffer() {
   return read_buffer_;
 }
@@ -19,18 +38,84 @@ void Connection::queueWrite(const std::vector<uint8_t>& data) {
   if (data.empty()) {
     return;
   }
-  write_buffer_.insert(write_buffer_.end(), data.begin(), data.end());
+  if (!write_queue_.empty()) {
+    auto& bytes = write_queue_.back().bytes;
+    bytes.insert(bytes.end(), data.begin(), data.end());
+    return;
+  }
+  WriteSegment segment;
+  segment.bytes = data;
+  write_queue_.push_back(std::move(segment));
+}
+
+void Connection::queueFileFrame(std::vector<uint8_t> prefix,
+                                std::shared_ptr<FileHandle> file,
+                                int64_t offset,
+                                int64_t length) {
+  const bool has_body = file && length > 0;
+  WriteSegment head;
+  head.bytes = std::move(prefix);
+  head.frame_end = !has_body;
+  bulk_queue_.push_back(std::move(head));
+  if (!has_body) {
+    return;
+  }
+  WriteSegment body;
+  body.file = std::move(file);
+  body.file_offset = offset;
+  body.file_remaining = length;
+  bulk_queue_.push_back(std::move(body));
 }
 
 bool Connection::flushWrite() {
-  while (write_offset_ < write_buffer_.size()) {
-    const auto remaining = write_buffer_.size() - write_offset_;
-    const auto sent = ::send(fd_,
-                             write_buffer_.data() + write_offset_,
-                             remaining,
-                             0);
+  while (true) {
+    std::deque<WriteSegment>* queue = nullptr;
+    if (bulk_started_ || (write_queue_.empty() && !bulk_queue_.empty())) {
+      queue = &bulk_queue_;
+    } else if (!write_queue_.empty()) {
+      queue = &write_queue_;
+    } else {
+      break;
+    }
+    const bool bulk = queue == &bulk_queue_;
+    auto& segment = queue->front();
+    if (segment.file) {
+      off_t file_offset = static_cast<off_t>(segment.file_offset);
+      const auto sent = ::sendfile(fd_, segment.file->fd(), &file_offset,
+                                   static_cast<size_t>(segment.file_remaining));
+      if (sent > 0) {
+        segment.file_offset = file_offset;
+        segment.file_remaining -= sent;
+        bulk_started_ = true;
+        if (segment.file_remaining == 0) {
+          bulk_started_ = !segment.frame_end;
+          queue->pop_front();
+        }
+        continue;
+      }
+      if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        break;
+      }
+      // sent == 0 means the file is shorter than announced; the frame can't
+      // be completed, so drop the connection.
+      return false;
+    }
+
+    const auto remaining = segment.bytes.size() - segment.offset;
+    // Let the kernel coalesce a frame header with the file bytes behind it.
+    const bool more = !segment.frame_end || write_queue_.size() + bulk_queue_.size() > 1;
+    const auto sent = ::send(fd_, segment.bytes.data() + segment.offset, remaining, more ? MSG_MORE : 0);
     if (sent > 0) {
-      write_offset_ += static_cast<size_t>(sent);
+      segment.offset += static_cast<size_t>(sent);
+      if (bulk) {
+        bulk_started_ = true;
+      }
+      if (segment.offset >= segment.bytes.size()) {
+        if (bulk) {
+          bulk_started_ = !segment.frame_end;
+        }
+        queue->pop_front();
+      }
       continue;
     }
     if (sent == -1 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
@@ -38,15 +123,19 @@ bool Connection::flushWrite() {
     }
     return false;
   }
-  if (write_offset_ >= write_buffer_.size()) {
-    write_buffer_.clear();
-    write_offset_ = 0;
-  }
   return true;
 }
 
 bool Connection::hasPendingWrite() const {
-  return write_offset_ < write_buffer_.size();
+  return !write_queue_.empty() || !bulk_queue_.empty();
+}
+
+int64_t Connection::bulkPendingBytes() const {
+  int64_t total = 0;
+  for (const auto& segment : bulk_queue_) {
+    total += segment.file ? segment.file_remaining : static_cast<int64_t>(segment.bytes.size() - segment.offset);
+  }
+  return total;
 }
 
 }  // namespace onlinetalk::server
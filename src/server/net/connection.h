@@ -2,27 +2,55 @@
 
 #include <cstddef>
 #include <cstdint>
+#include <deque>
+#include <memory>
+#include <string>
 #include <vector>
 
 #include "common/net/byte_buffer.h"
+#include "server/storage/file_handle.h"
 
 namespace onlinetalk::server {
 
 class Connection {
  public:
-  explicit Connection(int fd);
+  Connection(int fd, uint64_t id, std::string peer_address);
 
   int fd() const;
+  // Unique for the server's lifetime, unlike fd which the kernel reuses.
+  uint64_t id() const;
+  const std::string& peerAddress() const;
+  bool authPending() const;
+  void setAuthPending(bool pending);
   onlinetalk::common::ByteBuffer& readBuffer();
   void queueWrite(const std::vector<uint8_t>& data);
+  // Queues a frame whose body is `length` bytes of `file` starting at
+  // `offset`, sent with sendfile(). File frames go out on a bulk lane: queued
+  // control packets are written first whenever no file frame is half sent.
+  void queueFileFrame(std::vector<uint8_t> prefix, std::shared_ptr<FileHandle> file, int64_t offset, int64_t length);
   bool flushWrite();
   bool hasPendingWrite() const;
+  // Bytes of file frames not yet handed to the kernel.
+  int64_t bulkPendingBytes() const;
 
  private:
   int fd_;
+  uint64_t id_;
+  std::string peer_address_;
+  bool auth_pending_ = false;
+  struct WriteSegment {
+    std::vector<uint8_t> bytes;
+    size_t offset = 0;
+    std::shared_ptr<FileHandle> file;
+    int64_t file_offset = 0;
+    int64_t file_remaining = 0;
+    bool frame_end = true;
+  };
+
   onlinetalk::common::ByteBuffer read_buffer_;
-  std::vector<uint8_t> write_buffer_;
-  size_t write_offset_ = 0;
+  std::deque<WriteSegment> write_queue_;
+  std::deque<WriteSegment> bulk_queue_;
+  bool bulk_started_ = false;  // the front bulk frame is partly written
 };
 
 }  // namespace onlinetalk::server
@@ -6,14 +6,20 @@
 #include <fcntl.h>
 #include <netdb.h>
 #include <algorithm>
+#include <array>
+#include <chrono>
+#include <limits>
 #include <netinet/in.h>
 #include <netinet/tcp.h>
 #include <sys/epoll.h>
+#include <sys/resource.h>
 #include <sys/socket.h>
 #include <unistd.h>
 
 #include <nlohmann/json.hpp>
+#include <openssl/rand.h>
 
+#include "common/crypto/sha256.h"
 #include "common/log.h"
 #include "common/protocol/codec.h"
 
@@ -22,10 +28,61 @@ namespace onlinetalk::server {
 namespace {
 
 constexpr int kMaxEvents = 64;
+constexpr int kIdleWaitMs = 1000;
+constexpr int kBusyWaitMs = 10;
+constexpr auto kDictionaryTrainingInterval = std::chrono::minutes(10);
+constexpr auto kEphemeralSweepInterval = std::chrono::seconds(1);
+constexpr auto kIdleTransferSweepInterval = std::chrono::seconds(10);
+constexpr auto kStorageSweepInterval = std::chrono::minutes(10);
+// Batches of the storage sweep are spaced out so a large backlog of
+// abandoned uploads never monopolises the loop.
+constexpr auto kStorageSweepStepInterval = std::chrono::milliseconds(100);
+constexpr auto kStatsLogInterval = std::chrono::minutes(1);
+// A maintenance batch that failed is tried again after this.
+constexpr auto kMaintenanceRetryInterval = std::chrono::seconds(30);
+constexpr auto kRehashFlushInterval = std::chrono::seconds(1);
+constexpr size_t kRehashBatch = 64;
+constexpr int64_t kDownloadQueueBytes = 256 * 1024;
+constexpr size_t kDataTokenBytes = 32;
+constexpr int64_t kMaxDownloadCredit = 64 * 1024 * 1024;
+constexpr int64_t kMaxEphemeralTtlSeconds = 7 * 24 * 3600;
 constexpr size_t kMaxFieldLength = 64;
 constexpr size_t kMaxContentLength = 4096;
 constexpr size_t kMaxFileNameLength = 255;
 constexpr size_t kSha256HexLength = 64;
+constexpr size_t kMaxSyncConversations = 64;
+constexpr size_t kMaxHistoryBatch = 32;
+// Descriptors kept back for the listener, epoll, eventfds, SQLite and its
+// journal, the log and stdio.
+constexpr int64_t kReservedFds = 64;
+constexpr size_t kMaxUploadSessions = 256;
+constexpr size_t kMaxDownloadSessions = 1024;
+
+int64_t nowSeconds() {
+  const auto now = std::chrono::system_clock::now();
+  return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
+}
+
+int64_t steadyMs() {
+  return std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::steady_clock::now().time_since_epoch())
+      .count();
+}
+
+int64_t alignUp(int64_t value, int64_t alignment) {
+  return (value + alignment - 1) / alignment * alignment;
+}
+
+std::string peerAddress(const sockaddr_storage& addr) {
+  char host[INET6_ADDRSTRLEN] = {};
+  if (addr.ss_family == AF_INET) {
+    const auto* in = reinterpret_cast<const sockaddr_in*>(&addr);
+    ::inet_ntop(AF_INET, &in->sin_addr, host, sizeof(host));
+  } else if (addr.ss_family == AF_INET6) {
+    const auto* in6 = reinterpret_cast<const sockaddr_in6*>(&addr);
+    ::inet_ntop(AF_INET6, &in6->sin6_addr, host, sizeof(host));
+  }
+  return host;
+}
 
 bool setNonBlocking(int fd, std::string* error) {
   const int flags = ::fcntl(fd, F_GETFL, 0);
@@ -168,6 +225,44 @@ bool validateField(const std::string& value, const std::string& field, size_t ma
   return true;
 }
 
+nlohmann::json historyItem(const StoredMessage& msg, const std::string& content) {
+  nlohmann::json item;
+  item["message_id"] = msg.message_id;
+  item["seq"] = msg.conversation_seq;
+  item["sender_id"] = msg.sender_id;
+  item["sender_nickname"] = msg.sender_nickname;
+  item["content"] = content;
+  item["created_at"] = msg.created_at;
+  return item;
+}
+
+nlohmann::json ephemeralItem(const EphemeralMessage& msg) {
+  nlohmann::json item;
+  item["message_id"] = 0;
+  item["seq"] = 0;
+  item["ephemeral"] = true;
+  item["ephemeral_id"] = msg.ephemeral_id;
+  item["conversation_type"] = msg.conversation_type;
+  item["conversation_id"] = msg.conversation_id;
+  item["sender_id"] = msg.sender_id;
+  item["sender_nickname"] = msg.sender_nickname;
+  item["content"] = msg.content;
+  item["created_at"] = msg.created_at;
+  item["expires_at"] = msg.expires_at;
+  return item;
+}
+
+// Whoever presents the token acts as the user for file traffic, so it
+// comes from the CSPRNG.
+bool newDataToken(std::string* token) {
+  std::array<uint8_t, kDataTokenBytes> bytes{};
+  if (RAND_bytes(bytes.data(), static_cast<int>(bytes.size())) != 1) {
+    return false;
+  }
+  *token = onlinetalk::common::hexEncode(bytes.data(), bytes.size());
+  return true;
+}
+
 }  // namespace
 
 TcpServer::TcpServer(const onlinetalk::common::ServerConfig& config)
@@ -176,14 +271,21 @@ TcpServer::TcpServer(const onlinetalk::common::ServerConfig& config)
       auth_service_(database_),
       group_service_(database_),
       message_service_(database_),
-      file_service_(database_, config_.data_dir, config_.file_chunk_size) {}
+      file_service_(database_,
+                    config_.data_dir,
+                    config_.file_chunk_size,
+                    config_.file_chunk_size_max,
+                    config_.upload_window_chunks,
+                    config_.upload_checkpoint_bytes,
+                    StorageLimits{config_.user_quota_bytes, config_.group_quota_bytes, config_.disk_reserve_bytes}),
+      ephemeral_store_(static_cast<size_t>(config_.ephemeral_backlog_size)) {}
 
 TcpServer::~TcpServer() {
   stop();
 }
 
 bool TcpServer::start(std::string* error) {
-  if (!initDatabase(error)) {
+  if (!budgetFileDescriptors(error) || !initDatabase(error)) {
     return false;
   }
   if (!setupListener(error)) {
@@ -207,6 +309,35 @@ bool TcpServer::start(std::string* error) {
     return false;
   }
 
+  bcrypt_cost_ = AuthService::calibrateCost(config_.bcrypt_target_ms);
+  onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
+                                  "bcrypt cost " + std::to_string(bcrypt_cost_) + " for target " +
+                                      std::to_string(config_.bcrypt_target_ms) + "ms");
+  if (!password_pool_.start(static_cast<size_t>(config_.thread_pool_size),
+                            static_cast<size_t>(config_.auth_queue_size),
+                            error)) {
+    return false;
+  }
+  event.data.fd = password_pool_.notifyFd();
+  if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, password_pool_.notifyFd(), &event) != 0) {
+    if (error) {
+      *error = "epoll_ctl add password pool fd failed";
+    }
+    return false;
+  }
+  if (!file_io_pool_.start(static_cast<size_t>(config_.file_io_threads),
+                           static_cast<size_t>(config_.file_io_queue_bytes),
+                           error)) {
+    return false;
+  }
+  event.data.fd = file_io_pool_.notifyFd();
+  if (::epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, file_io_pool_.notifyFd(), &event) != 0) {
+    if (error) {
+      *error = "epoll_ctl add file io pool fd failed";
+    }
+    return false;
+  }
+
   running_ = true;
   return true;
 }
@@ -214,7 +345,10 @@ bool TcpServer::start(std::string* error) {
 void TcpServer::run() {
   std::vector<epoll_event> events(kMaxEvents);
   while (running_) {
-    const int count = ::epoll_wait(epoll_fd_, events.data(), static_cast<int>(events.size()), 1000);
+    const bool busy = purge_pending_ || training_pending_ || compaction_pending_ || nickname_pass_pending_ ||
+                      storage_sweep_pending_;
+    const int wait_ms = busy ? kBusyWaitMs : kIdleWaitMs;
+    const int count = ::epoll_wait(epoll_fd_, events.data(), static_cast<int>(events.size()), wait_ms);
     if (count < 0) {
       if (errno == EINTR) {
         continue;
@@ -230,6 +364,14 @@ void TcpServer::run() {
         acceptConnections();
         continue;
       }
+      if (fd == password_pool_.notifyFd()) {
+        finishAuthJobs();
+        continue;
+      }
+      if (fd == file_io_pool_.notifyFd()) {
+        finishFileIoJobs();
+        continue;
+      }
 
       auto it = connections_.find(fd);
       if (it == connections_.end()) {
@@ -250,17 +392,194 @@ void TcpServer::run() {
           disconnect(fd);
           continue;
         }
+        pumpDownloads(*it->second);
       }
       updateEpollEvents(fd, it->second->hasPendingWrite());
     }
+    runMaintenance();
   }
 }
 
+void TcpServer::runMaintenance() {
+  const auto now = std::chrono::steady_clock::now();
+  if (purge_pending_ && now >= next_purge_step_) {
+    purge_pending_ = purgeDissolvedGroupStep();
+  }
+  if (!pending_rehashes_.empty() && (pending_rehashes_.size() >= kRehashBatch || now >= next_rehash_flush_)) {
+    std::string rehash_error;
+    if (!auth_service_.updatePasswordHashes(pending_rehashes_, &rehash_error)) {
+      onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                      "password rehash failed: " + rehash_error);
+    }
+    pending_rehashes_.clear();
+    next_rehash_flush_ = now + kRehashFlushInterval;
+  }
+  if (now >= next_stats_log_) {
+    const auto& stats = login_throttle_.stats();
+    if (stats.failures != logged_login_failures_) {
+      onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
+                                      "login throttle: checked=" + std::to_string(stats.checked) +
+                                          " rejected=" + std::to_string(stats.rejected) +
+                                          " failures=" + std::to_string(stats.failures));
+      logged_login_failures_ = stats.failures;
+    }
+    next_stats_log_ = now + kStatsLogInterval;
+  }
+  if (now >= next_transfer_sweep_) {
+    file_service_.closeIdleSessions(nowSeconds());
+    next_transfer_sweep_ = now + kIdleTransferSweepInterval;
+  }
+  if (now >= next_storage_sweep_) {
+    storage_sweep_pending_ = true;
+    next_storage_sweep_ = now + kStorageSweepInterval;
+  }
+  if (storage_sweep_pending_ && now >= next_storage_sweep_step_) {
+    storage_sweep_pending_ = storageSweepStep();
+    next_storage_sweep_step_ = now + kStorageSweepStepInterval;
+  }
+  if (now >= next_ephemeral_sweep_) {
+    ephemeral_store_.expire(nowSeconds());
+    next_ephemeral_sweep_ = now + kEphemeralSweepInterval;
+  }
+  if (config_.message_compression && now >= next_training_) {
+    training_pending_ = true;
+    next_training_ = now + kDictionaryTrainingInterval;
+  }
+  std::string error;
+  // Runs whether or not messages are compressed.
+  if (nickname_pass_pending_ && now >= next_nickname_step_) {
+    int64_t next_id = 0;
+    if (message_service_.normalizeNicknames(nickname_cursor_, config_.purge_batch_size, &next_id, &error)) {
+      nickname_pass_pending_ = next_id != nickname_cursor_;
+      nickname_cursor_ = next_id;
+    } else {
+      onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                      "nickname normalization failed: " + error);
+      next_nickname_step_ = now + kMaintenanceRetryInterval;
+    }
+    error.clear();
+  }
+  if (training_pending_) {
+    bool trained = false;
+    if (!message_service_.trainDictionary(&trained, &error)) {
+      onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                      "dictionary training failed: " + error);
+    }
+    training_pending_ = trained;
+    if (trained) {
+      compaction_pending_ = true;
+      compaction_cursor_ = 0;
+    }
+  } else if (compaction_pending_) {
+    int64_t next_id = 0;
+    if (!message_service_.compactMessages(compaction_cursor_, config_.purge_batch_size, &next_id, &error)) {
+      onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                      "message compaction failed: " + error);
+      next_id = compaction_cursor_;
+    }
+    compaction_pending_ = next_id != compaction_cursor_;
+    compaction_cursor_ = next_id;
+  }
+}
+
+std::string TcpServer::messageText(const StoredMessage& msg) {
+  std::string text;
+  std::string error;
+  if (!message_service_.contentText(msg, &text, &error)) {
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                    "failed to decode message " + std::to_string(msg.message_id) + ": " + error);
+  }
+  return text;
+}
+
+bool TcpServer::purgeDissolvedGroupStep() {
+  std::string error;
+  if (purge_group_id_.empty()) {
+    if (!group_service_.nextDissolvedGroup(&purge_group_id_, &error)) {
+      onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                      "dissolved group lookup failed: " + error);
+      next_purge_step_ = std::chrono::steady_clock::now() + kMaintenanceRetryInterval;
+      return true;
+    }
+    if (purge_group_id_.empty()) {
+      return false;
+    }
+  }
+
+  // One bounded batch per loop iteration: messages first, then files, then the
+  // group row itself once nothing references it.
+  int removed = 0;
+  if (!message_service_.purgeConversation("group", purge_group_id_, config_.purge_batch_size, &removed, &error) ||
+      (removed == 0 &&
+       !file_service_.purgeConversationFiles("group", purge_group_id_, config_.purge_batch_size, &removed, &error))) {
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                    "purge of group " + purge_group_id_ + " failed: " + error);
+    // Keep the group and retry later; SQLite errors here are usually a busy
+    // or full database.
+    next_purge_step_ = std::chrono::steady_clock::now() + kMaintenanceRetryInterval;
+    return true;
+  }
+  if (removed > 0) {
+    return true;
+  }
+  if (!group_service_.removeDissolvedGroup(purge_group_id_, &error)) {
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                    "purge of group " + purge_group_id_ + " failed: " + error);
+    next_purge_step_ = std::chrono::steady_clock::now() + kMaintenanceRetryInterval;
+    return true;
+  }
+  onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
+                                  "purged dissolved group " + purge_group_id_);
+  purge_group_id_.clear();
+  return true;
+}
+
+bool TcpServer::storageSweepStep() {
+  const int64_t cutoff = nowSeconds() - config_.upload_ttl_seconds;
+  int removed = 0;
+  int64_t bytes = 0;
+  bool finished = false;
+  std::string error;
+  const bool ok =
+      storage_sweep_orphans_
+          ? file_service_.sweepOrphanFiles(cutoff, config_.purge_batch_size, &removed, &bytes, &finished, &error)
+          : file_service_.sweepStaleUploads(cutoff, config_.purge_batch_size, &removed, &bytes, &error);
+  if (!ok) {
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn, "storage sweep failed: " + error);
+  }
+  storage_sweep_removed_ += removed;
+  storage_sweep_bytes_ += bytes;
+  if (ok && (storage_sweep_orphans_ ? !finished : removed >= config_.purge_batch_size)) {
+    return true;
+  }
+  // Rows first, then whatever they no longer reference on disk.
+  if (ok && !storage_sweep_orphans_) {
+    storage_sweep_orphans_ = true;
+    return true;
+  }
+  if (storage_sweep_removed_ > 0) {
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
+                                    "storage sweep removed " + std::to_string(storage_sweep_removed_) +
+                                        " items, reclaimed " + std::to_string(storage_sweep_bytes_) + " bytes");
+  }
+  storage_sweep_orphans_ = false;
+  storage_sweep_removed_ = 0;
+  storage_sweep_bytes_ = 0;
+  return false;
+}
+
 void TcpServer::stop() {
   if (!running_) {
     return;
   }
   running_ = false;
+  password_pool_.stop();
+  file_io_pool_.stop();
+  file_service_.flushSessions();
+  pending_auth_.clear();
+  pending_file_io_.clear();
+  download_streams_.clear();
+  prefetching_bytes_.clear();
   for (auto& entry : connections_) {
     ::close(entry.first);
   }
@@ -283,7 +602,46 @@ bool TcpServer::setupListener(std::string* error) {
   return true;
 }
 
+bool TcpServer::budgetFileDescriptors(std::string* error) {
+  // Every cached transfer session holds a file open, so the caches get what
+  // the descriptor limit leaves after the clients and the server itself.
+  rlimit limit{};
+  if (::getrlimit(RLIMIT_NOFILE, &limit) != 0) {
+    if (error) {
+      *error = "getrlimit failed";
+    }
+    return false;
+  }
+  if (limit.rlim_cur != RLIM_INFINITY && limit.rlim_cur < limit.rlim_max) {
+    rlimit raised = limit;
+    raised.rlim_cur = limit.rlim_max;
+    if (::setrlimit(RLIMIT_NOFILE, &raised) == 0) {
+      limit = raised;
+    }
+  }
+  const auto descriptors =
+      limit.rlim_cur == RLIM_INFINITY ? std::numeric_limits<int64_t>::max() / 2
+                                      : static_cast<int64_t>(std::min<rlim_t>(limit.rlim_cur, INT64_MAX / 2));
+  const int64_t spare = descriptors - config_.max_clients - kReservedFds;
+  if (spare < 2) {
+    if (error) {
+      *error = "RLIMIT_NOFILE " + std::to_string(descriptors) + " is too low for max_clients " +
+               std::to_string(config_.max_clients);
+    }
+    return false;
+  }
+  const auto uploads = std::min<size_t>(kMaxUploadSessions, static_cast<size_t>(spare / 4));
+  const auto downloads = std::min<size_t>(kMaxDownloadSessions, static_cast<size_t>(spare) - uploads);
+  file_service_.setSessionLimits(uploads, downloads);
+  onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
+                                  "descriptor limit " + std::to_string(descriptors) + ", caching up to " +
+                                      std::to_string(uploads) + " uploads and " + std::to_string(downloads) +
+                                      " downloads");
+  return true;
+}
+
 void TcpServer::acceptConnections() {
+  bool released = false;
   while (true) {
     sockaddr_storage addr{};
     socklen_t addr_len = sizeof(addr);
@@ -292,6 +650,15 @@ void TcpServer::acceptConnections() {
       if (errno == EAGAIN || errno == EWOULDBLOCK) {
         break;
       }
+      if ((errno == EMFILE || errno == ENFILE) && !released) {
+        // Out of descriptors: give back the cached transfer files and try
+        // once more.
+        onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                        "accept out of descriptors, closing cached files");
+        file_service_.releaseIdleFiles();
+        released = true;
+        continue;
+      }
       onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Error,
                                       "accept failed");
       break;
@@ -316,7 +683,7 @@ void TcpServer::acceptConnections() {
       continue;
     }
 
-    connections_.emplace(client_fd, std::make_unique<Connection>(client_fd));
+    connections_.emplace(client_fd, std::make_unique<Connection>(client_fd, next_connection_id_++, peerAddress(addr)));
     sessions_.addConnection(client_fd);
     onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
                                     "client connected fd=" + std::to_string(client_fd));
@@ -359,7 +726,21 @@ bool TcpServer::processPackets(Connection& conn) {
       break;
     }
     const auto type = static_cast<onlinetalk::common::PacketType>(packet.header.type);
+    const bool file_traffic = type == onlinetalk::common::PacketType::FileOffer ||
+                              type == onlinetalk::common::PacketType::FileUploadChunk ||
+                              type == onlinetalk::common::PacketType::FileUploadDone ||
+                              type == onlinetalk::common::PacketType::FileDownloadRequest ||
+                              type == onlinetalk::common::PacketType::FileDownloadCredit;
+    const auto* session = sessions_.getSession(conn.fd());
+    if (session && session->control_fd >= 0 && !file_traffic) {
+      sendResponse(conn, type, packet.header.request_id, "error", "DATA_ONLY", "data connections carry file traffic only",
+                   "");
+      continue;
+    }
     switch (type) {
+      case onlinetalk::common::PacketType::DataAttach:
+        handleDataAttach(conn, packet);
+        break;
       case onlinetalk::common::PacketType::AuthLogin:
       case onlinetalk::common::PacketType::AuthRegister:
         handleAuth(conn, packet);
@@ -376,10 +757,17 @@ bool TcpServer::processPackets(Connection& conn) {
       case onlinetalk::common::PacketType::HistoryFetch:
         handleHistory(conn, packet);
         break;
+      case onlinetalk::common::PacketType::HistoryBatchFetch:
+        handleHistoryBatch(conn, packet);
+        break;
+      case onlinetalk::common::PacketType::SyncRequest:
+        handleSync(conn, packet);
+        break;
       case onlinetalk::common::PacketType::FileOffer:
       case onlinetalk::common::PacketType::FileUploadChunk:
       case onlinetalk::common::PacketType::FileUploadDone:
       case onlinetalk::common::PacketType::FileDownloadRequest:
+      case onlinetalk::common::PacketType::FileDownloadCredit:
         handleFile(conn, packet);
         break;
       default:
@@ -486,21 +874,22 @@ void TcpServer::handleRegister(Connection& conn, const onlinetalk::common::Packe
     return;
   }
 
-  if (!auth_service_.registerUser(user_id, nickname, password, &error)) {
-    sendAuthError(conn, packet.header.request_id, "REGISTER_FAILED", error);
+  std::string exists_error;
+  const bool exists = auth_service_.userExists(user_id, &exists_error);
+  if (!exists_error.empty() || exists) {
+    sendAuthError(conn, packet.header.request_id, "REGISTER_FAILED",
+                  exists ? "user already exists" : exists_error);
     return;
   }
 
-  nlohmann::json extra;
-  extra["registered"] = true;
-  extra["logged_in"] = false;
-  sendResponse(conn,
-               onlinetalk::common::PacketType::AuthOk,
-               packet.header.request_id,
-               "ok",
-               "",
-               "",
-               extra.dump());
+  PendingAuth pending;
+  pending.is_register = true;
+  pending.user_id = user_id;
+  pending.nickname = nickname;
+  PasswordJob job;
+  job.kind = PasswordJobKind::Hash;
+  job.password = password;
+  submitAuthJob(conn, packet.header.request_id, std::move(pending), std::move(job));
 }
 
 void TcpServer::handleLogin(Connection& conn, const onlinetalk::common::Packet& packet) {
@@ -523,22 +912,157 @@ void TcpServer::handleLogin(Connection& conn, const onlinetalk::common::Packet&
     return;
   }
 
+  int64_t retry_after = 0;
+  if (!login_throttle_.allow(user_id, conn.peerAddress(), nowSeconds(), &retry_after)) {
+    sendAuthError(conn, packet.header.request_id, "LOGIN_THROTTLED",
+                  "too many failed logins, retry in " + std::to_string(retry_after) + "s");
+    return;
+  }
+
   AuthUser user;
-  if (!auth_service_.loginUser(user_id, password, &user, &error)) {
+  PasswordJob job;
+  job.kind = PasswordJobKind::Verify;
+  job.password = password;
+  bool not_found = false;
+  if (!auth_service_.loadCredentials(user_id, &user, &job.hash, &not_found, &error)) {
+    if (not_found) {
+      login_throttle_.recordFailure(user_id, conn.peerAddress(), nowSeconds());
+    }
     sendAuthError(conn, packet.header.request_id, "LOGIN_FAILED", error);
     return;
   }
-  if (!sessions_.login(conn.fd(), user.user_id, user.nickname, &error)) {
-    sendAuthError(conn, packet.header.request_id, "LOGIN_FAILED", error);
+
+  PendingAuth pending;
+  pending.user_id = user.user_id;
+  pending.nickname = user.nickname;
+  pending.password = password;
+  submitAuthJob(conn, packet.header.request_id, std::move(pending), std::move(job));
+}
+
+void TcpServer::submitAuthJob(Connection& conn, uint64_t request_id, PendingAuth pending, PasswordJob job) {
+  // bcrypt runs on the password pool; the reply is sent from finishAuthJobs().
+  if (conn.authPending()) {
+    sendAuthError(conn, request_id, "AUTH_IN_PROGRESS", "previous auth request still running");
+    return;
+  }
+  job.job_id = next_auth_job_id_++;
+  job.cost = bcrypt_cost_;
+  const auto job_id = job.job_id;
+  if (!password_pool_.submit(std::move(job))) {
+    sendAuthError(conn, request_id, "SERVER_BUSY", "too many pending auth requests");
     return;
   }
+  pending.fd = conn.fd();
+  pending.connection_id = conn.id();
+  pending.peer_address = conn.peerAddress();
+  pending.request_id = request_id;
+  pending_auth_.emplace(job_id, std::move(pending));
+  conn.setAuthPending(true);
+}
+
+void TcpServer::finishAuthJobs() {
+  for (auto& result : password_pool_.takeResults()) {
+    auto rehash_it = rehash_jobs_.find(result.job_id);
+    if (rehash_it != rehash_jobs_.end()) {
+      // Hash was below the calibrated cost; written back in batches.
+      if (result.ok) {
+        pending_rehashes_.emplace_back(std::move(rehash_it->second), std::move(result.hash));
+      }
+      rehash_jobs_.erase(rehash_it);
+      continue;
+    }
+    auto pending_it = pending_auth_.find(result.job_id);
+    if (pending_it == pending_auth_.end()) {
+      continue;
+    }
+    PendingAuth pending = std::move(pending_it->second);
+    pending_auth_.erase(pending_it);
+
+    std::string error = result.error;
+    bool ok = result.ok;
+    if (ok && pending.is_register) {
+      ok = auth_service_.createUser(pending.user_id, pending.nickname, result.hash, &error);
+    }
+    if (!ok && !pending.is_register) {
+      login_throttle_.recordFailure(pending.user_id, pending.peer_address, nowSeconds());
+    }
+    if (ok && !pending.is_register && result.stale_cost) {
+      // The login reply does not wait for this; the new hash is computed
+      // when the pool has nothing else to do.
+      PasswordJob rehash;
+      rehash.job_id = next_auth_job_id_++;
+      rehash.kind = PasswordJobKind::Hash;
+      rehash.password = std::move(pending.password);
+      rehash.cost = bcrypt_cost_;
+      const auto job_id = rehash.job_id;
+      if (password_pool_.submit(std::move(rehash), true)) {
+        rehash_jobs_.emplace(job_id, pending.user_id);
+      }
+    }
+
+    // The client may have gone away, or its fd may already belong to a new
+    // connection, while the job was queued.
+    auto conn_it = connections_.find(pending.fd);
+    if (conn_it == connections_.end() || conn_it->second->id() != pending.connection_id) {
+      continue;
+    }
+    Connection& conn = *conn_it->second;
+    conn.setAuthPending(false);
+
+    if (pending.is_register) {
+      if (!ok) {
+        sendAuthError(conn, pending.request_id, "REGISTER_FAILED", error);
+        continue;
+      }
+      nlohmann::json extra;
+      extra["registered"] = true;
+      extra["logged_in"] = false;
+      sendResponse(conn,
+                   onlinetalk::common::PacketType::AuthOk,
+                   pending.request_id,
+                   "ok",
+                   "",
+                   "",
+                   extra.dump());
+      continue;
+    }
 
+    if (!ok || !sessions_.login(conn.fd(), pending.user_id, pending.nickname, &error)) {
+      sendAuthError(conn, pending.request_id, "LOGIN_FAILED", error);
+      continue;
+    }
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
+                                    "login ok: " + pending.user_id);
+    std::string data_token;
+    if (newDataToken(&data_token)) {
+      sessions_.setDataToken(conn.fd(), data_token);
+    } else {
+      onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                      "no data token for " + pending.user_id + ": RAND_bytes failed");
+    }
+    sendAuthOk(conn, pending.request_id);
+    broadcastUserList();
+    deliverOfflineMessages(pending.user_id, conn);
+    deliverPendingEphemeral(pending.user_id, conn);
+    deliverOfflineFiles(pending.user_id, conn);
+  }
+}
+
+void TcpServer::handleDataAttach(Connection& conn, const onlinetalk::common::Packet& packet) {
+  const auto type = static_cast<onlinetalk::common::PacketType>(packet.header.type);
+  nlohmann::json meta;
+  std::string error;
+  if (!parseJson(packet.meta_json, &meta, &error)) {
+    sendResponse(conn, type, packet.header.request_id, "error", "INVALID_JSON", error, "");
+    return;
+  }
+  if (!sessions_.attachData(conn.fd(), meta.value("token", ""), &error)) {
+    sendResponse(conn, type, packet.header.request_id, "error", "ATTACH_FAILED", error, "");
+    return;
+  }
   onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
-                                  "login ok: " + user.user_id);
-  sendAuthOk(conn, packet.header.request_id);
-  broadcastUserList();
-  deliverOfflineMessages(user.user_id, conn);
-  deliverOfflineFiles(user.user_id, conn);
+                                  "data connection attached fd=" + std::to_string(conn.fd()));
+  sendResponse(conn, type, packet.header.request_id, "ok", "", "", "");
 }
 
 void TcpServer::handleGroup(Connection& conn, const onlinetalk::common::Packet& packet) {
@@ -574,14 +1098,22 @@ void TcpServer::handleGroup(Connection& conn, const onlinetalk::common::Packet&
       sendResponse(conn, type, packet.header.request_id, "error", "INVALID_NAME", error, "");
       return;
     }
+    const bool ephemeral = meta.value("ephemeral", false);
+    const auto message_ttl = meta.value("message_ttl", static_cast<int64_t>(0));
+    if (message_ttl < 0 || message_ttl > kMaxEphemeralTtlSeconds) {
+      sendResponse(conn, type, packet.header.request_id, "error", "INVALID_TTL", "message_ttl out of range", "");
+      return;
+    }
     std::string group_id;
-    if (!group_service_.createGroup(session->user_id, name, &group_id, &error)) {
+    if (!group_service_.createGroup(session->user_id, name, ephemeral, message_ttl, &group_id, &error)) {
       sendResponse(conn, type, packet.header.request_id, "error", "CREATE_FAILED", error, "");
       return;
     }
     nlohmann::json extra;
     extra["group_id"] = group_id;
     extra["name"] = name;
+    extra["ephemeral"] = ephemeral;
+    extra["message_ttl"] = message_ttl;
     sendResponse(conn, type, packet.header.request_id, "ok", "", "", extra.dump());
     return;
   }
@@ -610,6 +1142,7 @@ void TcpServer::handleGroup(Connection& conn, const onlinetalk::common::Packet&
       sendResponse(conn, type, packet.header.request_id, "error", "LEAVE_FAILED", error, "");
       return;
     }
+    file_service_.invalidateDownloads("group", group_id, session->user_id);
     sendResponse(conn, type, packet.header.request_id, "ok", "", "", "");
     return;
   }
@@ -647,6 +1180,7 @@ void TcpServer::handleGroup(Connection& conn, const onlinetalk::common::Packet&
         sendResponse(conn, type, packet.header.request_id, "error", "KICK_FAILED", error, "");
         return;
       }
+      file_service_.invalidateDownloads("group", group_id, target);
       sendResponse(conn, type, packet.header.request_id, "ok", "", "", "");
       return;
     }
@@ -656,6 +1190,9 @@ void TcpServer::handleGroup(Connection& conn, const onlinetalk::common::Packet&
         sendResponse(conn, type, packet.header.request_id, "error", "DISSOLVE_FAILED", error, "");
         return;
       }
+      purge_pending_ = true;
+      file_service_.invalidateDownloads("group", group_id, "");
+      ephemeral_store_.dropConversation(MessageService::conversationKey("group", session->user_id, group_id));
       sendResponse(conn, type, packet.header.request_id, "ok", "", "", "");
       return;
     }
@@ -709,6 +1246,8 @@ void TcpServer::handleMessage(Connection& conn, const onlinetalk::common::Packet
   const auto conversation_type = meta.value("conversation_type", "");
   const auto conversation_id = meta.value("conversation_id", "");
   const auto content = meta.value("content", "");
+  bool ephemeral = meta.value("ephemeral", false);
+  auto ttl_seconds = meta.value("ttl_seconds", static_cast<int64_t>(0));
 
   if (!validateField(conversation_type, "conversation_type", kMaxFieldLength, &error) ||
       !validateField(conversation_id, "conversation_id", kMaxFieldLength, &error) ||
@@ -717,6 +1256,11 @@ void TcpServer::handleMessage(Connection& conn, const onlinetalk::common::Packet
                  "error", "INVALID_REQUEST", error, "");
     return;
   }
+  if (ttl_seconds < 0 || ttl_seconds > kMaxEphemeralTtlSeconds) {
+    sendResponse(conn, onlinetalk::common::PacketType::MessageSend, packet.header.request_id,
+                 "error", "INVALID_TTL", "ttl_seconds out of range", "");
+    return;
+  }
 
   std::vector<std::string> recipients;
   if (conversation_type == "private") {
@@ -751,6 +1295,18 @@ void TcpServer::handleMessage(Connection& conn, const onlinetalk::common::Packet
                    "error", "NO_RECIPIENTS", "no recipients available", "");
       return;
     }
+    GroupInfo info;
+    if (!group_service_.getGroupInfo(conversation_id, &info, &error)) {
+      sendResponse(conn, onlinetalk::common::PacketType::MessageSend, packet.header.request_id,
+                   "error", "GROUP_LOOKUP_FAILED", error, "");
+      return;
+    }
+    if (info.ephemeral) {
+      ephemeral = true;
+      if (ttl_seconds == 0) {
+        ttl_seconds = info.message_ttl;
+      }
+    }
   } else {
     sendResponse(conn, onlinetalk::common::PacketType::MessageSend, packet.header.request_id,
                  "error", "INVALID_CONVERSATION_TYPE", "use private or group", "");
@@ -764,6 +1320,11 @@ void TcpServer::handleMessage(Connection& conn, const onlinetalk::common::Packet
   input.sender_nickname = session->nickname;
   input.content = content;
 
+  if (ephemeral) {
+    sendEphemeralMessage(conn, packet.header.request_id, input, recipients, ttl_seconds);
+    return;
+  }
+
   StoredMessage stored;
   if (!message_service_.storeMessage(input, recipients, &stored, &error)) {
     sendResponse(conn, onlinetalk::common::PacketType::MessageSend, packet.header.request_id,
@@ -773,12 +1334,14 @@ void TcpServer::handleMessage(Connection& conn, const onlinetalk::common::Packet
 
   nlohmann::json ack;
   ack["message_id"] = stored.message_id;
+  ack["seq"] = stored.conversation_seq;
   ack["created_at"] = stored.created_at;
   sendResponse(conn, onlinetalk::common::PacketType::MessageSend, packet.header.request_id,
                "ok", "", "", ack.dump());
 
   nlohmann::json deliver_meta;
   deliver_meta["message_id"] = stored.message_id;
+  deliver_meta["seq"] = stored.conversation_seq;
   deliver_meta["conversation_type"] = stored.conversation_type;
   deliver_meta["conversation_id"] = stored.conversation_id;
   deliver_meta["sender_id"] = stored.sender_id;
@@ -807,6 +1370,63 @@ void TcpServer::handleMessage(Connection& conn, const onlinetalk::common::Packet
   }
 }
 
+void TcpServer::sendEphemeralMessage(Connection& conn,
+                                     uint64_t request_id,
+                                     const MessageInput& input,
+                                     const std::vector<std::string>& recipients,
+                                     int64_t ttl_seconds) {
+  EphemeralMessage message;
+  message.conversation_type = input.conversation_type;
+  message.conversation_id = input.conversation_id;
+  message.sender_id = input.sender_id;
+  message.sender_nickname = input.sender_nickname;
+  message.content = input.content;
+  message.created_at = nowSeconds();
+  message.expires_at = ttl_seconds > 0 ? message.created_at + ttl_seconds : 0;
+
+  // Fan out straight from memory; only recipients that are offline right now
+  // are remembered, and only for as long as the backlog keeps the message.
+  std::vector<Connection*> online;
+  for (const auto& user_id : recipients) {
+    int fd = -1;
+    auto it = sessions_.tryGetFd(user_id, &fd) ? connections_.find(fd) : connections_.end();
+    if (it == connections_.end()) {
+      message.pending.push_back(user_id);
+      continue;
+    }
+    online.push_back(it->second.get());
+  }
+
+  const auto key = MessageService::conversationKey(input.conversation_type, input.sender_id, input.conversation_id);
+  const auto& stored = ephemeral_store_.add(key, std::move(message));
+
+  nlohmann::json ack;
+  ack["message_id"] = 0;
+  ack["seq"] = 0;
+  ack["ephemeral"] = true;
+  ack["ephemeral_id"] = stored.ephemeral_id;
+  ack["created_at"] = stored.created_at;
+  ack["expires_at"] = stored.expires_at;
+  sendResponse(conn, onlinetalk::common::PacketType::MessageSend, request_id, "ok", "", "", ack.dump());
+
+  const auto deliver_payload = ephemeralItem(stored).dump();
+  for (auto* target : online) {
+    target->queueWrite(buildPacket(onlinetalk::common::PacketType::MessageDeliver, 0, deliver_payload, nullptr));
+    updateEpollEvents(target->fd(), true);
+  }
+}
+
+void TcpServer::deliverPendingEphemeral(const std::string& user_id, Connection& conn) {
+  const auto messages = ephemeral_store_.takePending(user_id, nowSeconds());
+  if (messages.empty()) {
+    return;
+  }
+  for (const auto& msg : messages) {
+    conn.queueWrite(buildPacket(onlinetalk::common::PacketType::MessageDeliver, 0, ephemeralItem(msg).dump(), nullptr));
+  }
+  updateEpollEvents(conn.fd(), true);
+}
+
 void TcpServer::handleHistory(Connection& conn, const onlinetalk::common::Packet& packet) {
   const auto* session = sessions_.getSession(conn.fd());
   if (!session || !session->logged_in) {
@@ -870,6 +1490,33 @@ void TcpServer::handleHistory(Connection& conn, const onlinetalk::common::Packet
                    "error", "NOT_IN_GROUP", error, "");
       return;
     }
+    GroupInfo info;
+    if (!group_service_.getGroupInfo(conversation_id, &info, &error)) {
+      sendResponse(conn, onlinetalk::common::PacketType::HistoryResponse, packet.header.request_id,
+                   "error", "GROUP_LOOKUP_FAILED", error, "");
+      return;
+    }
+    if (info.ephemeral) {
+      // Ephemeral groups have no stored history; serve the in-memory backlog
+      // as a single page.
+      nlohmann::json payload;
+      payload["conversation_type"] = conversation_type;
+      payload["conversation_id"] = conversation_id;
+      payload["ephemeral"] = true;
+      nlohmann::json items = nlohmann::json::array();
+      if (before_message_id == 0) {
+        const auto key = MessageService::conversationKey(conversation_type, session->user_id, conversation_id);
+        for (const auto& msg : ephemeral_store_.recent(key, nowSeconds(), static_cast<size_t>(limit))) {
+          items.push_back(ephemeralItem(msg));
+        }
+      }
+      payload["count"] = static_cast<int>(items.size());
+      payload["messages"] = std::move(items);
+      payload["next_before_message_id"] = 0;
+      sendResponse(conn, onlinetalk::common::PacketType::HistoryResponse, packet.header.request_id,
+                   "ok", "", "", payload.dump());
+      return;
+    }
   } else {
     sendResponse(conn, onlinetalk::common::PacketType::HistoryResponse, packet.header.request_id,
                  "error", "INVALID_CONVERSATION_TYPE", "use private or group", "");
@@ -896,13 +1543,7 @@ void TcpServer::handleHistory(Connection& conn, const onlinetalk::common::Packet
   payload["conversation_id"] = conversation_id;
   nlohmann::json items = nlohmann::json::array();
   for (const auto& msg : messages) {
-    nlohmann::json item;
-    item["message_id"] = msg.message_id;
-    item["sender_id"] = msg.sender_id;
-    item["sender_nickname"] = msg.sender_nickname;
-    item["content"] = msg.content;
-    item["created_at"] = msg.created_at;
-    items.push_back(std::move(item));
+    items.push_back(historyItem(msg, messageText(msg)));
   }
   payload["messages"] = std::move(items);
   payload["count"] = static_cast<int>(messages.size());
@@ -917,6 +1558,268 @@ void TcpServer::handleHistory(Connection& conn, const onlinetalk::common::Packet
                payload.dump());
 }
 
+void TcpServer::handleHistoryBatch(Connection& conn, const onlinetalk::common::Packet& packet) {
+  const auto* session = sessions_.getSession(conn.fd());
+  if (!session || !session->logged_in) {
+    sendResponse(conn,
+                 onlinetalk::common::PacketType::HistoryBatchResponse,
+                 packet.header.request_id,
+                 "error",
+                 "NOT_LOGGED_IN",
+                 "login required",
+                 "");
+    return;
+  }
+
+  nlohmann::json meta;
+  std::string error;
+  if (!parseJson(packet.meta_json, &meta, &error)) {
+    sendResponse(conn, onlinetalk::common::PacketType::HistoryBatchResponse, packet.header.request_id,
+                 "error", "INVALID_JSON", error, "");
+    return;
+  }
+  if (!meta.contains("conversations") || !meta["conversations"].is_array()) {
+    sendResponse(conn, onlinetalk::common::PacketType::HistoryBatchResponse, packet.header.request_id,
+                 "error", "INVALID_REQUEST", "conversations array is required", "");
+    return;
+  }
+  const auto& entries = meta["conversations"];
+  if (entries.size() > kMaxHistoryBatch) {
+    sendResponse(conn, onlinetalk::common::PacketType::HistoryBatchResponse, packet.header.request_id,
+                 "error", "TOO_MANY_CONVERSATIONS", "too many conversations in one batch", "");
+    return;
+  }
+  const int max_limit = std::max(1, config_.history_page_size);
+
+  // Validate every entry first so access checks collapse into one lookup per
+  // conversation kind instead of one query per entry.
+  std::vector<HistoryQuery> queries;
+  std::vector<std::string> private_ids;
+  std::vector<std::string> group_ids;
+  nlohmann::json results = nlohmann::json::array();
+  for (const auto& entry : entries) {
+    HistoryQuery query;
+    if (entry.is_object()) {
+      query.conversation_type = entry.value("conversation_type", "");
+      query.conversation_id = entry.value("conversation_id", "");
+      query.before_message_id = entry.value("before_message_id", static_cast<int64_t>(0));
+      query.limit = entry.value("limit", max_limit);
+    }
+    if (query.limit <= 0 || query.limit > max_limit) {
+      query.limit = max_limit;
+    }
+
+    nlohmann::json result;
+    result["conversation_type"] = query.conversation_type;
+    result["conversation_id"] = query.conversation_id;
+    std::string entry_error;
+    if (!validateField(query.conversation_type, "conversation_type", kMaxFieldLength, &entry_error) ||
+        !validateField(query.conversation_id, "conversation_id", kMaxFieldLength, &entry_error)) {
+      result["status"] = "error";
+      result["code"] = "INVALID_REQUEST";
+      result["message"] = entry_error;
+    } else if (query.conversation_type == "private") {
+      private_ids.push_back(query.conversation_id);
+    } else if (query.conversation_type == "group") {
+      group_ids.push_back(query.conversation_id);
+    } else {
+      result["status"] = "error";
+      result["code"] = "INVALID_CONVERSATION_TYPE";
+      result["message"] = "use private or group";
+    }
+    queries.push_back(std::move(query));
+    results.push_back(std::move(result));
+  }
+
+  std::unordered_set<std::string> existing_users;
+  if (!auth_service_.existingUsers(private_ids, &existing_users, &error)) {
+    sendResponse(conn, onlinetalk::common::PacketType::HistoryBatchResponse, packet.header.request_id,
+                 "error", "USER_LOOKUP_FAILED", error, "");
+    return;
+  }
+  std::unordered_map<std::string, std::string> roles;
+  if (!group_service_.getUserRoles(session->user_id, group_ids, &roles, &error)) {
+    sendResponse(conn, onlinetalk::common::PacketType::HistoryBatchResponse, packet.header.request_id,
+                 "error", "GROUP_LOOKUP_FAILED", error, "");
+    return;
+  }
+
+  std::vector<HistoryQuery> allowed;
+  std::vector<size_t> allowed_index;
+  for (size_t i = 0; i < queries.size(); ++i) {
+    auto& result = results[i];
+    if (result.contains("status")) {
+      continue;
+    }
+    const auto& query = queries[i];
+    if (query.conversation_type == "private" && existing_users.count(query.conversation_id) == 0) {
+      result["status"] = "error";
+      result["code"] = "TARGET_NOT_FOUND";
+      result["message"] = "target user not found";
+      continue;
+    }
+    if (query.conversation_type == "group" && roles.count(query.conversation_id) == 0) {
+      result["status"] = "error";
+      result["code"] = "NOT_IN_GROUP";
+      result["message"] = "user not in group";
+      continue;
+    }
+    allowed.push_back(query);
+    allowed_index.push_back(i);
+  }
+
+  std::vector<std::vector<StoredMessage>> pages;
+  if (!message_service_.fetchHistoryBatch(session->user_id, allowed, &pages, &error)) {
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                    "history batch failed for user " + session->user_id + ": " + error);
+    sendResponse(conn, onlinetalk::common::PacketType::HistoryBatchResponse, packet.header.request_id,
+                 "error", "HISTORY_FAILED", error, "");
+    return;
+  }
+  for (size_t i = 0; i < pages.size(); ++i) {
+    const auto& messages = pages[i];
+    auto& result = results[allowed_index[i]];
+    nlohmann::json items = nlohmann::json::array();
+    for (const auto& msg : messages) {
+      items.push_back(historyItem(msg, messageText(msg)));
+    }
+    result["status"] = "ok";
+    result["messages"] = std::move(items);
+    result["count"] = static_cast<int>(messages.size());
+    result["next_before_message_id"] = messages.empty() ? 0 : messages.front().message_id;
+  }
+
+  nlohmann::json payload;
+  payload["conversations"] = std::move(results);
+  sendResponse(conn,
+               onlinetalk::common::PacketType::HistoryBatchResponse,
+               packet.header.request_id,
+               "ok",
+               "",
+               "",
+               payload.dump());
+}
+
+void TcpServer::handleSync(Connection& conn, const onlinetalk::common::Packet& packet) {
+  const auto* session = sessions_.getSession(conn.fd());
+  if (!session || !session->logged_in) {
+    sendResponse(conn,
+                 onlinetalk::common::PacketType::SyncResponse,
+                 packet.header.request_id,
+                 "error",
+                 "NOT_LOGGED_IN",
+                 "login required",
+                 "");
+    return;
+  }
+
+  nlohmann::json meta;
+  std::string error;
+  if (!parseJson(packet.meta_json, &meta, &error)) {
+    sendResponse(conn, onlinetalk::common::PacketType::SyncResponse, packet.header.request_id,
+                 "error", "INVALID_JSON", error, "");
+    return;
+  }
+  if (!meta.contains("conversations") || !meta["conversations"].is_array()) {
+    sendResponse(conn, onlinetalk::common::PacketType::SyncResponse, packet.header.request_id,
+                 "error", "INVALID_REQUEST", "conversations array is required", "");
+    return;
+  }
+  const auto& cursors = meta["conversations"];
+  if (cursors.size() > kMaxSyncConversations) {
+    sendResponse(conn, onlinetalk::common::PacketType::SyncResponse, packet.header.request_id,
+                 "error", "TOO_MANY_CONVERSATIONS", "too many conversations in one sync", "");
+    return;
+  }
+  const int limit = std::max(1, config_.history_page_size);
+
+  nlohmann::json results = nlohmann::json::array();
+  for (const auto& cursor : cursors) {
+    if (!cursor.is_object()) {
+      continue;
+    }
+    const auto conversation_type = cursor.value("conversation_type", "");
+    const auto conversation_id = cursor.value("conversation_id", "");
+    const auto last_seq = cursor.value("last_seq", static_cast<int64_t>(0));
+
+    nlohmann::json result;
+    result["conversation_type"] = conversation_type;
+    result["conversation_id"] = conversation_id;
+    std::string entry_error;
+    if (!validateField(conversation_type, "conversation_type", kMaxFieldLength, &entry_error) ||
+        !validateField(conversation_id, "conversation_id", kMaxFieldLength, &entry_error)) {
+      result["status"] = "error";
+      result["code"] = "INVALID_REQUEST";
+      result["message"] = entry_error;
+      results.push_back(std::move(result));
+      continue;
+    }
+    if (conversation_type == "private") {
+      const bool exists = auth_service_.userExists(conversation_id, &entry_error);
+      if (!exists) {
+        result["status"] = "error";
+        result["code"] = entry_error.empty() ? "TARGET_NOT_FOUND" : "USER_LOOKUP_FAILED";
+        result["message"] = entry_error.empty() ? "target user not found" : entry_error;
+        results.push_back(std::move(result));
+        continue;
+      }
+    } else if (conversation_type == "group") {
+      std::string role;
+      if (!group_service_.getUserRole(session->user_id, conversation_id, &role, &entry_error)) {
+        result["status"] = "error";
+        result["code"] = "NOT_IN_GROUP";
+        result["message"] = entry_error;
+        results.push_back(std::move(result));
+        continue;
+      }
+    } else {
+      result["status"] = "error";
+      result["code"] = "INVALID_CONVERSATION_TYPE";
+      result["message"] = "use private or group";
+      results.push_back(std::move(result));
+      continue;
+    }
+
+    const auto key = MessageService::conversationKey(conversation_type, session->user_id, conversation_id);
+    int64_t head_seq = 0;
+    std::vector<StoredMessage> messages;
+    if (!message_service_.headSeq(key, &head_seq, &entry_error) ||
+        (head_seq > last_seq &&
+         !message_service_.fetchSince(key, last_seq, limit, &messages, &entry_error))) {
+      onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                      "sync failed for user " + session->user_id + ": " + entry_error);
+      result["status"] = "error";
+      result["code"] = "SYNC_FAILED";
+      result["message"] = entry_error;
+      results.push_back(std::move(result));
+      continue;
+    }
+
+    nlohmann::json items = nlohmann::json::array();
+    for (const auto& msg : messages) {
+      items.push_back(historyItem(msg, messageText(msg)));
+    }
+    const int64_t synced_seq = messages.empty() ? std::max(last_seq, head_seq)
+                                                : messages.back().conversation_seq;
+    result["status"] = "ok";
+    result["head_seq"] = head_seq;
+    result["synced_seq"] = synced_seq;
+    result["has_more"] = synced_seq < head_seq;
+    result["messages"] = std::move(items);
+    results.push_back(std::move(result));
+  }
+
+  nlohmann::json payload;
+  payload["conversations"] = std::move(results);
+  sendResponse(conn,
+               onlinetalk::common::PacketType::SyncResponse,
+               packet.header.request_id,
+               "ok",
+               "",
+               "",
+               payload.dump());
+}
+
 void TcpServer::handleFile(Connection& conn, const onlinetalk::common::Packet& packet) {
   const auto* session = sessions_.getSession(conn.fd());
   if (!session || !session->logged_in) {
@@ -1013,8 +1916,16 @@ void TcpServer::handleFile(Connection& conn, const onlinetalk::common::Packet& p
       offer.uploader_id = session->user_id;
       offer.uploader_nickname = session->nickname;
       offer.recipients = std::move(recipients);
+      offer.manifest = packet.binary;
+      offer.manifest_root = meta.value("manifest_root", "");
       if (!file_service_.createUpload(offer, &info, &error)) {
-        sendResponse(conn, type, packet.header.request_id, "error", "OFFER_FAILED", error, "");
+        const char* code = "OFFER_FAILED";
+        if (error == "user storage quota exceeded" || error == "group storage quota exceeded") {
+          code = "QUOTA_EXCEEDED";
+        } else if (error == "not enough disk space") {
+          code = "DISK_FULL";
+        }
+        sendResponse(conn, type, packet.header.request_id, "error", code, error, "");
         return;
       }
     }
@@ -1022,7 +1933,16 @@ void TcpServer::handleFile(Connection& conn, const onlinetalk::common::Packet& p
     nlohmann::json response;
     response["file_id"] = info.file_id;
     response["next_offset"] = info.uploaded_size;
-    response["chunk_size"] = file_service_.chunkSize();
+    response["deduplicated"] = info.deduplicated;
+    // The client may ask for a chunk size and change it as it goes, within
+    // these bounds.
+    response["chunk_size"] = file_service_.negotiateChunkSize(meta.value("chunk_size", static_cast<int64_t>(0)));
+    response["min_chunk_size"] = file_service_.minChunkSize();
+    response["max_chunk_size"] = file_service_.maxChunkSize();
+    // Clients that do not ask for a window keep stop-and-wait uploads.
+    response["window"] = std::clamp(meta.value("window", 1), 1, file_service_.uploadWindow());
+    // Chunks may then be sent deflated, flagged in the packet header.
+    response["compression"] = config_.file_compression;
     sendResponse(conn, onlinetalk::common::PacketType::FileAccept, packet.header.request_id,
                  "ok", "", "", response.dump());
     return;
@@ -1039,26 +1959,32 @@ void TcpServer::handleFile(Connection& conn, const onlinetalk::common::Packet& p
       sendResponse(conn, type, packet.header.request_id, "error", "EMPTY_CHUNK", "chunk is empty", "");
       return;
     }
-    if (static_cast<int>(packet.binary.size()) > file_service_.chunkSize()) {
+    if (static_cast<int>(packet.binary.size()) > file_service_.maxChunkSize()) {
       sendResponse(conn, type, packet.header.request_id, "error", "CHUNK_TOO_LARGE", "chunk too large", "");
       return;
     }
-    UploadInfo info;
-    if (!file_service_.appendChunk(file_id, session->user_id, offset, packet.binary, &info, &error)) {
-      nlohmann::json extra;
-      if (error == "offset mismatch") {
-        UploadInfo current;
-        std::string resume_error;
-        if (file_service_.resumeUpload(file_id, session->user_id, &current, &resume_error)) {
-          extra["expected_offset"] = current.uploaded_size;
-        }
-      }
-      sendResponse(conn, type, packet.header.request_id, "error", "UPLOAD_FAILED", error, extra.dump());
+    // The write happens on the I/O pool; the ack is sent from
+    // finishFileIoJobs().
+    // The window is checked before the payload is copied, so a sender that
+    // ignores acks cannot make the server buffer more than a window.
+    auto write = std::make_shared<FileService::ChunkWrite>();
+    write->offset = offset;
+    write->compressed = (packet.header.flags & onlinetalk::common::PacketHeader::kFlagCompressed) != 0;
+    bool window_full = false;
+    if (!file_service_.prepareChunk(file_id, session->user_id, write.get(), &window_full, &error)) {
+      sendResponse(conn, type, packet.header.request_id, "error", window_full ? "WINDOW_EXCEEDED" : "UPLOAD_FAILED",
+                   error, "");
       return;
     }
-    nlohmann::json extra;
-    extra["next_offset"] = info.uploaded_size;
-    sendResponse(conn, type, packet.header.request_id, "ok", "", "", extra.dump());
+    write->data = packet.binary;
+    PendingFileIo pending;
+    pending.request_id = packet.header.request_id;
+    pending.chunk = write;
+    if (!submitFileIo(conn, file_id, std::move(pending), [this, write] { file_service_.writeChunk(*write); },
+                      write->data.size())) {
+      file_service_.finishChunk(*write);
+      sendResponse(conn, type, packet.header.request_id, "error", "SERVER_BUSY", "file i/o unavailable", "");
+    }
     return;
   }
 
@@ -1119,33 +2045,317 @@ void TcpServer::handleFile(Connection& conn, const onlinetalk::common::Packet& p
 
   if (type == onlinetalk::common::PacketType::FileDownloadRequest) {
     const auto file_id = meta.value("file_id", "");
-    const auto offset = meta.value("offset", static_cast<int64_t>(0));
+    auto offset = meta.value("offset", static_cast<int64_t>(0));
+    const auto length = meta.value("length", static_cast<int64_t>(0));
     if (!validateField(file_id, "file_id", kMaxFieldLength, &error)) {
       sendResponse(conn, type, packet.header.request_id, "error", "INVALID_FILE_ID", error, "");
       return;
     }
-    std::vector<uint8_t> data;
-    FileNotice notice;
-    if (!file_service_.readChunk(file_id, session->user_id, offset, &data, &notice, &error)) {
-      sendResponse(conn, type, packet.header.request_id, "error", "DOWNLOAD_FAILED", error, "");
+    if (length < 0 || offset < 0 ||
+        length > std::numeric_limits<int64_t>::max() - offset - onlinetalk::common::kManifestBlockSize) {
+      sendResponse(conn, type, packet.header.request_id, "error", "INVALID_RANGE", "invalid byte range", "");
       return;
     }
-    const bool done = (offset + static_cast<int64_t>(data.size()) >= notice.file_size);
-    nlohmann::json meta_resp;
-    meta_resp["file_id"] = notice.file_id;
-    meta_resp["offset"] = offset;
-    meta_resp["file_size"] = notice.file_size;
-    meta_resp["file_name"] = notice.file_name;
-    meta_resp["sha256"] = notice.sha256;
-    meta_resp["done"] = done;
-    auto packet_out = buildPacket(onlinetalk::common::PacketType::FileDownloadChunk,
-                                  packet.header.request_id,
-                                  meta_resp.dump(),
-                                  &data);
-    conn.queueWrite(packet_out);
-    updateEpollEvents(conn.fd(), true);
+    // A range is widened to whole manifest blocks so every chunk carries the
+    // hashes to check it; the first chunk's offset says where data starts.
+    int64_t end = 0;
+    if (length > 0) {
+      end = alignUp(offset + length, onlinetalk::common::kManifestBlockSize);
+      offset -= offset % onlinetalk::common::kManifestBlockSize;
+    }
+    const int chunk_size = file_service_.negotiateChunkSize(meta.value("chunk_size", static_cast<int64_t>(0)));
+    std::shared_ptr<onlinetalk::common::ChunkCompressor> compressor;
+    if (config_.file_compression && meta.value("compress", false)) {
+      compressor = std::make_shared<onlinetalk::common::ChunkCompressor>();
+    }
+    if (!meta.value("stream", false)) {
+      // A single range comes back in one chunk, whatever its size, so a
+      // client can ask again for exactly the chunk it lost.
+      const int64_t single_size = end > 0 ? std::min<int64_t>(end - offset, file_service_.maxChunkSize()) : chunk_size;
+      int64_t next_offset = 0;
+      bool done = false;
+      if (!queueDownloadChunk(conn, packet.header.request_id, file_id, session->user_id, offset, end, single_size,
+                              compressor, &next_offset, &done, &error)) {
+        sendResponse(conn, type, packet.header.request_id, "error", "DOWNLOAD_FAILED", error, "");
+      }
+      return;
+    }
+    const auto credit = meta.value("credit", static_cast<int64_t>(0));
+    if (credit <= 0) {
+      sendResponse(conn, type, packet.header.request_id, "error", "INVALID_CREDIT", "credit must be positive", "");
+      return;
+    }
+    // A restarted whole-file stream replaces the old one, whichever
+    // connection it was on. Ranges run alongside it.
+    for (const int fd : sessionFds(conn.fd())) {
+      auto it = download_streams_.find(fd);
+      if (it == download_streams_.end()) {
+        continue;
+      }
+      auto& streams = it->second;
+      streams.erase(std::remove_if(streams.begin(), streams.end(),
+                                   [&](const DownloadStream& stream) {
+                                     return stream.file_id == file_id &&
+                                            ((stream.end == 0 && end == 0) ||
+                                             stream.request_id == packet.header.request_id);
+                                   }),
+                    streams.end());
+    }
+    auto& streams = download_streams_[conn.fd()];
+    DownloadStream stream;
+    stream.request_id = packet.header.request_id;
+    stream.file_id = file_id;
+    stream.user_id = session->user_id;
+    stream.offset = offset;
+    stream.end = end;
+    stream.credit = std::min(credit, kMaxDownloadCredit);
+    stream.sizer = onlinetalk::common::ChunkSizer(file_service_.minChunkSize(), file_service_.minChunkSize(),
+                                                  file_service_.maxChunkSize(), chunk_size);
+    stream.compressor = std::move(compressor);
+    streams.push_back(std::move(stream));
+    pumpDownloads(conn);
+    return;
+  }
+
+  if (type == onlinetalk::common::PacketType::FileDownloadCredit) {
+    const auto file_id = meta.value("file_id", "");
+    const auto credit = meta.value("credit", static_cast<int64_t>(0));
+    // Credit may arrive on another connection of the session than the one
+    // the stream runs on.
+    DownloadStream* stream = nullptr;
+    Connection* stream_conn = nullptr;
+    for (const int fd : sessionFds(conn.fd())) {
+      auto it = download_streams_.find(fd);
+      auto conn_it = connections_.find(fd);
+      if (it == download_streams_.end() || conn_it == connections_.end()) {
+        continue;
+      }
+      for (auto& candidate : it->second) {
+        if (candidate.file_id != file_id) {
+          continue;
+        }
+        // Match on the request id the stream was opened with; without one,
+        // the credit goes to the whole-file stream.
+        const bool exact = candidate.request_id == packet.header.request_id;
+        if (exact || (candidate.end == 0 && !stream)) {
+          stream = &candidate;
+          stream_conn = conn_it->second.get();
+        }
+        if (exact) {
+          break;
+        }
+      }
+    }
+    if (!stream) {
+      sendResponse(conn, type, packet.header.request_id, "error", "NO_DOWNLOAD", "no active download", "");
+      return;
+    }
+    if (credit <= 0) {
+      sendResponse(conn, type, packet.header.request_id, "error", "INVALID_CREDIT", "credit must be positive", "");
+      return;
+    }
+    stream->credit = std::min(stream->credit + credit, kMaxDownloadCredit);
+    // Credit comes back as the client writes, so its pace is the link's.
+    // Chunks the client had to fetch again count as losses.
+    stream->sizer.onAck(credit, -1, steadyMs());
+    if (meta.value("lost_chunks", 0) > 0) {
+      stream->sizer.onLoss();
+    }
+    pumpDownloads(*stream_conn);
+    return;
+  }
+}
+
+bool TcpServer::queueDownloadChunk(Connection& conn,
+                                   uint64_t request_id,
+                                   const std::string& file_id,
+                                   const std::string& user_id,
+                                   int64_t offset,
+                                   int64_t end,
+                                   int64_t chunk_size,
+                                   const std::shared_ptr<onlinetalk::common::ChunkCompressor>& compressor,
+                                   int64_t* next_offset,
+                                   bool* done,
+                                   std::string* error) {
+  std::shared_ptr<FileHandle> file;
+  int64_t length = 0;
+  FileNotice notice;
+  std::vector<onlinetalk::common::ManifestDigest> blocks;
+  if (!file_service_.openDownload(file_id, user_id, offset, end, chunk_size, &file, &length, &notice, &blocks,
+                                  error)) {
+    return false;
+  }
+  *next_offset = offset + length;
+  *done = *next_offset >= notice.file_size || (end > 0 && *next_offset >= end);
+  nlohmann::json meta;
+  meta["file_id"] = notice.file_id;
+  meta["offset"] = offset;
+  meta["length"] = length;
+  meta["file_size"] = notice.file_size;
+  meta["file_name"] = notice.file_name;
+  meta["sha256"] = notice.sha256;
+  meta["done"] = *done;
+  if (!blocks.empty()) {
+    auto& hashes = meta["block_hashes"];
+    for (const auto& block : blocks) {
+      hashes.push_back(onlinetalk::common::manifestDigestHex(block));
+    }
+  }
+  onlinetalk::common::PacketHeader header;
+  header.type = static_cast<uint16_t>(onlinetalk::common::PacketType::FileDownloadChunk);
+  header.request_id = request_id;
+  const auto meta_json = meta.dump();
+  auto prefix = onlinetalk::common::Codec::encodePrefix(header, meta_json, static_cast<uint32_t>(length));
+  if (length > 0) {
+    PendingFileIo pending;
+    pending.request_id = request_id;
+    pending.prefix = prefix;
+    pending.file = file;
+    pending.offset = offset;
+    pending.length = length;
+    std::function<void()> work = [file, offset, length] { FileService::prefetch(*file, offset, length); };
+    size_t buffered = 0;
+    if (compressor) {
+      buffered = static_cast<size_t>(length);
+      // Jobs for one file run in order on one worker, so the stream's
+      // compressor sees its chunks in sequence.
+      auto frame = std::make_shared<std::vector<uint8_t>>();
+      pending.frame = frame;
+      work = [file, offset, length, compressor, frame, header, meta_json]() mutable {
+        std::vector<uint8_t> data;
+        std::vector<uint8_t> deflated;
+        if (!FileService::readChunk(*file, offset, length, &data) ||
+            !compressor->compress(data.data(), data.size(), &deflated)) {
+          return;
+        }
+        header.flags |= onlinetalk::common::PacketHeader::kFlagCompressed;
+        *frame = onlinetalk::common::Codec::encodePrefix(header, meta_json, static_cast<uint32_t>(deflated.size()));
+        frame->insert(frame->end(), deflated.begin(), deflated.end());
+      };
+    }
+    if (submitFileIo(conn, file_id, std::move(pending), std::move(work), buffered)) {
+      prefetching_bytes_[conn.fd()] += length;
+      return true;
+    }
+  }
+  conn.queueFileFrame(std::move(prefix), std::move(file), offset, length);
+  updateEpollEvents(conn.fd(), true);
+  return true;
+}
+
+bool TcpServer::submitFileIo(Connection& conn,
+                             const std::string& file_id,
+                             PendingFileIo pending,
+                             std::function<void()> work,
+                             size_t bytes) {
+  const auto job_id = next_file_io_job_id_++;
+  if (!file_io_pool_.submit(file_id, job_id, std::move(work), bytes)) {
+    return false;
+  }
+  pending.fd = conn.fd();
+  pending.connection_id = conn.id();
+  pending_file_io_.emplace(job_id, std::move(pending));
+  return true;
+}
+
+void TcpServer::finishFileIoJobs() {
+  for (const auto job_id : file_io_pool_.takeCompleted()) {
+    auto pending_it = pending_file_io_.find(job_id);
+    if (pending_it == pending_file_io_.end()) {
+      continue;
+    }
+    PendingFileIo pending = std::move(pending_it->second);
+    pending_file_io_.erase(pending_it);
+    if (pending.chunk) {
+      file_service_.finishChunk(*pending.chunk);
+    }
+    auto conn_it = connections_.find(pending.fd);
+    if (conn_it == connections_.end() || conn_it->second->id() != pending.connection_id) {
+      continue;
+    }
+    Connection& conn = *conn_it->second;
+
+    if (!pending.chunk) {
+      prefetching_bytes_[conn.fd()] -= pending.length;
+      if (pending.frame && !pending.frame->empty()) {
+        conn.queueFileFrame(std::move(*pending.frame), nullptr, 0, 0);
+      } else {
+        conn.queueFileFrame(std::move(pending.prefix), std::move(pending.file), pending.offset, pending.length);
+      }
+      pumpDownloads(conn);
+      updateEpollEvents(conn.fd(), true);
+      continue;
+    }
+
+    const auto type = onlinetalk::common::PacketType::FileUploadChunk;
+    const auto& write = *pending.chunk;
+    // Acks on the control and data connections can overtake each other;
+    // the offset tells the client which chunk this one is for.
+    nlohmann::json extra;
+    extra["offset"] = write.offset;
+    if (!write.ok) {
+      if (write.error == "chunk hash mismatch") {
+        // Only this chunk is bad; the client resends it and carries on.
+        sendResponse(conn, type, pending.request_id, "error", "CHUNK_CORRUPT", write.error, extra.dump());
+        continue;
+      }
+      if (write.error == "offset mismatch") {
+        extra["expected_offset"] = write.next_offset;
+      }
+      sendResponse(conn, type, pending.request_id, "error", "UPLOAD_FAILED", write.error, extra.dump());
+      continue;
+    }
+    extra["next_offset"] = write.next_offset;
+    sendResponse(conn, type, pending.request_id, "ok", "", "", extra.dump());
+  }
+}
+
+void TcpServer::pumpDownloads(Connection& conn) {
+  auto it = download_streams_.find(conn.fd());
+  if (it == download_streams_.end()) {
     return;
   }
+  // Round-robin one chunk per stream per pass, and only keep a few chunks
+  // queued so control packets never sit behind a whole file.
+  auto& streams = it->second;
+  bool progressed = true;
+  // Chunks still being read on the I/O pool count against the queue too.
+  auto queued = [&] { return conn.bulkPendingBytes() + prefetching_bytes_[conn.fd()]; };
+  while (progressed && !streams.empty() && queued() < kDownloadQueueBytes) {
+    progressed = false;
+    for (auto stream = streams.begin(); stream != streams.end();) {
+      if (stream->credit <= 0 || queued() >= kDownloadQueueBytes) {
+        ++stream;
+        continue;
+      }
+      if (stream->compressor && !stream->compressor->active()) {
+        // Incompressible data: back to prefetch + sendfile for the rest.
+        stream->compressor.reset();
+      }
+      std::string error;
+      int64_t next_offset = 0;
+      bool done = false;
+      if (!queueDownloadChunk(conn, stream->request_id, stream->file_id, stream->user_id, stream->offset,
+                              stream->end, stream->sizer.size(), stream->compressor, &next_offset, &done,
+                              &error)) {
+        sendResponse(conn, onlinetalk::common::PacketType::FileDownloadRequest, stream->request_id,
+                     "error", "DOWNLOAD_FAILED", error, "");
+        stream = streams.erase(stream);
+        continue;
+      }
+      progressed = true;
+      stream->credit -= next_offset - stream->offset;
+      stream->offset = next_offset;
+      if (done) {
+        stream = streams.erase(stream);
+        continue;
+      }
+      ++stream;
+    }
+  }
+  if (streams.empty()) {
+    download_streams_.erase(it);
+  }
 }
 
 void TcpServer::deliverOfflineMessages(const std::string& user_id, Connection& conn) {
@@ -1167,11 +2377,12 @@ void TcpServer::deliverOfflineMessages(const std::string& user_id, Connection& c
     for (const auto& msg : messages) {
       nlohmann::json meta;
       meta["message_id"] = msg.message_id;
+      meta["seq"] = msg.conversation_seq;
       meta["conversation_type"] = msg.conversation_type;
       meta["conversation_id"] = msg.conversation_id;
       meta["sender_id"] = msg.sender_id;
       meta["sender_nickname"] = msg.sender_nickname;
-      meta["content"] = msg.content;
+      meta["content"] = messageText(msg);
       meta["created_at"] = msg.created_at;
       conn.queueWrite(buildPacket(onlinetalk::common::PacketType::MessageDeliver, 0, meta.dump(), nullptr));
       delivered_ids.push_back(msg.message_id);
@@ -1241,6 +2452,8 @@ void TcpServer::sendAuthOk(Connection& conn, uint64_t request_id) {
   if (session) {
     meta["user_id"] = session->user_id;
     meta["nickname"] = session->nickname;
+    // Lets the client open data connections for file traffic.
+    meta["data_token"] = session->data_token;
   }
   meta["registered"] = false;
   meta["logged_in"] = true;
@@ -1303,7 +2516,8 @@ void TcpServer::broadcastUserList() {
 
   const auto payload = meta.dump();
   for (auto& entry : connections_) {
-    if (!sessions_.isLoggedIn(entry.first)) {
+    const auto* session = sessions_.getSession(entry.first);
+    if (!session || !session->logged_in || session->control_fd >= 0) {
       continue;
     }
     entry.second->queueWrite(buildPacket(onlinetalk::common::PacketType::UserListUpdate, 0, payload, nullptr));
@@ -1336,13 +2550,34 @@ void TcpServer::updateEpollEvents(int fd, bool want_write) {
 }
 
 void TcpServer::disconnect(int fd) {
+  const auto* session = sessions_.getSession(fd);
+  const bool data = session && session->control_fd >= 0;
+  // Data connections live only as long as the control connection they serve.
+  const auto data_fds = data ? std::vector<int>() : sessions_.dataConnections(fd);
   sessions_.removeConnection(fd);
+  download_streams_.erase(fd);
+  prefetching_bytes_.erase(fd);
   connections_.erase(fd);
   ::epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
   ::close(fd);
   onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
-                                  "client disconnected fd=" + std::to_string(fd));
-  broadcastUserList();
+                                  std::string(data ? "data connection" : "client") + " disconnected fd=" +
+                                      std::to_string(fd));
+  for (const int data_fd : data_fds) {
+    disconnect(data_fd);
+  }
+  if (!data) {
+    broadcastUserList();
+  }
+}
+
+std::vector<int> TcpServer::sessionFds(int fd) const {
+  const auto* session = sessions_.getSession(fd);
+  const int control_fd = session && session->control_fd >= 0 ? session->control_fd : fd;
+  std::vector<int> fds{control_fd};
+  const auto data_fds = sessions_.dataConnections(control_fd);
+  fds.insert(fds.end(), data_fds.begin(), data_fds.end());
+  return fds;
 }
 
 bool TcpServer::initDatabase(std::string* error) {
@@ -1352,6 +2587,10 @@ bool TcpServer::initDatabase(std::string* error) {
   if (!database_.initSchema(error)) {
     return false;
   }
+  message_service_.setCompression(config_.message_compression);
+  if (!message_service_.loadDictionaries(error)) {
+    return false;
+  }
   return file_service_.ensureStorage(error);
 }
 
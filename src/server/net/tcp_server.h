@@ -1,24 +1,76 @@
 #pragma once
 
+#include <chrono>
 #include <cstdint>
+#include <functional>
 #include <memory>
 #include <string>
 #include <unordered_map>
+#include <utility>
 #include <vector>
 
+#include "common/compress/chunk_compressor.h"
 #include "common/config.h"
 #include "common/net/byte_buffer.h"
+#include "common/net/chunk_sizer.h"
 #include "common/protocol/packet.h"
 #include "server/net/connection.h"
 #include "server/services/auth_service.h"
+#include "server/services/ephemeral_store.h"
+#include "server/services/file_io_pool.h"
 #include "server/services/file_service.h"
 #include "server/services/group_service.h"
+#include "server/services/login_throttle.h"
 #include "server/services/message_service.h"
+#include "server/services/password_pool.h"
 #include "server/session/session_manager.h"
 #include "server/storage/database.h"
 
 namespace onlinetalk::server {
 
+struct PendingAuth {
+  int fd = -1;
+  uint64_t connection_id = 0;
+  uint64_t request_id = 0;
+  bool is_register = false;
+  std::string peer_address;
+  std::string user_id;
+  std::string nickname;
+  std::string password;  // login only, for a rehash if the stored cost is stale
+};
+
+// File I/O handed to the I/O pool, answered from finishFileIoJobs(). Either an
+// upload chunk being written, or a download chunk being read into the page
+// cache before its frame is queued.
+struct PendingFileIo {
+  int fd = -1;
+  uint64_t connection_id = 0;
+  uint64_t request_id = 0;
+  std::shared_ptr<FileService::ChunkWrite> chunk;
+  std::vector<uint8_t> prefix;
+  std::shared_ptr<FileHandle> file;
+  int64_t offset = 0;
+  int64_t length = 0;
+  // Filled with the whole frame when the chunk was read and deflated on the
+  // pool; otherwise the chunk goes out with sendfile().
+  std::shared_ptr<std::vector<uint8_t>> frame;
+};
+
+// A download the server pushes chunk by chunk while the client has credit
+// (bytes it is willing to receive) left.
+struct DownloadStream {
+  uint64_t request_id = 0;
+  std::string file_id;
+  std::string user_id;
+  int64_t offset = 0;
+  int64_t end = 0;  // exclusive; 0 streams to the end of the file
+  int64_t credit = 0;
+  // Fed by returning credit: how fast the client drains the stream.
+  onlinetalk::common::ChunkSizer sizer;
+  // Set when the client takes deflated chunks.
+  std::shared_ptr<onlinetalk::common::ChunkCompressor> compressor;
+};
+
 class TcpServer {
  public:
   explicit TcpServer(const onlinetalk::common::ServerConfig& config);
@@ -30,6 +82,11 @@ class TcpServer {
 
  private:
   bool setupListener(std::string* error);
+  bool budgetFileDescriptors(std::string* error);
+  void runMaintenance();
+  bool purgeDissolvedGroupStep();
+  bool storageSweepStep();
+  std::string messageText(const StoredMessage& msg);
   void acceptConnections();
   bool handleRead(Connection& conn);
   bool handleWrite(Connection& conn);
@@ -40,12 +97,44 @@ class TcpServer {
                   std::string* error) const;
 
   void handleAuth(Connection& conn, const onlinetalk::common::Packet& packet);
+  void handleDataAttach(Connection& conn, const onlinetalk::common::Packet& packet);
+  // The connection's control fd followed by every data connection of it.
+  std::vector<int> sessionFds(int fd) const;
   void handleRegister(Connection& conn, const onlinetalk::common::Packet& packet);
   void handleLogin(Connection& conn, const onlinetalk::common::Packet& packet);
+  void submitAuthJob(Connection& conn, uint64_t request_id, PendingAuth pending, PasswordJob job);
+  void finishAuthJobs();
+  // `bytes` is the memory the job holds until it finishes; see FileIoPool.
+  bool submitFileIo(Connection& conn,
+                    const std::string& file_id,
+                    PendingFileIo pending,
+                    std::function<void()> work,
+                    size_t bytes = 0);
+  void finishFileIoJobs();
   void handleGroup(Connection& conn, const onlinetalk::common::Packet& packet);
   void handleMessage(Connection& conn, const onlinetalk::common::Packet& packet);
   void handleHistory(Connection& conn, const onlinetalk::common::Packet& packet);
+  void handleHistoryBatch(Connection& conn, const onlinetalk::common::Packet& packet);
+  void handleSync(Connection& conn, const onlinetalk::common::Packet& packet);
   void handleFile(Connection& conn, const onlinetalk::common::Packet& packet);
+  bool queueDownloadChunk(Connection& conn,
+                          uint64_t request_id,
+                          const std::string& file_id,
+                          const std::string& user_id,
+                          int64_t offset,
+                          int64_t end,
+                          int64_t chunk_size,
+                          const std::shared_ptr<onlinetalk::common::ChunkCompressor>& compressor,
+                          int64_t* next_offset,
+                          bool* done,
+                          std::string* error);
+  void pumpDownloads(Connection& conn);
+  void sendEphemeralMessage(Connection& conn,
+                            uint64_t request_id,
+                            const MessageInput& input,
+                            const std::vector<std::string>& recipients,
+                            int64_t ttl_seconds);
+  void deliverPendingEphemeral(const std::string& user_id, Connection& conn);
   void deliverOfflineMessages(const std::string& user_id, Connection& conn);
   void deliverOfflineFiles(const std::string& user_id, Connection& conn);
   void sendAuthError(Connection& conn,
@@ -73,13 +162,48 @@ class TcpServer {
   int listen_fd_ = -1;
   int epoll_fd_ = -1;
   bool running_ = false;
+  bool purge_pending_ = true;
+  std::string purge_group_id_;
+  std::chrono::steady_clock::time_point next_purge_step_{};
+  bool training_pending_ = false;
+  bool compaction_pending_ = true;
+  int64_t compaction_cursor_ = 0;
+  bool nickname_pass_pending_ = true;
+  int64_t nickname_cursor_ = 0;
+  std::chrono::steady_clock::time_point next_nickname_step_{};
+  std::chrono::steady_clock::time_point next_training_{};
+  std::chrono::steady_clock::time_point next_ephemeral_sweep_{};
+  std::chrono::steady_clock::time_point next_transfer_sweep_{};
+  bool storage_sweep_pending_ = false;
+  bool storage_sweep_orphans_ = false;  // second pass: files on disk
+  int64_t storage_sweep_removed_ = 0;
+  int64_t storage_sweep_bytes_ = 0;
+  std::chrono::steady_clock::time_point next_storage_sweep_{};
+  std::chrono::steady_clock::time_point next_storage_sweep_step_{};
+  std::chrono::steady_clock::time_point next_stats_log_{};
+  uint64_t logged_login_failures_ = 0;
+  uint64_t next_connection_id_ = 1;
+  uint64_t next_auth_job_id_ = 1;
+  std::unordered_map<uint64_t, PendingAuth> pending_auth_;
+  std::unordered_map<uint64_t, std::string> rehash_jobs_;  // job id -> user id
+  std::vector<std::pair<std::string, std::string>> pending_rehashes_;
+  std::chrono::steady_clock::time_point next_rehash_flush_{};
+  int bcrypt_cost_ = 0;
   SessionManager sessions_;
   std::unordered_map<int, std::unique_ptr<Connection>> connections_;
+  std::unordered_map<int, std::vector<DownloadStream>> download_streams_;  // by fd
+  std::unordered_map<int, int64_t> prefetching_bytes_;  // download bytes on the I/O pool, by fd
+  std::unordered_map<uint64_t, PendingFileIo> pending_file_io_;
+  uint64_t next_file_io_job_id_ = 1;
   Database database_;
   AuthService auth_service_;
   GroupService group_service_;
   MessageService message_service_;
   FileService file_service_;
+  EphemeralStore ephemeral_store_;
+  PasswordPool password_pool_;
+  FileIoPool file_io_pool_;
+  LoginThrottle login_throttle_;
 };
 
 }  // namespace onlinetalk::server
@@ -1,7 +1,9 @@
 #include "server/services/auth_service.h"
 
+#include <algorithm>
 #include <chrono>
 #include <crypt.h>
+#include <cstdlib>
 
 namespace onlinetalk::server {
 
@@ -12,17 +14,20 @@ int64_t nowSeconds() {
   return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
 }
 
+constexpr int kMinBcryptCost = 10;
+constexpr int kMaxBcryptCost = 16;
+
 }  // namespace
 
 AuthService::AuthService(Database& db) : db_(db) {}
 
-bool AuthService::registerUser(const std::string& user_id,
-                               const std::string& nickname,
-                               const std::string& password,
-                               std::string* error) {
-  if (user_id.empty() || nickname.empty() || password.empty()) {
+bool AuthService::createUser(const std::string& user_id,
+                             const std::string& nickname,
+                             const std::string& password_hash,
+                             std::string* error) {
+  if (user_id.empty() || nickname.empty() || password_hash.empty()) {
     if (error) {
-      *error = "user_id, nickname, password are required";
+      *error = "user_id, nickname, password_hash are required";
     }
     return false;
   }
@@ -42,11 +47,6 @@ bool AuthService::registerUser(const std::string& user_id,
     return false;
   }
 
-  const auto hash = hashPassword(password, error);
-  if (hash.empty()) {
-    return false;
-  }
-
   const std::string sql =
       "INSERT INTO users(user_id, nickname, password_hash, created_at) VALUES(?,?,?,?);";
   Statement stmt(db_.handle(), sql, error);
@@ -55,7 +55,7 @@ bool AuthService::registerUser(const std::string& user_id,
   }
   sqlite3_bind_text(stmt.get(), 1, user_id.c_str(), -1, SQLITE_TRANSIENT);
   sqlite3_bind_text(stmt.get(), 2, nickname.c_str(), -1, SQLITE_TRANSIENT);
-  sqlite3_bind_text(stmt.get(), 3, hash.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(stmt.get(), 3, password_hash.c_str(), -1, SQLITE_TRANSIENT);
   sqlite3_bind_int64(stmt.get(), 4, nowSeconds());
   if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
     if (error) {
@@ -66,13 +66,17 @@ bool AuthService::registerUser(const std::string& user_id,
   return true;
 }
 
-bool AuthService::loginUser(const std::string& user_id,
-                            const std::string& password,
-                            AuthUser* user,
-                            std::string* error) {
-  if (!user) {
+bool AuthService::loadCredentials(const std::string& user_id,
+                                  AuthUser* user,
+                                  std::string* password_hash,
+                                  bool* not_found,
+                                  std::string* error) {
+  if (not_found) {
+    *not_found = false;
+  }
+  if (!user || !password_hash) {
     if (error) {
-      *error = "user output is null";
+      *error = "output is null";
     }
     return false;
   }
@@ -86,24 +90,22 @@ bool AuthService::loginUser(const std::string& user_id,
   const int rc = sqlite3_step(stmt.get());
   if (rc == SQLITE_ROW) {
     const auto nickname = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 0));
-    const auto password_hash = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 1));
-    if (!nickname || !password_hash) {
+    const auto hash = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 1));
+    if (!nickname || !hash) {
       if (error) {
         *error = "user record is invalid";
       }
       return false;
     }
-    if (!verifyPassword(password, password_hash)) {
-      if (error) {
-        *error = "password mismatch";
-      }
-      return false;
-    }
     user->user_id = user_id;
     user->nickname = nickname;
+    *password_hash = hash;
     return true;
   }
   if (rc == SQLITE_DONE) {
+    if (not_found) {
+      *not_found = true;
+    }
     if (error) {
       *error = "user not found";
     }
@@ -135,17 +137,58 @@ bool AuthService::userExists(const std::string& user_id, std::string* error) {
   return false;
 }
 
-std::string AuthService::hashPassword(const std::string& password, std::string* error) {
-  constexpr int kRounds = 12;
-  const auto salt = crypt_gensalt("$2b$", kRounds, nullptr, 0);
-  if (!salt) {
+bool AuthService::existingUsers(const std::vector<std::string>& user_ids,
+                                std::unordered_set<std::string>* found,
+                                std::string* error) {
+  if (!found) {
+    if (error) {
+      *error = "found output is null";
+    }
+    return false;
+  }
+  found->clear();
+  if (user_ids.empty()) {
+    return true;
+  }
+  const std::string sql =
+      "SELECT user_id FROM users WHERE user_id IN (" + sqlPlaceholders(user_ids.size()) + ");";
+  Statement stmt(db_.handle(), sql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  for (size_t i = 0; i < user_ids.size(); ++i) {
+    sqlite3_bind_text(stmt.get(), static_cast<int>(i + 1), user_ids[i].c_str(), -1, SQLITE_TRANSIENT);
+  }
+  while (true) {
+    const int rc = sqlite3_step(stmt.get());
+    if (rc == SQLITE_ROW) {
+      const auto user_id = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 0));
+      if (user_id) {
+        found->insert(user_id);
+      }
+      continue;
+    }
+    if (rc == SQLITE_DONE) {
+      return true;
+    }
+    if (error) {
+      *error = sqlite3_errmsg(db_.handle());
+    }
+    return false;
+  }
+}
+
+std::string AuthService::hashPassword(const std::string& password, int cost, std::string* error) {
+  char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+  if (!crypt_gensalt_rn("$2b$", static_cast<unsigned long>(cost), nullptr, 0, salt, sizeof(salt))) {
     if (error) {
       *error = "failed to generate bcrypt salt";
     }
     return {};
   }
-  const auto hashed = crypt(password.c_str(), salt);
-  if (!hashed) {
+  thread_local crypt_data data{};
+  const auto hashed = crypt_r(password.c_str(), salt, &data);
+  if (!hashed || hashed[0] == '*') {
     if (error) {
       *error = "failed to hash password";
     }
@@ -155,11 +198,72 @@ std::string AuthService::hashPassword(const std::string& password, std::string*
 }
 
 bool AuthService::verifyPassword(const std::string& password, const std::string& hash) {
-  const auto hashed = crypt(password.c_str(), hash.c_str());
-  if (!hashed) {
+  thread_local crypt_data data{};
+  const auto hashed = crypt_r(password.c_str(), hash.c_str(), &data);
+  if (!hashed || hashed[0] == '*') {
     return false;
   }
   return hash == hashed;
 }
 
+int AuthService::hashCost(const std::string& hash) {
+  // Modular crypt format: $2b$<cost>$<salt+digest>
+  if (hash.size() < 7 || hash[0] != '$' || hash[3] != '$') {
+    return 0;
+  }
+  return std::atoi(hash.substr(4, 2).c_str());
+}
+
+int AuthService::calibrateCost(int target_ms) {
+  // Each extra cost step doubles the work, so one timed hash at the minimum
+  // cost is enough to extrapolate.
+  std::string error;
+  const auto start = std::chrono::steady_clock::now();
+  if (hashPassword("calibration", kMinBcryptCost, &error).empty()) {
+    return kMinBcryptCost;
+  }
+  const auto elapsed = std::chrono::duration<double, std::milli>(std::chrono::steady_clock::now() - start).count();
+  int cost = kMinBcryptCost;
+  double estimate = std::max(elapsed, 0.01);
+  while (cost < kMaxBcryptCost && estimate * 2 <= target_ms) {
+    estimate *= 2;
+    ++cost;
+  }
+  return cost;
+}
+
+bool AuthService::updatePasswordHashes(const std::vector<std::pair<std::string, std::string>>& hashes,
+                                       std::string* error) {
+  if (hashes.empty()) {
+    return true;
+  }
+  if (!db_.execute("BEGIN;", error)) {
+    return false;
+  }
+  bool ok = false;
+  do {
+    Statement stmt(db_.handle(), "UPDATE users SET password_hash = ? WHERE user_id = ?;", error);
+    if (!stmt.valid()) {
+      break;
+    }
+    ok = true;
+    for (const auto& [user_id, hash] : hashes) {
+      sqlite3_reset(stmt.get());
+      sqlite3_bind_text(stmt.get(), 1, hash.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(stmt.get(), 2, user_id.c_str(), -1, SQLITE_TRANSIENT);
+      if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+        if (error) {
+          *error = sqlite3_errmsg(db_.handle());
+        }
+        ok = false;
+        break;
+      }
+    }
+  } while (false);
+  if (!db_.execute(ok ? "COMMIT;" : "ROLLBACK;", error)) {
+    return false;
+  }
+  return ok;
+}
+
 }  // namespace onlinetalk::server
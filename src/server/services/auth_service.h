@@ -1,6 +1,9 @@
 #pragma once
 
 #include <string>
+#include <unordered_set>
+#include <utility>
+#include <vector>
 
 #include "server/storage/database.h"
 
@@ -15,19 +18,30 @@ class AuthService {
  public:
   explicit AuthService(Database& db);
 
-  bool registerUser(const std::string& user_id,
-                    const std::string& nickname,
-                    const std::string& password,
-                    std::string* error);
-  bool loginUser(const std::string& user_id,
-                 const std::string& password,
-                 AuthUser* user,
-                 std::string* error);
+  bool createUser(const std::string& user_id,
+                  const std::string& nickname,
+                  const std::string& password_hash,
+                  std::string* error);
+  // `not_found` is set when the lookup succeeded but no such user exists.
+  bool loadCredentials(const std::string& user_id,
+                       AuthUser* user,
+                       std::string* password_hash,
+                       bool* not_found,
+                       std::string* error);
+  bool updatePasswordHashes(const std::vector<std::pair<std::string, std::string>>& hashes, std::string* error);
   bool userExists(const std::string& user_id, std::string* error);
+  bool existingUsers(const std::vector<std::string>& user_ids,
+                     std::unordered_set<std::string>* found,
+                     std::string* error);
+
+  // Thread-safe; called from PasswordPool workers.
+  static std::string hashPassword(const std::string& password, int cost, std::string* error);
+  static bool verifyPassword(const std::string& password, const std::string& hash);
+  static int hashCost(const std::string& hash);
+  // Picks the highest cost whose hash time stays within target_ms.
+  static int calibrateCost(int target_ms);
 
  private:
-  std::string hashPassword(const std::string& password, std::string* error);
-  bool verifyPassword(const std::string& password, const std::string& hash);
 
   Database& db_;
 };
@@ -0,0 +1,144 @@
+#include "server/services/ephemeral_store.h"
+
+#include <algorithm>
+
+namespace onlinetalk::server {
+
+namespace {
+
+bool expired(const EphemeralMessage& message, int64_t now) {
+  return message.expires_at > 0 && message.expires_at <= now;
+}
+
+}  // namespace
+
+EphemeralStore::EphemeralStore(size_t backlog_size) : backlog_size_(std::max<size_t>(1, backlog_size)) {}
+
+const EphemeralMessage& EphemeralStore::add(const std::string& conversation_key, EphemeralMessage message) {
+  message.ephemeral_id = next_id_++;
+  auto& backlog = backlogs_[conversation_key];
+  while (backlog.size() >= backlog_size_) {
+    const auto dropped = std::move(backlog.front().pending);
+    backlog.pop_front();
+    forgetPending(conversation_key, backlog, dropped);
+  }
+  for (const auto& user_id : message.pending) {
+    pending_keys_[user_id].insert(conversation_key);
+  }
+  backlog.push_back(std::move(message));
+  return backlog.back();
+}
+
+std::vector<EphemeralMessage> EphemeralStore::recent(const std::string& conversation_key,
+                                                     int64_t now,
+                                                     size_t limit) const {
+  std::vector<EphemeralMessage> out;
+  auto it = backlogs_.find(conversation_key);
+  if (it == backlogs_.end()) {
+    return out;
+  }
+  const auto& backlog = it->second;
+  const size_t skip = backlog.size() > limit ? backlog.size() - limit : 0;
+  for (size_t i = skip; i < backlog.size(); ++i) {
+    if (!expired(backlog[i], now)) {
+      out.push_back(backlog[i]);
+      out.back().pending.clear();
+    }
+  }
+  return out;
+}
+
+std::vector<EphemeralMessage> EphemeralStore::takePending(const std::string& user_id, int64_t now) {
+  std::vector<EphemeralMessage> out;
+  auto keys_it = pending_keys_.find(user_id);
+  if (keys_it == pending_keys_.end()) {
+    return out;
+  }
+  for (const auto& key : keys_it->second) {
+    auto backlog_it = backlogs_.find(key);
+    if (backlog_it == backlogs_.end()) {
+      continue;
+    }
+    for (auto& message : backlog_it->second) {
+      auto pending_it = std::find(message.pending.begin(), message.pending.end(), user_id);
+      if (pending_it == message.pending.end()) {
+        continue;
+      }
+      message.pending.erase(pending_it);
+      if (!expired(message, now)) {
+        out.push_back(message);
+        out.back().pending.clear();
+      }
+    }
+  }
+  pending_keys_.erase(keys_it);
+  std::sort(out.begin(), out.end(), [](const EphemeralMessage& lhs, const EphemeralMessage& rhs) {
+    return lhs.ephemeral_id < rhs.ephemeral_id;
+  });
+  return out;
+}
+
+void EphemeralStore::expire(int64_t now) {
+  for (auto it = backlogs_.begin(); it != backlogs_.end();) {
+    auto& backlog = it->second;
+    const auto live_end = std::stable_partition(backlog.begin(), backlog.end(), [&](const EphemeralMessage& message) {
+      return !expired(message, now);
+    });
+    std::vector<std::string> dropped;
+    for (auto expired_it = live_end; expired_it != backlog.end(); ++expired_it) {
+      dropped.insert(dropped.end(), expired_it->pending.begin(), expired_it->pending.end());
+    }
+    backlog.erase(live_end, backlog.end());
+    forgetPending(it->first, backlog, dropped);
+    if (backlog.empty()) {
+      it = backlogs_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+void EphemeralStore::dropConversation(const std::string& conversation_key) {
+  auto it = backlogs_.find(conversation_key);
+  if (it == backlogs_.end()) {
+    return;
+  }
+  for (auto& message : it->second) {
+    for (const auto& user_id : message.pending) {
+      auto keys_it = pending_keys_.find(user_id);
+      if (keys_it == pending_keys_.end()) {
+        continue;
+      }
+      keys_it->second.erase(conversation_key);
+      if (keys_it->second.empty()) {
+        pending_keys_.erase(keys_it);
+      }
+    }
+  }
+  backlogs_.erase(it);
+}
+
+void EphemeralStore::forgetPending(const std::string& conversation_key,
+                                   const std::deque<EphemeralMessage>& backlog,
+                                   const std::vector<std::string>& user_ids) {
+  // `backlog` no longer holds the removed messages. Only drop the index
+  // entry when nothing left in it still waits for the user.
+  for (const auto& user_id : user_ids) {
+    const bool still_pending = std::any_of(backlog.begin(), backlog.end(), [&](const EphemeralMessage& other) {
+      return std::find(other.pending.begin(), other.pending.end(), user_id) != other.pending.end();
+    });
+    if (still_pending) {
+      continue;
+    }
+    auto it = pending_keys_.find(user_id);
+    if (it == pending_keys_.end()) {
+      continue;
+    }
+    it->second.erase(conversation_key);
+    if (it->second.empty()) {
+      pending_keys_.erase(it);
+    }
+  }
+}
+
+}  // namespace onlinetalk::server
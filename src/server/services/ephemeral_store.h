@@ -0,0 +1,49 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <string>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+namespace onlinetalk::server {
+
+struct EphemeralMessage {
+  int64_t ephemeral_id = 0;
+  std::string conversation_type;
+  std::string conversation_id;
+  std::string sender_id;
+  std::string sender_nickname;
+  std::string content;
+  int64_t created_at = 0;
+  int64_t expires_at = 0;  // 0 = kept until pushed out of the backlog
+  std::vector<std::string> pending;  // recipients that were offline at send time
+};
+
+// Memory-only message backlog for conversations that never touch SQLite.
+// Each conversation keeps at most `backlog_size` recent messages; messages
+// also disappear once their TTL passes. Nothing survives a restart.
+class EphemeralStore {
+ public:
+  explicit EphemeralStore(size_t backlog_size);
+
+  const EphemeralMessage& add(const std::string& conversation_key, EphemeralMessage message);
+  std::vector<EphemeralMessage> recent(const std::string& conversation_key, int64_t now, size_t limit) const;
+  std::vector<EphemeralMessage> takePending(const std::string& user_id, int64_t now);
+  void expire(int64_t now);
+  void dropConversation(const std::string& conversation_key);
+
+ private:
+  void forgetPending(const std::string& conversation_key,
+                     const std::deque<EphemeralMessage>& backlog,
+                     const std::vector<std::string>& user_ids);
+
+  size_t backlog_size_ = 0;
+  int64_t next_id_ = 1;
+  std::unordered_map<std::string, std::deque<EphemeralMessage>> backlogs_;
+  std::unordered_map<std::string, std::unordered_set<std::string>> pending_keys_;
+};
+
+}  // namespace onlinetalk::server
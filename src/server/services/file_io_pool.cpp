@@ -0,0 +1,112 @@
+#include "server/services/file_io_pool.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+namespace onlinetalk::server {
+
+FileIoPool::~FileIoPool() {
+  stop();
+}
+
+bool FileIoPool::start(size_t threads, size_t max_queued_bytes, std::string* error) {
+  event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    if (error) {
+      *error = "eventfd failed";
+    }
+    return false;
+  }
+  max_queued_bytes_ = max_queued_bytes;
+  queued_bytes_ = 0;
+  stopping_ = false;
+  workers_.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.push_back(std::make_unique<Worker>());
+  }
+  for (auto& worker : workers_) {
+    worker->thread = std::thread([this, raw = worker.get()] { workerLoop(*raw); });
+  }
+  return true;
+}
+
+void FileIoPool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    for (auto& worker : workers_) {
+      worker->queue.clear();
+    }
+  }
+  for (auto& worker : workers_) {
+    worker->cv.notify_all();
+  }
+  for (auto& worker : workers_) {
+    if (worker->thread.joinable()) {
+      worker->thread.join();
+    }
+  }
+  workers_.clear();
+  completed_.clear();
+  queued_bytes_ = 0;
+  if (event_fd_ >= 0) {
+    ::close(event_fd_);
+    event_fd_ = -1;
+  }
+}
+
+int FileIoPool::notifyFd() const {
+  return event_fd_;
+}
+
+bool FileIoPool::submit(const std::string& key, uint64_t job_id, std::function<void()> work, size_t bytes) {
+  Worker* worker = nullptr;
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    if (stopping_ || workers_.empty() || (bytes > 0 && queued_bytes_ + bytes > max_queued_bytes_)) {
+      return false;
+    }
+    queued_bytes_ += bytes;
+    worker = workers_[std::hash<std::string>{}(key) % workers_.size()].get();
+    worker->queue.push_back(Job{job_id, std::move(work), bytes});
+  }
+  worker->cv.notify_one();
+  return true;
+}
+
+std::vector<uint64_t> FileIoPool::takeCompleted() {
+  uint64_t counter = 0;
+  while (::read(event_fd_, &counter, sizeof(counter)) > 0) {
+  }
+  std::vector<uint64_t> out;
+  std::lock_guard<std::mutex> lock(mutex_);
+  out.swap(completed_);
+  return out;
+}
+
+void FileIoPool::workerLoop(Worker& worker) {
+  while (true) {
+    Job job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      worker.cv.wait(lock, [&] { return stopping_ || !worker.queue.empty(); });
+      if (stopping_) {
+        return;
+      }
+      job = std::move(worker.queue.front());
+      worker.queue.pop_front();
+    }
+
+    job.work();
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      queued_bytes_ -= job.bytes;
+      completed_.push_back(job.job_id);
+    }
+    const uint64_t one = 1;
+    [[maybe_unused]] const auto written = ::write(event_fd_, &one, sizeof(one));
+  }
+}
+
+}  // namespace onlinetalk::server
@@ -0,0 +1,63 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <utility>
+#include <vector>
+
+namespace onlinetalk::server {
+
+// Worker threads for blocking file I/O. Each key (a file id) is pinned to one
+// worker, so jobs for the same transfer run one at a time in submission order
+// while different transfers proceed in parallel. Finished job ids are
+// signalled through an eventfd that the event loop polls with its sockets;
+// whatever a job produces travels in state its closure shares with the caller.
+// Jobs that carry a buffer declare its size, and submit() refuses new ones
+// once `max_queued_bytes` are waiting.
+class FileIoPool {
+ public:
+  FileIoPool() = default;
+  ~FileIoPool();
+
+  FileIoPool(const FileIoPool&) = delete;
+  FileIoPool& operator=(const FileIoPool&) = delete;
+
+  bool start(size_t threads, size_t max_queued_bytes, std::string* error);
+  // Joins the workers; jobs still queued are dropped without completing.
+  void stop();
+  int notifyFd() const;
+  bool submit(const std::string& key, uint64_t job_id, std::function<void()> work, size_t bytes = 0);
+  std::vector<uint64_t> takeCompleted();
+
+ private:
+  struct Job {
+    uint64_t job_id = 0;
+    std::function<void()> work;
+    size_t bytes = 0;
+  };
+
+  struct Worker {
+    std::deque<Job> queue;
+    std::condition_variable cv;
+    std::thread thread;
+  };
+
+  void workerLoop(Worker& worker);
+
+  std::mutex mutex_;
+  std::vector<std::unique_ptr<Worker>> workers_;
+  std::vector<uint64_t> completed_;
+  size_t max_queued_bytes_ = 0;
+  size_t queued_bytes_ = 0;  // declared by jobs not yet finished
+  bool stopping_ = false;
+  int event_fd_ = -1;
+};
+
+}  // namespace onlinetalk::server
@@ -4,38 +4,104 @@
 #include <chrono>
 #include <filesystem>
 #include <fstream>
+#include <cerrno>
+#include <cstring>
+#include <fcntl.h>
+#include <iterator>
+#include <limits>
+#include <sys/stat.h>
+#include <sys/statvfs.h>
+#include <unistd.h>
 #include <unordered_set>
 
+#include "common/compress/deflate.h"
 #include "common/crypto/sha256.h"
 #include "common/fs.h"
+#include "common/log.h"
+#include "common/protocol/codec.h"
 #include "server/services/id_generator.h"
 
 namespace onlinetalk::server {
 
 namespace {
 
+constexpr int64_t kIdleSessionSeconds = 60;
+constexpr int64_t kPrefetchSlice = 256 * 1024;
+constexpr char kStatusUploading[] = "uploading";
+// Offer matched an existing blob; the row only waits for FileUploadDone.
+constexpr char kStatusDeduplicated[] = "deduplicated";
+constexpr char kUserQuotaExceeded[] = "user storage quota exceeded";
+constexpr char kGroupQuotaExceeded[] = "group storage quota exceeded";
+constexpr char kNoDiskSpace[] = "not enough disk space";
+constexpr char kCheckpointMagic[8] = {'O', 'L', 'T', 'K', 'C', 'K', 'P', '1'};
+
+bool writeAt(int fd, const uint8_t* data, size_t length, int64_t offset) {
+  size_t done = 0;
+  while (done < length) {
+    const auto rc = ::pwrite(fd, data + done, length - done, static_cast<off_t>(offset + static_cast<int64_t>(done)));
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      return false;
+    }
+    done += static_cast<size_t>(rc);
+  }
+  return true;
+}
+
+bool readAt(int fd, uint8_t* data, size_t length, int64_t offset) {
+  size_t done = 0;
+  while (done < length) {
+    const auto rc = ::pread(fd, data + done, length - done, static_cast<off_t>(offset + static_cast<int64_t>(done)));
+    if (rc < 0 && errno == EINTR) {
+      continue;
+    }
+    if (rc <= 0) {
+      return false;
+    }
+    done += static_cast<size_t>(rc);
+  }
+  return true;
+}
+
+// Allocates [offset, size) without changing the file size. Filesystems
+// without fallocate() simply skip the reservation.
+bool preallocate(int fd, int64_t offset, int64_t size) {
+  if (size <= offset) {
+    return true;
+  }
+  if (::fallocate(fd, FALLOC_FL_KEEP_SIZE, static_cast<off_t>(offset), static_cast<off_t>(size - offset)) == 0) {
+    return true;
+  }
+  return errno == EOPNOTSUPP || errno == ENOSYS;
+}
+
 int64_t nowSeconds() {
   const auto now = std::chrono::system_clock::now();
   return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
 }
 
-std::string sanitizeFileName(const std::string& name) {
-  std::string sanitized;
-  sanitized.reserve(name.size());
-  for (const char ch : name) {
-    if ((ch >= 'a' && ch <= 'z') ||
-        (ch >= 'A' && ch <= 'Z') ||
-        (ch >= '0' && ch <= '9') ||
-        ch == '.' || ch == '_' || ch == '-') {
-      sanitized.push_back(ch);
+// Lower-cases a hex SHA-256; false if it is not one. The digest names the
+// blob on disk, so nothing else may get through.
+bool normalizeSha256(const std::string& value, std::string* out) {
+  if (value.size() != 64) {
+    return false;
+  }
+  out->clear();
+  out->reserve(value.size());
+  for (const char ch : value) {
+    if (ch >= '0' && ch <= '9') {
+      out->push_back(ch);
+    } else if (ch >= 'a' && ch <= 'f') {
+      out->push_back(ch);
+    } else if (ch >= 'A' && ch <= 'F') {
+      out->push_back(static_cast<char>(ch - 'A' + 'a'));
     } else {
-      sanitized.push_back('_');
+      return false;
     }
   }
-  if (sanitized.empty()) {
-    return "file";
-  }
-  return sanitized;
+  return true;
 }
 
 bool ensureParentDir(const std::string& path, std::string* error) {
@@ -46,13 +112,34 @@ bool ensureParentDir(const std::string& path, std::string* error) {
   return onlinetalk::common::ensureDirectory(dir.string(), error);
 }
 
+std::string downloadKey(const std::string& file_id, const std::string& user_id) {
+  return file_id + '\n' + user_id;
+}
+
 }  // namespace
 
-FileService::FileService(Database& db, const std::string& data_dir, int chunk_size)
+FileService::FileService(Database& db,
+                         const std::string& data_dir,
+                         int chunk_size,
+                         int max_chunk_size,
+                         int upload_window,
+                         int64_t checkpoint_bytes,
+                         const StorageLimits& limits)
     : data_dir_(data_dir),
       files_dir_(data_dir + "/files"),
       temp_dir_(data_dir + "/tmp"),
       chunk_size_(chunk_size),
+      // Block-sized steps keep every chunk checkable against the manifest;
+      // other sizes fall back to whole multiples of the configured chunk.
+      chunk_unit_(chunk_size % onlinetalk::common::kManifestBlockSize == 0
+                      ? static_cast<int>(onlinetalk::common::kManifestBlockSize)
+                      : chunk_size),
+      max_chunk_size_(std::max(chunk_size,
+                               std::min<int>(max_chunk_size, onlinetalk::common::Codec::kMaxBinarySize) /
+                                   chunk_unit_ * chunk_unit_)),
+      upload_window_(upload_window),
+      checkpoint_bytes_(checkpoint_bytes),
+      limits_(limits),
       db_(db) {}
 
 bool FileService::ensureStorage(std::string* error) {
@@ -80,10 +167,31 @@ bool FileService::createUpload(const FileOffer& offer, UploadInfo* info, std::st
     return false;
   }
 
+  std::string sha256;
+  if (!normalizeSha256(offer.sha256, &sha256)) {
+    if (error) {
+      *error = "sha256 must be hex";
+    }
+    return false;
+  }
+
+  if (!offer.manifest.empty()) {
+    std::vector<onlinetalk::common::ManifestDigest> leaves;
+    onlinetalk::common::ManifestDigest root{};
+    if (!onlinetalk::common::unpackManifest(offer.manifest.data(), offer.manifest.size(), &leaves) ||
+        leaves.size() != onlinetalk::common::manifestLeafCount(offer.file_size) ||
+        !onlinetalk::common::manifestDigestFromHex(offer.manifest_root, &root) ||
+        onlinetalk::common::manifestRoot(leaves) != root) {
+      if (error) {
+        *error = "manifest does not match";
+      }
+      return false;
+    }
+  }
+
   const std::string file_id = generateId();
-  const std::string safe_name = sanitizeFileName(offer.file_name);
-  const std::string storage_path = files_dir_ + "/" + file_id + "_" + safe_name;
-  const std::string temp_path = temp_dir_ + "/" + file_id + ".part";
+  const std::string storage_path = blobPath(sha256);
+  std::string temp_path = temp_dir_ + "/" + file_id + ".part";
 
   if (!ensureParentDir(storage_path, error) || !ensureParentDir(temp_path, error)) {
     return false;
@@ -96,7 +204,51 @@ bool FileService::createUpload(const FileOffer& offer, UploadInfo* info, std::st
     return false;
   }
   bool ok = false;
+  bool deduplicated = false;
+  bool reserved = false;
   do {
+    if (!checkQuota(offer, error)) {
+      break;
+    }
+
+    // A verified blob with this digest means the bytes are already here: take
+    // a reference and skip the transfer.
+    Statement blob_stmt(db_.handle(), "SELECT file_size FROM file_blobs WHERE sha256 = ?;", error);
+    if (!blob_stmt.valid()) {
+      break;
+    }
+    sqlite3_bind_text(blob_stmt.get(), 1, sha256.c_str(), -1, SQLITE_TRANSIENT);
+    const int blob_rc = sqlite3_step(blob_stmt.get());
+    if (blob_rc != SQLITE_ROW && blob_rc != SQLITE_DONE) {
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      break;
+    }
+    if (blob_rc == SQLITE_ROW && sqlite3_column_int64(blob_stmt.get(), 0) == offer.file_size) {
+      std::error_code ec;
+      deduplicated = static_cast<int64_t>(std::filesystem::file_size(storage_path, ec)) == offer.file_size && !ec;
+    }
+    if (deduplicated) {
+      Statement ref_stmt(db_.handle(), "UPDATE file_blobs SET ref_count = ref_count + 1 WHERE sha256 = ?;", error);
+      if (!ref_stmt.valid()) {
+        break;
+      }
+      sqlite3_bind_text(ref_stmt.get(), 1, sha256.c_str(), -1, SQLITE_TRANSIENT);
+      if (sqlite3_step(ref_stmt.get()) != SQLITE_DONE) {
+        if (error) {
+          *error = sqlite3_errmsg(db_.handle());
+        }
+        break;
+      }
+      temp_path.clear();
+    } else {
+      if (!reserveSpace(temp_path, offer.file_size, error)) {
+        break;
+      }
+      reserved = true;
+    }
+
     const std::string insert_file =
         "INSERT INTO files(file_id, uploader_id, uploader_nickname, conversation_type, conversation_id, "
         "file_name, file_size, sha256, storage_path, created_at) "
@@ -112,7 +264,7 @@ bool FileService::createUpload(const FileOffer& offer, UploadInfo* info, std::st
     sqlite3_bind_text(file_stmt.get(), 5, offer.conversation_id.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(file_stmt.get(), 6, offer.file_name.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_int64(file_stmt.get(), 7, offer.file_size);
-    sqlite3_bind_text(file_stmt.get(), 8, offer.sha256.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(file_stmt.get(), 8, sha256.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(file_stmt.get(), 9, storage_path.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_int64(file_stmt.get(), 10, created_at);
     if (sqlite3_step(file_stmt.get()) != SQLITE_DONE) {
@@ -123,8 +275,8 @@ bool FileService::createUpload(const FileOffer& offer, UploadInfo* info, std::st
     }
 
     const std::string insert_upload =
-        "INSERT INTO file_uploads(file_id, uploader_id, temp_path, uploaded_size, status, updated_at) "
-        "VALUES(?,?,?,?,?,?);";
+        "INSERT INTO file_uploads(file_id, uploader_id, temp_path, uploaded_size, status, updated_at, manifest) "
+        "VALUES(?,?,?,?,?,?,?);";
     Statement upload_stmt(db_.handle(), insert_upload, error);
     if (!upload_stmt.valid()) {
       break;
@@ -132,9 +284,15 @@ bool FileService::createUpload(const FileOffer& offer, UploadInfo* info, std::st
     sqlite3_bind_text(upload_stmt.get(), 1, file_id.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(upload_stmt.get(), 2, offer.uploader_id.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(upload_stmt.get(), 3, temp_path.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(upload_stmt.get(), 4, 0);
-    sqlite3_bind_text(upload_stmt.get(), 5, "uploading", -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(upload_stmt.get(), 4, deduplicated ? offer.file_size : 0);
+    sqlite3_bind_text(upload_stmt.get(), 5, deduplicated ? kStatusDeduplicated : kStatusUploading, -1, SQLITE_STATIC);
     sqlite3_bind_int64(upload_stmt.get(), 6, created_at);
+    if (!offer.manifest.empty() && !deduplicated) {
+      sqlite3_bind_blob(upload_stmt.get(), 7, offer.manifest.data(), static_cast<int>(offer.manifest.size()),
+                        SQLITE_TRANSIENT);
+    } else {
+      sqlite3_bind_null(upload_stmt.get(), 7);
+    }
     if (sqlite3_step(upload_stmt.get()) != SQLITE_DONE) {
       if (error) {
         *error = sqlite3_errmsg(db_.handle());
@@ -166,10 +324,12 @@ bool FileService::createUpload(const FileOffer& offer, UploadInfo* info, std::st
     ok = true;
   } while (false);
 
-  if (!db_.execute(ok ? "COMMIT;" : "ROLLBACK;", error)) {
-    return false;
-  }
-  if (!ok) {
+  const bool committed = db_.execute(ok ? "COMMIT;" : "ROLLBACK;", error) && ok;
+  if (!committed) {
+    if (reserved) {
+      std::error_code ec;
+      std::filesystem::remove(temp_path, ec);
+    }
     return false;
   }
 
@@ -180,8 +340,9 @@ bool FileService::createUpload(const FileOffer& offer, UploadInfo* info, std::st
   info->conversation_id = offer.conversation_id;
   info->file_name = offer.file_name;
   info->file_size = offer.file_size;
-  info->uploaded_size = 0;
-  info->sha256 = offer.sha256;
+  info->uploaded_size = deduplicated ? offer.file_size : 0;
+  info->sha256 = sha256;
+  info->deduplicated = deduplicated;
   info->uploader_id = offer.uploader_id;
   info->uploader_nickname = offer.uploader_nickname;
   info->created_at = created_at;
@@ -198,113 +359,209 @@ bool FileService::resumeUpload(const std::string& file_id,
     }
     return false;
   }
-  UploadInfo current;
-  if (!getUploadInfo(file_id, &current, error)) {
+  auto session = uploadSession(file_id, error);
+  if (!session) {
     return false;
   }
-  if (current.uploader_id != uploader_id) {
+  std::lock_guard<std::mutex> lock(session->mutex);
+  if (session->info.uploader_id != uploader_id) {
     if (error) {
       *error = "uploader mismatch";
     }
     return false;
   }
-
-  std::error_code ec;
-  const auto actual_size =
-      std::filesystem::exists(current.temp_path, ec) ? std::filesystem::file_size(current.temp_path, ec) : 0;
-  if (!ec && static_cast<int64_t>(actual_size) != current.uploaded_size) {
-    const std::string sql = "UPDATE file_uploads SET uploaded_size = ?, updated_at = ? WHERE file_id = ?;";
-    std::string update_error;
-    Statement stmt(db_.handle(), sql, &update_error);
-    if (stmt.valid()) {
-      sqlite3_bind_int64(stmt.get(), 1, static_cast<int64_t>(actual_size));
-      sqlite3_bind_int64(stmt.get(), 2, nowSeconds());
-      sqlite3_bind_text(stmt.get(), 3, file_id.c_str(), -1, SQLITE_TRANSIENT);
-      sqlite3_step(stmt.get());
-    }
-    current.uploaded_size = static_cast<int64_t>(actual_size);
-  }
-
-  *info = current;
+  *info = session->info;
   return true;
 }
 
-bool FileService::appendChunk(const std::string& file_id,
-                              const std::string& uploader_id,
-                              int64_t offset,
-                              const std::vector<uint8_t>& data,
-                              UploadInfo* info,
-                              std::string* error) {
-  if (!info) {
+bool FileService::prepareChunk(const std::string& file_id,
+                               const std::string& uploader_id,
+                               ChunkWrite* write,
+                               bool* window_full,
+                               std::string* error) {
+  if (window_full) {
+    *window_full = false;
+  }
+  if (!write) {
     if (error) {
-      *error = "upload info is null";
+      *error = "chunk write is null";
     }
     return false;
   }
-  UploadInfo current;
-  if (!getUploadInfo(file_id, &current, error)) {
+  auto session = uploadSession(file_id, error);
+  if (!session) {
     return false;
   }
-  if (current.uploader_id != uploader_id) {
+  // Written only when the session is built, so no lock is needed.
+  if (session->info.uploader_id != uploader_id) {
     if (error) {
       *error = "uploader mismatch";
     }
     return false;
   }
-  if (offset != current.uploaded_size) {
-    if (error) {
-      *error = "offset mismatch";
+  if (session->inflight >= upload_window_) {
+    if (window_full) {
+      *window_full = true;
     }
-    return false;
-  }
-  if (offset + static_cast<int64_t>(data.size()) > current.file_size) {
     if (error) {
-      *error = "chunk exceeds file size";
+      *error = "upload window exceeded";
     }
     return false;
   }
+  ++session->inflight;
+  write->file_id = file_id;
+  write->session = std::move(session);
+  return true;
+}
 
-  std::fstream stream;
-  if (offset == 0) {
-    stream.open(current.temp_path, std::ios::binary | std::ios::out | std::ios::trunc);
-  } else {
-    stream.open(current.temp_path, std::ios::binary | std::ios::in | std::ios::out);
-  }
-  if (!stream.is_open()) {
-    if (error) {
-      *error = "failed to open temp file";
+void FileService::writeChunk(ChunkWrite& write) {
+  if (write.compressed) {
+    std::vector<uint8_t> plain;
+    std::string inflate_error;
+    if (!onlinetalk::common::inflateRaw(write.data.data(), write.data.size(), {}, static_cast<size_t>(max_chunk_size_),
+                                        &plain, &inflate_error)) {
+      write.ok = false;
+      write.error = "chunk inflate failed";
+      return;
     }
-    return false;
+    write.data.swap(plain);
+    write.compressed = false;
+  }
+  UploadSession& session = *write.session;
+  std::lock_guard<std::mutex> lock(session.mutex);
+  UploadInfo& current = session.info;
+  const auto& data = write.data;
+  const int64_t offset = write.offset;
+  write.ok = false;
+  write.next_offset = current.uploaded_size;
+  auto fail = [&](const char* message, bool broken) {
+    write.error = message;
+    session.failed = session.failed || broken;
+  };
+  if (session.failed) {
+    fail("upload interrupted", false);
+    return;
+  }
+  const int64_t end = offset + static_cast<int64_t>(data.size());
+  if (end > current.file_size) {
+    fail("chunk exceeds file size", false);
+    return;
+  }
+  const auto size = static_cast<int64_t>(data.size());
+  if (size > max_chunk_size_ || (size % chunk_unit_ != 0 && end != current.file_size)) {
+    fail("chunk size mismatch", false);
+    return;
+  }
+  if (offset < current.uploaded_size) {
+    // Retransmission of data that is already acknowledged.
+    write.ok = true;
+    return;
+  }
+  const int64_t ahead = offset - current.uploaded_size;
+  if (offset % chunk_unit_ != 0 || ahead + size > static_cast<int64_t>(upload_window_) * max_chunk_size_) {
+    fail("offset mismatch", false);
+    return;
+  }
+  // The sender may change chunk sizes between chunks, so parked chunks are
+  // kept by offset; a resend must cover exactly what it covered before.
+  auto next = session.parked.lower_bound(offset);
+  if (next != session.parked.end() && next->first == offset) {
+    if (next->second != size) {
+      fail("offset mismatch", false);
+      return;
+    }
+    write.ok = true;
+    return;
   }
-  stream.seekp(offset, std::ios::beg);
-  stream.write(reinterpret_cast<const char*>(data.data()), static_cast<std::streamsize>(data.size()));
-  if (!stream.good()) {
-    if (error) {
-      *error = "failed to write temp file";
+  if ((next != session.parked.end() && next->first < end) ||
+      (next != session.parked.begin() && std::prev(next)->first + std::prev(next)->second > offset)) {
+    fail("offset mismatch", false);
+    return;
+  }
+  if (!session.manifest.empty() && verifiesChunks() && !chunkMatchesManifest(session.manifest, offset, data)) {
+    fail("chunk hash mismatch", false);
+    return;
+  }
+
+  if (!session.file) {
+    const int fd = ::open(current.temp_path.c_str(), O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+    if (fd < 0) {
+      fail("failed to open temp file", true);
+      return;
     }
-    return false;
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+    session.file = std::make_shared<FileHandle>(fd);
+  }
+  const int fd = session.file->fd();
+  if (offset == 0 && session.parked.empty()) {
+    // A restart invalidates every saved hash state for this upload; the row
+    // is reset once the write is back on the event loop.
+    std::error_code ec;
+    std::filesystem::remove(checkpointPath(current.temp_path), ec);
+    session.hasher = onlinetalk::common::Sha256Hasher();
+    session.checkpointed_size = 0;
+    if (::ftruncate(fd, 0) != 0 || !preallocate(fd, 0, current.file_size)) {
+      fail("failed to truncate temp file", true);
+      return;
+    }
+    write.restarted = true;
+  }
+  if (!writeAt(fd, data.data(), data.size(), offset)) {
+    fail("failed to write temp file", true);
+    return;
+  }
+  if (ahead > 0) {
+    session.parked.emplace(offset, size);
+    write.ok = true;
+    return;
   }
-  stream.flush();
 
-  const int64_t next_offset = offset + static_cast<int64_t>(data.size());
-  const std::string sql = "UPDATE file_uploads SET uploaded_size = ?, updated_at = ? WHERE file_id = ?;";
-  Statement stmt(db_.handle(), sql, error);
-  if (!stmt.valid()) {
-    return false;
+  // The chunk closes the gap at the front of the window: hash it, then any
+  // chunks that were already waiting behind it.
+  session.hasher.update(data.data(), data.size());
+  current.uploaded_size = end;
+  std::vector<uint8_t> buffer;
+  while (!session.parked.empty() && session.parked.begin()->first == current.uploaded_size) {
+    const auto length = static_cast<size_t>(session.parked.begin()->second);
+    buffer.resize(length);
+    if (!readAt(fd, buffer.data(), length, current.uploaded_size)) {
+      fail("failed to read temp file", true);
+      return;
+    }
+    session.hasher.update(buffer.data(), length);
+    current.uploaded_size += static_cast<int64_t>(length);
+    session.parked.erase(session.parked.begin());
   }
-  sqlite3_bind_int64(stmt.get(), 1, next_offset);
-  sqlite3_bind_int64(stmt.get(), 2, nowSeconds());
-  sqlite3_bind_text(stmt.get(), 3, file_id.c_str(), -1, SQLITE_TRANSIENT);
-  if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
-    if (error) {
-      *error = sqlite3_errmsg(db_.handle());
+
+  if (current.uploaded_size - session.checkpointed_size >= checkpoint_bytes_ &&
+      current.uploaded_size < current.file_size) {
+    std::string checkpoint_error;
+    if (!writeCheckpoint(session, &checkpoint_error)) {
+      onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                      "upload checkpoint failed for " + write.file_id + ": " + checkpoint_error);
     }
-    return false;
   }
+  write.next_offset = current.uploaded_size;
+  write.ok = true;
+}
 
-  current.uploaded_size = next_offset;
-  *info = current;
-  return true;
+void FileService::finishChunk(const ChunkWrite& write) {
+  auto& session = write.session;
+  --session->inflight;
+  auto it = uploads_.find(write.file_id);
+  if (it == uploads_.end() || it->second != session) {
+    return;  // purged or replaced while the write was queued
+  }
+  std::string error;
+  if (write.restarted &&
+      !saveProgress(write.file_id, 0, onlinetalk::common::Sha256Hasher(), &error)) {
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                    "resetting upload progress failed for " + write.file_id + ": " + error);
+  }
+  // A broken session is rebuilt from the temp file on the next chunk.
+  if (session->inflight == 0 && session->failed) {
+    uploads_.erase(it);
+  }
 }
 
 bool FileService::finalizeUpload(const std::string& file_id,
@@ -317,45 +574,66 @@ bool FileService::finalizeUpload(const std::string& file_id,
     }
     return false;
   }
-  UploadInfo current;
-  if (!getUploadInfo(file_id, &current, error)) {
+  auto session = uploadSession(file_id, error);
+  if (!session) {
     return false;
   }
-  if (current.uploader_id != uploader_id) {
+  if (session->inflight > 0) {
+    // The temp file is about to move; a queued write must not follow it.
     if (error) {
-      *error = "uploader mismatch";
+      *error = "upload has chunks in flight";
     }
     return false;
   }
-  if (current.uploaded_size != current.file_size) {
-    if (error) {
-      *error = "file not fully uploaded";
-    }
-    return false;
-  }
-
-  std::string hash_error;
-  const auto computed = onlinetalk::common::sha256HexFile(current.temp_path, &hash_error);
-  if (!hash_error.empty()) {
+  std::unique_lock<std::mutex> lock(session->mutex);
+  if (session->info.uploader_id != uploader_id) {
+    // Leave the session alone; only its uploader may finish or drop it.
     if (error) {
-      *error = hash_error;
+      *error = "uploader mismatch";
     }
     return false;
   }
-  if (computed != current.sha256) {
+  const UploadInfo current = session->info;
+  std::string failure;
+  if (current.uploaded_size != current.file_size) {
+    failure = "file not fully uploaded";
+  } else if (!current.deduplicated &&
+             !onlinetalk::common::sha256HexEqual(session->hasher.finishHex(), current.sha256)) {
+    failure = "sha256 mismatch";
+  }
+  // Every byte was checked against the manifest on the way in, so once the
+  // whole-file digest matches, the manifest can be trusted for downloads.
+  const auto manifest = failure.empty() && verifiesChunks() ? onlinetalk::common::packManifest(session->manifest)
+                                                            : std::vector<uint8_t>();
+  lock.unlock();
+  // Either way the session goes through the normal close: its progress is
+  // synced and saved, so a failed finalize can resume or be retried, and a
+  // successful one has its data on disk before the rename below.
+  closeUploadSession(file_id, *session);
+  uploads_.erase(file_id);
+  if (!failure.empty()) {
     if (error) {
-      *error = "sha256 mismatch";
+      *error = failure;
     }
     return false;
   }
 
-  std::error_code ec;
-  std::filesystem::rename(current.temp_path, current.storage_path, ec);
-  if (ec) {
-    if (error) {
-      *error = "failed to move file to storage path";
+  if (!current.deduplicated) {
+    // Another upload of the same bytes may have finished first; its blob is
+    // verified too, so ours is simply dropped.
+    std::error_code ec;
+    if (std::filesystem::exists(current.storage_path, ec)) {
+      std::filesystem::remove(current.temp_path, ec);
+    } else {
+      std::filesystem::rename(current.temp_path, current.storage_path, ec);
+      if (ec) {
+        if (error) {
+          *error = "failed to move file to storage path";
+        }
+        return false;
+      }
     }
-    return false;
+    std::filesystem::remove(checkpointPath(current.temp_path), ec);
   }
 
   if (!db_.execute("BEGIN;", error)) {
@@ -363,6 +641,32 @@ bool FileService::finalizeUpload(const std::string& file_id,
   }
   bool ok = false;
   do {
+    if (!current.deduplicated) {
+      const std::string upsert_blob =
+          "INSERT INTO file_blobs(sha256, file_size, storage_path, ref_count, created_at, manifest) "
+          "VALUES(?,?,?,1,?,?) "
+          "ON CONFLICT(sha256) DO UPDATE SET ref_count = ref_count + 1, "
+          "manifest = COALESCE(manifest, excluded.manifest);";
+      Statement blob_stmt(db_.handle(), upsert_blob, error);
+      if (!blob_stmt.valid()) {
+        break;
+      }
+      sqlite3_bind_text(blob_stmt.get(), 1, current.sha256.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int64(blob_stmt.get(), 2, current.file_size);
+      sqlite3_bind_text(blob_stmt.get(), 3, current.storage_path.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_int64(blob_stmt.get(), 4, nowSeconds());
+      if (!manifest.empty()) {
+        sqlite3_bind_blob(blob_stmt.get(), 5, manifest.data(), static_cast<int>(manifest.size()), SQLITE_TRANSIENT);
+      } else {
+        sqlite3_bind_null(blob_stmt.get(), 5);
+      }
+      if (sqlite3_step(blob_stmt.get()) != SQLITE_DONE) {
+        if (error) {
+          *error = sqlite3_errmsg(db_.handle());
+        }
+        break;
+      }
+    }
     const std::string delete_upload = "DELETE FROM file_uploads WHERE file_id = ?;";
     Statement del_stmt(db_.handle(), delete_upload, error);
     if (!del_stmt.valid()) {
@@ -410,7 +714,8 @@ bool FileService::fetchUndelivered(const std::string& user_id,
       "FROM file_targets t "
       "JOIN files f ON t.file_id = f.file_id "
       "LEFT JOIN file_uploads u ON f.file_id = u.file_id "
-      "WHERE t.user_id = ? AND t.delivered_at IS NULL AND u.file_id IS NULL "
+      "LEFT JOIN groups g ON f.conversation_type = 'group' AND g.group_id = f.conversation_id "
+      "WHERE t.user_id = ? AND t.delivered_at IS NULL AND u.file_id IS NULL AND g.dissolved_at IS NULL "
       "ORDER BY f.created_at ASC LIMIT ?;";
   Statement stmt(db_.handle(), sql, error);
   if (!stmt.valid()) {
@@ -488,18 +793,62 @@ bool FileService::markDelivered(const std::string& user_id,
   return ok;
 }
 
-bool FileService::readChunk(const std::string& file_id,
-                            const std::string& user_id,
-                            int64_t offset,
-                            std::vector<uint8_t>* data,
-                            FileNotice* notice,
-                            std::string* error) {
-  if (!data || !notice) {
+bool FileService::openDownload(const std::string& file_id,
+                               const std::string& user_id,
+                               int64_t offset,
+                               int64_t end,
+                               int64_t chunk_size,
+                               std::shared_ptr<FileHandle>* file,
+                               int64_t* length,
+                               FileNotice* notice,
+                               std::vector<onlinetalk::common::ManifestDigest>* blocks,
+                               std::string* error) {
+  if (!file || !length || !notice) {
     if (error) {
       *error = "output is null";
     }
     return false;
   }
+  auto chunkLength = [&](int64_t file_size) {
+    const int64_t limit = end > 0 ? std::min(end, file_size) : file_size;
+    return std::min<int64_t>(limit - offset, chunk_size > 0 ? chunk_size : chunk_size_);
+  };
+  // Leaves of the whole blocks inside [offset, offset + length).
+  auto chunkBlocks = [&](const DownloadSession& session) {
+    if (!blocks) {
+      return;
+    }
+    blocks->clear();
+    const int64_t chunk_end = offset + *length;
+    if (session.manifest.empty() || offset % onlinetalk::common::kManifestBlockSize != 0 ||
+        (*length % onlinetalk::common::kManifestBlockSize != 0 && chunk_end != session.notice.file_size)) {
+      return;
+    }
+    const auto first = static_cast<size_t>(offset / onlinetalk::common::kManifestBlockSize);
+    const auto last = onlinetalk::common::manifestLeafCount(chunk_end);
+    blocks->assign(session.manifest.begin() + static_cast<std::ptrdiff_t>(first),
+                   session.manifest.begin() + static_cast<std::ptrdiff_t>(last));
+  };
+
+  const auto key = downloadKey(file_id, user_id);
+  auto cached = downloads_.find(key);
+  if (cached != downloads_.end()) {
+    auto& session = cached->second;
+    if (offset < 0 || offset >= session.notice.file_size || (end > 0 && offset >= end)) {
+      if (error) {
+        *error = "offset out of range";
+      }
+      return false;
+    }
+    session.last_used = ++download_clock_;
+    session.touched_at = nowSeconds();
+    *file = session.file;
+    *length = chunkLength(session.notice.file_size);
+    *notice = session.notice;
+    chunkBlocks(session);
+    return true;
+  }
+
   if (!hasDownloadPermission(file_id, user_id, error)) {
     return false;
   }
@@ -517,36 +866,59 @@ bool FileService::readChunk(const std::string& file_id,
   if (!getFileNotice(file_id, &record, error)) {
     return false;
   }
-  if (offset < 0 || offset >= record.file_size) {
+  if (offset < 0 || offset >= record.file_size || (end > 0 && offset >= end)) {
     if (error) {
       *error = "offset out of range";
     }
     return false;
   }
 
-  std::ifstream file(record.storage_path, std::ios::binary);
-  if (!file.is_open()) {
+  const int fd = ::open(record.storage_path.c_str(), O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
     if (error) {
       *error = "failed to open file";
     }
     return false;
   }
-  file.seekg(offset, std::ios::beg);
-  const int64_t remaining = record.file_size - offset;
-  const int64_t to_read = std::min<int64_t>(remaining, chunk_size_);
-  data->assign(static_cast<size_t>(to_read), 0);
-  file.read(reinterpret_cast<char*>(data->data()), static_cast<std::streamsize>(to_read));
-  if (!file.good() && !file.eof()) {
-    if (error) {
-      *error = "failed to read file";
-    }
+  ::posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+  *file = std::make_shared<FileHandle>(fd);
+  *length = chunkLength(record.file_size);
+  *notice = record;
+
+  evictDownloads();
+  DownloadSession session;
+  session.notice = record;
+  session.file = *file;
+  session.user_id = user_id;
+  session.last_used = ++download_clock_;
+  session.touched_at = nowSeconds();
+  if (!loadBlobManifest(record, &session.manifest, error)) {
     return false;
   }
-  data->resize(static_cast<size_t>(file.gcount()));
-  *notice = record;
+  chunkBlocks(session);
+  downloads_.emplace(key, std::move(session));
   return true;
 }
 
+void FileService::prefetch(const FileHandle& file, int64_t offset, int64_t length) {
+  // readahead() only starts the I/O, so the range is read for real: once
+  // pread() returns the pages are resident and sendfile() will not block.
+  // A failed read just leaves the work to sendfile(), which reports it.
+  thread_local std::vector<uint8_t> buffer(kPrefetchSlice);
+  for (int64_t done = 0; done < length;) {
+    const auto slice = static_cast<size_t>(std::min<int64_t>(kPrefetchSlice, length - done));
+    if (!readAt(file.fd(), buffer.data(), slice, offset + done)) {
+      return;
+    }
+    done += static_cast<int64_t>(slice);
+  }
+}
+
+bool FileService::readChunk(const FileHandle& file, int64_t offset, int64_t length, std::vector<uint8_t>* out) {
+  out->resize(static_cast<size_t>(length));
+  return readAt(file.fd(), out->data(), out->size(), offset);
+}
+
 bool FileService::listTargets(const std::string& file_id, std::vector<std::string>* targets, std::string* error) {
   if (!targets) {
     if (error) {
@@ -581,10 +953,394 @@ bool FileService::listTargets(const std::string& file_id, std::vector<std::strin
   return true;
 }
 
+bool FileService::purgeConversationFiles(const std::string& conversation_type,
+                                         const std::string& conversation_id,
+                                         int limit,
+                                         int* removed,
+                                         std::string* error) {
+  if (!removed) {
+    if (error) {
+      *error = "removed output is null";
+    }
+    return false;
+  }
+  *removed = 0;
+  if (limit <= 0) {
+    limit = 1;
+  }
+
+  std::vector<PurgedFile> purged;
+  {
+    const std::string sql =
+        "SELECT f.file_id, f.sha256, f.storage_path, u.temp_path, u.status FROM files f "
+        "LEFT JOIN file_uploads u ON f.file_id = u.file_id "
+        "WHERE f.conversation_type = ? AND f.conversation_id = ? LIMIT ?;";
+    Statement stmt(db_.handle(), sql, error);
+    if (!stmt.valid()) {
+      return false;
+    }
+    sqlite3_bind_text(stmt.get(), 1, conversation_type.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt.get(), 2, conversation_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt.get(), 3, limit);
+    if (!collectPurgedFiles(stmt, &purged, error)) {
+      return false;
+    }
+  }
+  if (purged.empty()) {
+    return true;
+  }
+  if (!removeFiles(purged, nullptr, error)) {
+    return false;
+  }
+  invalidateDownloads(conversation_type, conversation_id, "");
+  *removed = static_cast<int>(purged.size());
+  return true;
+}
+
+bool FileService::sweepStaleUploads(int64_t cutoff,
+                                    int limit,
+                                    int* removed,
+                                    int64_t* reclaimed_bytes,
+                                    std::string* error) {
+  if (!removed || !reclaimed_bytes) {
+    if (error) {
+      *error = "sweep output is null";
+    }
+    return false;
+  }
+  *removed = 0;
+  *reclaimed_bytes = 0;
+  if (limit <= 0) {
+    limit = 1;
+  }
+
+  // updated_at only moves when a session closes, so uploads with a live
+  // session are left alone however old their row looks.
+  std::vector<PurgedFile> purged;
+  {
+    const std::string sql =
+        "SELECT f.file_id, f.sha256, f.storage_path, u.temp_path, u.status FROM files f "
+        "LEFT JOIN file_uploads u ON f.file_id = u.file_id "
+        "WHERE (u.file_id IS NOT NULL AND u.updated_at < ?) "
+        "OR (f.conversation_type = 'group' AND "
+        "NOT EXISTS (SELECT 1 FROM groups g WHERE g.group_id = f.conversation_id)) "
+        "ORDER BY u.updated_at LIMIT ?;";
+    Statement stmt(db_.handle(), sql, error);
+    if (!stmt.valid()) {
+      return false;
+    }
+    sqlite3_bind_int64(stmt.get(), 1, cutoff);
+    sqlite3_bind_int(stmt.get(), 2, limit + static_cast<int>(uploads_.size()));
+    if (!collectPurgedFiles(stmt, &purged, error)) {
+      return false;
+    }
+  }
+  purged.erase(std::remove_if(purged.begin(), purged.end(),
+                              [this](const PurgedFile& file) { return uploads_.count(file.file_id) > 0; }),
+               purged.end());
+  if (purged.size() > static_cast<size_t>(limit)) {
+    purged.resize(static_cast<size_t>(limit));
+  }
+  if (purged.empty()) {
+    return true;
+  }
+  if (!removeFiles(purged, reclaimed_bytes, error)) {
+    return false;
+  }
+  for (const auto& file : purged) {
+    const auto prefix = file.file_id + '\n';
+    for (auto it = downloads_.begin(); it != downloads_.end();) {
+      it = it->first.compare(0, prefix.size(), prefix) == 0 ? downloads_.erase(it) : std::next(it);
+    }
+  }
+  *removed = static_cast<int>(purged.size());
+  return true;
+}
+
+bool FileService::sweepOrphanFiles(int64_t cutoff,
+                                   int limit,
+                                   int* removed,
+                                   int64_t* reclaimed_bytes,
+                                   bool* finished,
+                                   std::string* error) {
+  if (!removed || !reclaimed_bytes || !finished) {
+    if (error) {
+      *error = "sweep output is null";
+    }
+    return false;
+  }
+  *removed = 0;
+  *reclaimed_bytes = 0;
+  *finished = false;
+  if (limit <= 0) {
+    limit = 1;
+  }
+
+  Statement upload_stmt(db_.handle(), "SELECT 1 FROM file_uploads WHERE file_id = ? AND temp_path = ?;", error);
+  Statement blob_stmt(db_.handle(), "SELECT 1 FROM file_blobs WHERE sha256 = ? AND storage_path = ?;", error);
+  if (!upload_stmt.valid() || !blob_stmt.valid()) {
+    return false;
+  }
+  // Temp files are named <file_id>.part plus checkpoint suffixes; blobs are
+  // named by their digest.
+  auto referenced = [&](sqlite3_stmt* stmt, const std::string& key, const std::string& path, bool* found) {
+    sqlite3_reset(stmt);
+    sqlite3_bind_text(stmt, 1, key.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, path.c_str(), -1, SQLITE_TRANSIENT);
+    const int rc = sqlite3_step(stmt);
+    if (rc != SQLITE_ROW && rc != SQLITE_DONE) {
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      return false;
+    }
+    *found = rc == SQLITE_ROW;
+    return true;
+  };
+
+  std::error_code ec;
+  if (orphan_pass_ == 0) {
+    orphan_it_ = std::filesystem::recursive_directory_iterator(temp_dir_, ec);
+    orphan_pass_ = 1;
+  }
+  for (int examined = 0; examined < limit;) {
+    if (ec || orphan_it_ == std::filesystem::recursive_directory_iterator()) {
+      ec.clear();
+      if (orphan_pass_ == 1) {
+        orphan_it_ = std::filesystem::recursive_directory_iterator(files_dir_ + "/blobs", ec);
+        orphan_pass_ = 2;
+        continue;
+      }
+      orphan_it_ = {};
+      orphan_pass_ = 0;
+      *finished = true;
+      return true;
+    }
+    ++examined;
+    struct stat st {};
+    const auto path = orphan_it_->path().string();
+    if (::stat(path.c_str(), &st) == 0 && S_ISREG(st.st_mode) && st.st_mtime < cutoff) {
+      const auto name = orphan_it_->path().filename().string();
+      const auto file_id = name.substr(0, name.find('.'));
+      bool found = false;
+      const bool looked_up = orphan_pass_ == 2
+                                 ? referenced(blob_stmt.get(), name, path, &found)
+                                 : referenced(upload_stmt.get(), file_id, temp_dir_ + "/" + file_id + ".part", &found);
+      if (!looked_up) {
+        orphan_it_ = {};
+        orphan_pass_ = 0;
+        return false;
+      }
+      std::error_code remove_ec;
+      if (!found && std::filesystem::remove(path, remove_ec)) {
+        *reclaimed_bytes += static_cast<int64_t>(st.st_size);
+        ++*removed;
+      }
+    }
+    orphan_it_.increment(ec);
+  }
+  return true;
+}
+
+bool FileService::collectPurgedFiles(const Statement& stmt, std::vector<PurgedFile>* files, std::string* error) {
+  // Completed and deduplicated files hold a blob reference; an upload still
+  // in progress only owns its temp file. Rows from before the blob store
+  // point at a private file that goes with them.
+  while (true) {
+    const int rc = sqlite3_step(stmt.get());
+    if (rc == SQLITE_ROW) {
+      PurgedFile file;
+      file.file_id = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 0));
+      file.sha256 = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 1));
+      file.storage_path = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 2));
+      const auto temp_path = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 3));
+      const auto status = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 4));
+      file.holds_blob = !status || std::strcmp(status, kStatusDeduplicated) == 0;
+      file.temp_path = temp_path ? temp_path : "";
+      files->push_back(std::move(file));
+      continue;
+    }
+    if (rc == SQLITE_DONE) {
+      return true;
+    }
+    if (error) {
+      *error = sqlite3_errmsg(db_.handle());
+    }
+    return false;
+  }
+}
+
+bool FileService::removeFiles(const std::vector<PurgedFile>& files, int64_t* reclaimed_bytes, std::string* error) {
+  std::vector<std::string> paths;
+  for (const auto& file : files) {
+    if (!file.temp_path.empty()) {
+      paths.push_back(file.temp_path);
+      paths.push_back(checkpointPath(file.temp_path));
+    }
+  }
+  if (!db_.execute("BEGIN;", error)) {
+    return false;
+  }
+  bool ok = false;
+  do {
+    Statement target_stmt(db_.handle(), "DELETE FROM file_targets WHERE file_id = ?;", error);
+    Statement upload_stmt(db_.handle(), "DELETE FROM file_uploads WHERE file_id = ?;", error);
+    Statement file_stmt(db_.handle(), "DELETE FROM files WHERE file_id = ?;", error);
+    Statement release_stmt(db_.handle(),
+                           "UPDATE file_blobs SET ref_count = ref_count - 1 WHERE sha256 = ? AND storage_path = ?;",
+                           error);
+    if (!target_stmt.valid() || !upload_stmt.valid() || !file_stmt.valid() || !release_stmt.valid()) {
+      break;
+    }
+    bool deleted = true;
+    for (const auto& file : files) {
+      for (auto* stmt : {target_stmt.get(), upload_stmt.get(), file_stmt.get()}) {
+        sqlite3_reset(stmt);
+        sqlite3_clear_bindings(stmt);
+        sqlite3_bind_text(stmt, 1, file.file_id.c_str(), -1, SQLITE_TRANSIENT);
+        if (sqlite3_step(stmt) != SQLITE_DONE) {
+          if (error) {
+            *error = sqlite3_errmsg(db_.handle());
+          }
+          deleted = false;
+          break;
+        }
+      }
+      if (!deleted) {
+        break;
+      }
+      if (!file.holds_blob) {
+        continue;
+      }
+      sqlite3_reset(release_stmt.get());
+      sqlite3_bind_text(release_stmt.get(), 1, file.sha256.c_str(), -1, SQLITE_TRANSIENT);
+      sqlite3_bind_text(release_stmt.get(), 2, file.storage_path.c_str(), -1, SQLITE_TRANSIENT);
+      if (sqlite3_step(release_stmt.get()) != SQLITE_DONE) {
+        if (error) {
+          *error = sqlite3_errmsg(db_.handle());
+        }
+        deleted = false;
+        break;
+      }
+      if (sqlite3_changes(db_.handle()) == 0) {
+        paths.push_back(file.storage_path);
+      }
+    }
+    if (!deleted) {
+      break;
+    }
+
+    // Collect blobs whose last reference just went away.
+    Statement orphan_stmt(db_.handle(), "SELECT storage_path FROM file_blobs WHERE ref_count <= 0;", error);
+    if (!orphan_stmt.valid()) {
+      break;
+    }
+    while (sqlite3_step(orphan_stmt.get()) == SQLITE_ROW) {
+      paths.push_back(reinterpret_cast<const char*>(sqlite3_column_text(orphan_stmt.get(), 0)));
+    }
+    if (!db_.execute("DELETE FROM file_blobs WHERE ref_count <= 0;", error)) {
+      break;
+    }
+    ok = true;
+  } while (false);
+
+  if (!db_.execute(ok ? "COMMIT;" : "ROLLBACK;", error)) {
+    return false;
+  }
+  if (!ok) {
+    return false;
+  }
+
+  for (const auto& file : files) {
+    uploads_.erase(file.file_id);
+  }
+
+  // Rows go first so a crash between the two steps leaves stray files on disk
+  // rather than records pointing at missing data.
+  for (const auto& path : paths) {
+    std::error_code ec;
+    const auto size = std::filesystem::file_size(path, ec);
+    if (!ec && std::filesystem::remove(path, ec) && reclaimed_bytes) {
+      *reclaimed_bytes += static_cast<int64_t>(size);
+    }
+  }
+  return true;
+}
+
 int FileService::chunkSize() const {
   return chunk_size_;
 }
 
+int FileService::minChunkSize() const {
+  return chunk_unit_;
+}
+
+int FileService::maxChunkSize() const {
+  return max_chunk_size_;
+}
+
+int FileService::negotiateChunkSize(int64_t requested) const {
+  if (requested <= 0) {
+    return chunk_size_;
+  }
+  const auto size = std::clamp<int64_t>(requested, chunk_unit_, max_chunk_size_);
+  return static_cast<int>(size - size % chunk_unit_);
+}
+
+int FileService::uploadWindow() const {
+  return upload_window_;
+}
+
+bool FileService::verifiesChunks() const {
+  return chunk_size_ % onlinetalk::common::kManifestBlockSize == 0;
+}
+
+bool FileService::chunkMatchesManifest(const std::vector<onlinetalk::common::ManifestDigest>& manifest,
+                                       int64_t offset,
+                                       const std::vector<uint8_t>& data) const {
+  constexpr auto kBlock = onlinetalk::common::kManifestBlockSize;
+  if (offset % kBlock != 0) {
+    return false;
+  }
+  for (size_t done = 0; done < data.size(); done += static_cast<size_t>(kBlock)) {
+    const auto index = static_cast<size_t>(offset / kBlock) + done / static_cast<size_t>(kBlock);
+    const auto size = std::min(data.size() - done, static_cast<size_t>(kBlock));
+    if (index >= manifest.size() || onlinetalk::common::manifestLeaf(data.data() + done, size) != manifest[index]) {
+      return false;
+    }
+  }
+  return true;
+}
+
+bool FileService::loadBlobManifest(const FileNotice& notice,
+                                   std::vector<onlinetalk::common::ManifestDigest>* leaves,
+                                   std::string* error) {
+  leaves->clear();
+  Statement stmt(db_.handle(), "SELECT manifest FROM file_blobs WHERE sha256 = ? AND storage_path = ?;", error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  sqlite3_bind_text(stmt.get(), 1, notice.sha256.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_text(stmt.get(), 2, notice.storage_path.c_str(), -1, SQLITE_TRANSIENT);
+  const int rc = sqlite3_step(stmt.get());
+  if (rc == SQLITE_ROW) {
+    const auto data = static_cast<const uint8_t*>(sqlite3_column_blob(stmt.get(), 0));
+    const auto size = static_cast<size_t>(sqlite3_column_bytes(stmt.get(), 0));
+    if (!data || !onlinetalk::common::unpackManifest(data, size, leaves) ||
+        leaves->size() != onlinetalk::common::manifestLeafCount(notice.file_size)) {
+      leaves->clear();
+    }
+    return true;
+  }
+  if (rc == SQLITE_DONE) {
+    return true;  // stored before the blob store existed
+  }
+  if (error) {
+    *error = sqlite3_errmsg(db_.handle());
+  }
+  return false;
+}
+
 bool FileService::getUploadInfo(const std::string& file_id, UploadInfo* info, std::string* error) {
   if (!info) {
     if (error) {
@@ -595,7 +1351,7 @@ bool FileService::getUploadInfo(const std::string& file_id, UploadInfo* info, st
   const std::string sql =
       "SELECT f.file_id, f.conversation_type, f.conversation_id, f.file_name, f.file_size, f.sha256, "
       "f.uploader_id, f.uploader_nickname, f.storage_path, f.created_at, "
-      "u.temp_path, u.uploaded_size "
+      "u.temp_path, u.uploaded_size, u.hash_state, u.status, u.manifest "
       "FROM files f JOIN file_uploads u ON f.file_id = u.file_id WHERE f.file_id = ?;";
   Statement stmt(db_.handle(), sql, error);
   if (!stmt.valid()) {
@@ -616,6 +1372,13 @@ bool FileService::getUploadInfo(const std::string& file_id, UploadInfo* info, st
     info->created_at = sqlite3_column_int64(stmt.get(), 9);
     info->temp_path = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 10));
     info->uploaded_size = sqlite3_column_int64(stmt.get(), 11);
+    const auto state = static_cast<const uint8_t*>(sqlite3_column_blob(stmt.get(), 12));
+    const int state_size = sqlite3_column_bytes(stmt.get(), 12);
+    info->hash_state.assign(state, state + (state ? state_size : 0));
+    const auto status = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 13));
+    info->deduplicated = status && std::strcmp(status, kStatusDeduplicated) == 0;
+    const auto manifest = static_cast<const uint8_t*>(sqlite3_column_blob(stmt.get(), 14));
+    info->manifest.assign(manifest, manifest + (manifest ? sqlite3_column_bytes(stmt.get(), 14) : 0));
     return true;
   }
   if (rc == SQLITE_DONE) {
@@ -630,6 +1393,285 @@ bool FileService::getUploadInfo(const std::string& file_id, UploadInfo* info, st
   return false;
 }
 
+void FileService::invalidateDownloads(const std::string& conversation_type,
+                                      const std::string& conversation_id,
+                                      const std::string& user_id) {
+  for (auto it = downloads_.begin(); it != downloads_.end();) {
+    const auto& session = it->second;
+    if (session.notice.conversation_type == conversation_type &&
+        session.notice.conversation_id == conversation_id &&
+        (user_id.empty() || session.user_id == user_id)) {
+      it = downloads_.erase(it);
+    } else {
+      ++it;
+    }
+  }
+}
+
+std::shared_ptr<FileService::UploadSession> FileService::uploadSession(const std::string& file_id,
+                                                                       std::string* error) {
+  auto it = uploads_.find(file_id);
+  if (it != uploads_.end()) {
+    it->second->touched_at = nowSeconds();
+    return it->second;
+  }
+  auto session = std::make_shared<UploadSession>();
+  if (!getUploadInfo(file_id, &session->info, error)) {
+    return nullptr;
+  }
+  // Resume from a prefix that was recorded durably: the row (saved when a
+  // session closes) or the sidecar checkpoint, whichever is further. The
+  // file's own layout is no guide, since gaps left behind parked chunks can
+  // read back as zeros rather than holes.
+  if (!session->info.deduplicated) {
+    std::vector<uint8_t> checkpoint;
+    onlinetalk::common::Sha256Hasher checkpointed;
+    if (readCheckpoint(session->info.temp_path, &checkpoint) && checkpointed.loadState(checkpoint)) {
+      session->info.uploaded_size =
+          std::max(session->info.uploaded_size, static_cast<int64_t>(checkpointed.bytesHashed()));
+    }
+    session->info.uploaded_size = std::min(session->info.uploaded_size, session->info.file_size);
+    if (!restoreHasher(session->info, &session->hasher, error)) {
+      return nullptr;
+    }
+    // Whatever lies past the prefix is resent by the client.
+    const int fd = ::open(session->info.temp_path.c_str(), O_RDWR | O_CLOEXEC);
+    if (fd >= 0) {
+      session->file = std::make_shared<FileHandle>(fd);
+      if (::ftruncate(fd, static_cast<off_t>(session->info.uploaded_size)) != 0 ||
+          !preallocate(fd, session->info.uploaded_size, session->info.file_size)) {
+        if (error) {
+          *error = "failed to truncate temp file";
+        }
+        return nullptr;
+      }
+    }
+  }
+  // The hasher is authoritative from here on.
+  session->info.hash_state.clear();
+  if (!onlinetalk::common::unpackManifest(session->info.manifest.data(), session->info.manifest.size(),
+                                          &session->manifest)) {
+    session->manifest.clear();
+  }
+  session->info.manifest.clear();
+  session->checkpointed_size = session->info.uploaded_size;
+  session->touched_at = nowSeconds();
+  if (uploads_.size() >= max_upload_sessions_) {
+    // Sessions with writes queued stay; the map may briefly exceed its bound.
+    auto oldest = uploads_.end();
+    for (auto candidate = uploads_.begin(); candidate != uploads_.end(); ++candidate) {
+      if (candidate->second->inflight == 0 &&
+          (oldest == uploads_.end() || candidate->second->touched_at < oldest->second->touched_at)) {
+        oldest = candidate;
+      }
+    }
+    if (oldest != uploads_.end()) {
+      closeUploadSession(oldest->first, *oldest->second);
+      uploads_.erase(oldest);
+    }
+  }
+  uploads_.emplace(file_id, session);
+  return session;
+}
+
+void FileService::setSessionLimits(size_t max_uploads, size_t max_downloads) {
+  max_upload_sessions_ = std::max<size_t>(1, max_uploads);
+  max_download_sessions_ = std::max<size_t>(1, max_downloads);
+}
+
+void FileService::releaseIdleFiles() {
+  closeIdleSessions(std::numeric_limits<int64_t>::max());
+}
+
+void FileService::closeIdleSessions(int64_t now) {
+  const int64_t cutoff = now - kIdleSessionSeconds;
+  for (auto it = uploads_.begin(); it != uploads_.end();) {
+    if (it->second->touched_at >= cutoff || it->second->inflight > 0) {
+      ++it;
+      continue;
+    }
+    closeUploadSession(it->first, *it->second);
+    it = uploads_.erase(it);
+  }
+  for (auto it = downloads_.begin(); it != downloads_.end();) {
+    it = it->second.touched_at < cutoff ? downloads_.erase(it) : std::next(it);
+  }
+}
+
+void FileService::evictDownloads() {
+  if (downloads_.size() < max_download_sessions_) {
+    return;
+  }
+  auto oldest = downloads_.begin();
+  for (auto it = downloads_.begin(); it != downloads_.end(); ++it) {
+    if (it->second.last_used < oldest->second.last_used) {
+      oldest = it;
+    }
+  }
+  downloads_.erase(oldest);
+}
+
+bool FileService::restoreHasher(const UploadInfo& info,
+                                onlinetalk::common::Sha256Hasher* hasher,
+                                std::string* error) {
+  // Start from the furthest saved state that does not pass uploaded_size
+  // (the row's state or the sidecar checkpoint) and hash only the rest.
+  *hasher = onlinetalk::common::Sha256Hasher();
+  const auto target = static_cast<uint64_t>(info.uploaded_size);
+  std::vector<std::vector<uint8_t>> candidates{info.hash_state};
+  std::vector<uint8_t> checkpoint;
+  if (readCheckpoint(info.temp_path, &checkpoint)) {
+    candidates.push_back(std::move(checkpoint));
+  }
+  for (const auto& state : candidates) {
+    onlinetalk::common::Sha256Hasher candidate;
+    if (candidate.loadState(state) && candidate.bytesHashed() <= target &&
+        candidate.bytesHashed() > hasher->bytesHashed()) {
+      *hasher = candidate;
+    }
+  }
+  if (hasher->bytesHashed() == target) {
+    return true;
+  }
+
+  std::ifstream file(info.temp_path, std::ios::binary);
+  if (!file.is_open()) {
+    if (error) {
+      *error = "failed to open temp file";
+    }
+    return false;
+  }
+  file.seekg(static_cast<std::streamoff>(hasher->bytesHashed()), std::ios::beg);
+  std::vector<char> buffer(64 * 1024);
+  auto remaining = static_cast<int64_t>(target - hasher->bytesHashed());
+  while (remaining > 0) {
+    const auto want = static_cast<std::streamsize>(std::min<int64_t>(remaining, buffer.size()));
+    file.read(buffer.data(), want);
+    if (file.gcount() != want) {
+      if (error) {
+        *error = "failed to read temp file";
+      }
+      return false;
+    }
+    hasher->update(reinterpret_cast<const uint8_t*>(buffer.data()), static_cast<size_t>(want));
+    remaining -= want;
+  }
+  return true;
+}
+
+bool FileService::writeCheckpoint(UploadSession& session, std::string* error) {
+  // Data first, then the sidecar, so a checkpoint never claims bytes that
+  // are not on disk yet.
+  if (session.file && ::fdatasync(session.file->fd()) != 0) {
+    if (error) {
+      *error = "fdatasync failed";
+    }
+    return false;
+  }
+  const auto path = checkpointPath(session.info.temp_path);
+  const auto staging = path + ".tmp";
+  const auto state = session.hasher.saveState();
+  const int fd = ::open(staging.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    if (error) {
+      *error = "failed to open checkpoint";
+    }
+    return false;
+  }
+  FileHandle handle(fd);
+  const bool written = ::write(fd, kCheckpointMagic, sizeof(kCheckpointMagic)) ==
+                           static_cast<ssize_t>(sizeof(kCheckpointMagic)) &&
+                       ::write(fd, state.data(), state.size()) == static_cast<ssize_t>(state.size()) &&
+                       ::fsync(fd) == 0;
+  if (!written || ::rename(staging.c_str(), path.c_str()) != 0) {
+    if (error) {
+      *error = "failed to write checkpoint";
+    }
+    return false;
+  }
+  session.checkpointed_size = session.info.uploaded_size;
+  return true;
+}
+
+bool FileService::readCheckpoint(const std::string& temp_path, std::vector<uint8_t>* state) {
+  std::ifstream file(checkpointPath(temp_path), std::ios::binary);
+  if (!file.is_open()) {
+    return false;
+  }
+  char magic[sizeof(kCheckpointMagic)] = {};
+  file.read(magic, sizeof(magic));
+  if (file.gcount() != static_cast<std::streamsize>(sizeof(magic)) ||
+      std::memcmp(magic, kCheckpointMagic, sizeof(magic)) != 0) {
+    return false;
+  }
+  state->assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+  return true;
+}
+
+std::string FileService::blobPath(const std::string& sha256) const {
+  return files_dir_ + "/blobs/" + sha256.substr(0, 2) + "/" + sha256;
+}
+
+std::string FileService::checkpointPath(const std::string& temp_path) {
+  return temp_path + ".ckpt";
+}
+
+void FileService::closeUploadSession(const std::string& file_id, UploadSession& session) {
+  if (session.info.deduplicated) {
+    return;
+  }
+  std::lock_guard<std::mutex> lock(session.mutex);
+  // The only place progress reaches SQLite: when a transfer goes idle, is
+  // evicted, or the server shuts down.
+  std::string error;
+  // Chunks received ahead of a gap are dropped; the client resends them.
+  // Truncating also frees the reservation past the new end, so take it again.
+  // The data is synced before the row claims it, as for checkpoints.
+  if (session.file && (::ftruncate(session.file->fd(), static_cast<off_t>(session.info.uploaded_size)) != 0 ||
+                       !preallocate(session.file->fd(), session.info.uploaded_size, session.info.file_size) ||
+                       ::fdatasync(session.file->fd()) != 0)) {
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn, "truncating upload failed for " + file_id);
+    return;
+  }
+  if (!saveProgress(file_id, session.info.uploaded_size, session.hasher, &error)) {
+    onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Warn,
+                                    "saving upload progress failed for " + file_id + ": " + error);
+  }
+}
+
+void FileService::flushSessions() {
+  // Callers stop the I/O pool first, so nothing is writing any more.
+  for (const auto& [file_id, session] : uploads_) {
+    closeUploadSession(file_id, *session);
+  }
+  uploads_.clear();
+  downloads_.clear();
+}
+
+bool FileService::saveProgress(const std::string& file_id,
+                               int64_t uploaded_size,
+                               const onlinetalk::common::Sha256Hasher& hasher,
+                               std::string* error) {
+  const std::string sql =
+      "UPDATE file_uploads SET uploaded_size = ?, hash_state = ?, updated_at = ? WHERE file_id = ?;";
+  Statement stmt(db_.handle(), sql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  const auto state = hasher.saveState();
+  sqlite3_bind_int64(stmt.get(), 1, uploaded_size);
+  sqlite3_bind_blob(stmt.get(), 2, state.data(), static_cast<int>(state.size()), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(stmt.get(), 3, nowSeconds());
+  sqlite3_bind_text(stmt.get(), 4, file_id.c_str(), -1, SQLITE_TRANSIENT);
+  if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+    if (error) {
+      *error = sqlite3_errmsg(db_.handle());
+    }
+    return false;
+  }
+  return true;
+}
+
 bool FileService::getFileNotice(const std::string& file_id, FileNotice* notice, std::string* error) {
   if (!notice) {
     if (error) {
@@ -675,7 +1717,11 @@ bool FileService::getFileNotice(const std::string& file_id, FileNotice* notice,
 bool FileService::hasDownloadPermission(const std::string& file_id,
                                         const std::string& user_id,
                                         std::string* error) {
-  const std::string sql = "SELECT 1 FROM file_targets WHERE file_id = ? AND user_id = ?;";
+  const std::string sql =
+      "SELECT 1 FROM file_targets t "
+      "JOIN files f ON t.file_id = f.file_id "
+      "LEFT JOIN groups g ON f.conversation_type = 'group' AND g.group_id = f.conversation_id "
+      "WHERE t.file_id = ? AND t.user_id = ? AND g.dissolved_at IS NULL;";
   Statement stmt(db_.handle(), sql, error);
   if (!stmt.valid()) {
     return false;
@@ -698,6 +1744,83 @@ bool FileService::hasDownloadPermission(const std::string& file_id,
   return false;
 }
 
+bool FileService::checkQuota(const FileOffer& offer, std::string* error) {
+  auto usage = [&](const std::string& sql, const std::string& key, int64_t* used) {
+    Statement stmt(db_.handle(), sql, error);
+    if (!stmt.valid()) {
+      return false;
+    }
+    sqlite3_bind_text(stmt.get(), 1, key.c_str(), -1, SQLITE_TRANSIENT);
+    if (sqlite3_step(stmt.get()) != SQLITE_ROW) {
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      return false;
+    }
+    *used = sqlite3_column_int64(stmt.get(), 0);
+    return true;
+  };
+  int64_t used = 0;
+  if (!usage("SELECT COALESCE(SUM(file_size), 0) FROM files WHERE uploader_id = ?;", offer.uploader_id, &used)) {
+    return false;
+  }
+  if (offer.file_size > limits_.user_quota_bytes - used) {
+    if (error) {
+      *error = kUserQuotaExceeded;
+    }
+    return false;
+  }
+  if (offer.conversation_type != "group") {
+    return true;
+  }
+  if (!usage("SELECT COALESCE(SUM(file_size), 0) FROM files WHERE conversation_type = 'group' AND conversation_id = ?;",
+             offer.conversation_id, &used)) {
+    return false;
+  }
+  if (offer.file_size > limits_.group_quota_bytes - used) {
+    if (error) {
+      *error = kGroupQuotaExceeded;
+    }
+    return false;
+  }
+  return true;
+}
+
+bool FileService::reserveSpace(const std::string& temp_path, int64_t file_size, std::string* error) {
+  // Space reserved by earlier uploads is already allocated, so statvfs sees it.
+  struct statvfs fs {};
+  if (::statvfs(temp_dir_.c_str(), &fs) != 0) {
+    if (error) {
+      *error = "failed to query free space";
+    }
+    return false;
+  }
+  const auto available = static_cast<int64_t>(fs.f_bavail) * static_cast<int64_t>(fs.f_frsize);
+  if (file_size > available - limits_.disk_reserve_bytes) {
+    if (error) {
+      *error = kNoDiskSpace;
+    }
+    return false;
+  }
+  const int fd = ::open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+  if (fd < 0) {
+    if (error) {
+      *error = "failed to create temp file";
+    }
+    return false;
+  }
+  FileHandle file(fd);
+  if (!preallocate(fd, 0, file_size)) {
+    std::error_code ec;
+    std::filesystem::remove(temp_path, ec);
+    if (error) {
+      *error = kNoDiskSpace;
+    }
+    return false;
+  }
+  return true;
+}
+
 bool FileService::isUploading(const std::string& file_id, std::string* error) {
   const std::string sql = "SELECT 1 FROM file_uploads WHERE file_id = ?;";
   Statement stmt(db_.handle(), sql, error);
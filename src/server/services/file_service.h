@@ -1,10 +1,18 @@
 #pragma once
 
 #include <cstdint>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
+#include "common/crypto/merkle.h"
+#include "common/crypto/sha256.h"
 #include "server/storage/database.h"
+#include "server/storage/file_handle.h"
 
 namespace onlinetalk::server {
 
@@ -18,6 +26,8 @@ struct FileOffer {
   std::string uploader_id;
   std::string uploader_nickname;
   std::vector<std::string> recipients;
+  std::vector<uint8_t> manifest;  // packed leaves; empty when the client sent none
+  std::string manifest_root;
 };
 
 struct UploadInfo {
@@ -33,6 +43,9 @@ struct UploadInfo {
   std::string uploader_id;
   std::string uploader_nickname;
   int64_t created_at = 0;
+  std::vector<uint8_t> hash_state;  // SHA-256 state over the first uploaded_size bytes
+  bool deduplicated = false;  // content already stored; nothing to transfer
+  std::vector<uint8_t> manifest;
 };
 
 struct FileNotice {
@@ -48,19 +61,55 @@ struct FileNotice {
   int64_t created_at = 0;
 };
 
+// Admission limits checked when an upload is offered. Quotas count the
+// logical size of every file a user uploaded or a group holds, including
+// uploads still in progress; the reserve is free space the filesystem must
+// keep after the new file is allocated.
+struct StorageLimits {
+  int64_t user_quota_bytes = 0;
+  int64_t group_quota_bytes = 0;
+  int64_t disk_reserve_bytes = 0;
+};
+
 class FileService {
+  struct UploadSession;
+
  public:
-  FileService(Database& db, const std::string& data_dir, int chunk_size);
+  // An upload chunk on its way to disk: prepared on the event loop, written
+  // by a file I/O worker, then finished back on the loop.
+  struct ChunkWrite {
+    std::string file_id;
+    int64_t offset = 0;
+    std::vector<uint8_t> data;
+    bool compressed = false;  // data is deflated; inflated on the I/O worker
+    bool ok = false;
+    std::string error;
+    int64_t next_offset = 0;  // acknowledged prefix once the write is done
+    bool restarted = false;
+    std::shared_ptr<UploadSession> session;
+  };
+
+  FileService(Database& db,
+              const std::string& data_dir,
+              int chunk_size,
+              int max_chunk_size,
+              int upload_window,
+              int64_t checkpoint_bytes,
+              const StorageLimits& limits);
 
   bool ensureStorage(std::string* error);
   bool createUpload(const FileOffer& offer, UploadInfo* info, std::string* error);
   bool resumeUpload(const std::string& file_id, const std::string& uploader_id, UploadInfo* info, std::string* error);
-  bool appendChunk(const std::string& file_id,
-                   const std::string& uploader_id,
-                   int64_t offset,
-                   const std::vector<uint8_t>& data,
-                   UploadInfo* info,
-                   std::string* error);
+  // Sets `window_full` and fails when the upload already has a full window
+  // of chunks handed to the I/O pool.
+  bool prepareChunk(const std::string& file_id,
+                    const std::string& uploader_id,
+                    ChunkWrite* write,
+                    bool* window_full,
+                    std::string* error);
+  // Runs on an I/O worker; writes for one upload must be issued in order.
+  void writeChunk(ChunkWrite& write);
+  void finishChunk(const ChunkWrite& write);
   bool finalizeUpload(const std::string& file_id,
                       const std::string& uploader_id,
                       FileNotice* notice,
@@ -74,29 +123,166 @@ class FileService {
                      const std::vector<std::string>& file_ids,
                      std::string* error);
 
-  bool readChunk(const std::string& file_id,
-                 const std::string& user_id,
-                 int64_t offset,
-                 std::vector<uint8_t>* data,
-                 FileNotice* notice,
-                 std::string* error);
+  // Checks access and returns an open handle plus the length of the chunk at
+  // `offset`, at most `chunk_size` (the default when not positive) and
+  // stopping short of `end` when it is positive; the bytes are sent straight
+  // from the file by the connection.
+  // prefetch() reads them into the page cache first, off the event loop, and
+  // returns only once they are resident, so the sendfile() that follows does
+  // not wait on the disk.
+  // `blocks` receives the manifest leaves covering the chunk, or nothing when
+  // the file has no manifest or the chunk is not block aligned.
+  bool openDownload(const std::string& file_id,
+                    const std::string& user_id,
+                    int64_t offset,
+                    int64_t end,
+                    int64_t chunk_size,
+                    std::shared_ptr<FileHandle>* file,
+                    int64_t* length,
+                    FileNotice* notice,
+                    std::vector<onlinetalk::common::ManifestDigest>* blocks,
+                    std::string* error);
+  static void prefetch(const FileHandle& file, int64_t offset, int64_t length);
+  // For chunks that are deflated before they are sent.
+  static bool readChunk(const FileHandle& file, int64_t offset, int64_t length, std::vector<uint8_t>* out);
   bool listTargets(const std::string& file_id,
                    std::vector<std::string>* targets,
                    std::string* error);
 
+  bool purgeConversationFiles(const std::string& conversation_type,
+                              const std::string& conversation_id,
+                              int limit,
+                              int* removed,
+                              std::string* error);
+  // Janitor passes, each bounded by `limit`. The first reclaims uploads not
+  // touched since `cutoff` and files whose group no longer exists; the second
+  // deletes temp and blob files older than `cutoff` that no row refers to.
+  // The second examines at most `limit` directory entries per call and
+  // resumes where the last call stopped; `finished` is set once the walk
+  // has covered both directories.
+  bool sweepStaleUploads(int64_t cutoff, int limit, int* removed, int64_t* reclaimed_bytes, std::string* error);
+  bool sweepOrphanFiles(int64_t cutoff,
+                        int limit,
+                        int* removed,
+                        int64_t* reclaimed_bytes,
+                        bool* finished,
+                        std::string* error);
+
+  // Drops cached download sessions for a conversation, or only for one user
+  // in it when user_id is set (dissolve, kick, leave).
+  void invalidateDownloads(const std::string& conversation_type,
+                           const std::string& conversation_id,
+                           const std::string& user_id);
+
+  // Each cached session holds a file open; the server sizes the caches to
+  // the descriptors it can spare.
+  void setSessionLimits(size_t max_uploads, size_t max_downloads);
+  // Closes descriptors of transfers that have been idle for a while.
+  void closeIdleSessions(int64_t now);
+  // Closes every cached descriptor no queued write still needs, for when
+  // the process has run out of descriptors.
+  void releaseIdleFiles();
+  // Persists upload progress and drops every cached session.
+  void flushSessions();
+
+  // Chunks may be any multiple of minChunkSize() up to maxChunkSize(); only
+  // the last chunk of a file may be shorter. chunkSize() is the default.
   int chunkSize() const;
+  int minChunkSize() const;
+  int maxChunkSize() const;
+  // `requested` rounded down to a valid size, or the default when not positive.
+  int negotiateChunkSize(int64_t requested) const;
+  // True when uploads with a manifest are checked chunk by chunk.
+  bool verifiesChunks() const;
+  // Most chunks a client may have in flight ahead of the acknowledged offset.
+  int uploadWindow() const;
 
  private:
+  // Per-transfer state kept between chunk requests so steady-state chunks
+  // need no lookups or open() calls. Both maps are bounded; an evicted entry
+  // is simply rebuilt from the database on the next chunk.
+  struct UploadSession {
+    // Held by the I/O worker while it writes; the loop takes it before
+    // reading anything the worker updates.
+    std::mutex mutex;
+    int inflight = 0;  // chunks handed to the I/O pool; event loop only
+    bool failed = false;  // an I/O error left the session unusable
+    UploadInfo info;
+    onlinetalk::common::Sha256Hasher hasher;
+    std::shared_ptr<FileHandle> file;  // temp file, opened on first write
+    // Chunks written ahead of info.uploaded_size: offset -> length.
+    std::map<int64_t, int64_t> parked;
+    std::vector<onlinetalk::common::ManifestDigest> manifest;
+    int64_t checkpointed_size = 0;
+    int64_t touched_at = 0;
+  };
+  struct DownloadSession {
+    FileNotice notice;
+    std::shared_ptr<FileHandle> file;
+    std::vector<onlinetalk::common::ManifestDigest> manifest;
+    std::string user_id;
+    uint64_t last_used = 0;
+    int64_t touched_at = 0;
+  };
+
+  // A files row on its way out, with what it owns on disk.
+  struct PurgedFile {
+    std::string file_id;
+    std::string sha256;
+    std::string storage_path;
+    std::string temp_path;  // empty once the upload has finished
+    bool holds_blob = false;
+  };
+
+  std::shared_ptr<UploadSession> uploadSession(const std::string& file_id, std::string* error);
+  void evictDownloads();
+
   bool getUploadInfo(const std::string& file_id, UploadInfo* info, std::string* error);
+  bool restoreHasher(const UploadInfo& info, onlinetalk::common::Sha256Hasher* hasher, std::string* error);
+  bool writeCheckpoint(UploadSession& session, std::string* error);
+  static bool readCheckpoint(const std::string& temp_path, std::vector<uint8_t>* state);
+  bool loadBlobManifest(const FileNotice& notice,
+                        std::vector<onlinetalk::common::ManifestDigest>* leaves,
+                        std::string* error);
+  bool chunkMatchesManifest(const std::vector<onlinetalk::common::ManifestDigest>& manifest,
+                            int64_t offset,
+                            const std::vector<uint8_t>& data) const;
+  // Files are stored once per content, under their SHA-256.
+  std::string blobPath(const std::string& sha256) const;
+  static std::string checkpointPath(const std::string& temp_path);
+  void closeUploadSession(const std::string& file_id, UploadSession& session);
+  bool saveProgress(const std::string& file_id,
+                    int64_t uploaded_size,
+                    const onlinetalk::common::Sha256Hasher& hasher,
+                    std::string* error);
   bool getFileNotice(const std::string& file_id, FileNotice* notice, std::string* error);
   bool hasDownloadPermission(const std::string& file_id, const std::string& user_id, std::string* error);
   bool isUploading(const std::string& file_id, std::string* error);
+  bool checkQuota(const FileOffer& offer, std::string* error);
+  // Creates the temp file with the whole upload allocated up front, so a
+  // transfer that was admitted cannot run out of space halfway.
+  bool reserveSpace(const std::string& temp_path, int64_t file_size, std::string* error);
+  // Reads rows of (file_id, sha256, storage_path, temp_path, status).
+  bool collectPurgedFiles(const Statement& stmt, std::vector<PurgedFile>* files, std::string* error);
+  bool removeFiles(const std::vector<PurgedFile>& files, int64_t* reclaimed_bytes, std::string* error);
 
   std::string data_dir_;
   std::string files_dir_;
   std::string temp_dir_;
   int chunk_size_ = 0;
+  int chunk_unit_ = 0;
+  int max_chunk_size_ = 0;
+  int upload_window_ = 0;
+  int64_t checkpoint_bytes_ = 0;
+  StorageLimits limits_;
   Database& db_;
+  std::unordered_map<std::string, std::shared_ptr<UploadSession>> uploads_;
+  std::unordered_map<std::string, DownloadSession> downloads_;  // key: file_id + '\n' + user_id
+  uint64_t download_clock_ = 0;
+  size_t max_upload_sessions_ = 256;
+  size_t max_download_sessions_ = 1024;
+  std::filesystem::recursive_directory_iterator orphan_it_;
+  int orphan_pass_ = 0;  // 0 idle, 1 temp dir, 2 blobs
 };
 
 }  // namespace onlinetalk::server
@@ -19,6 +19,8 @@ GroupService::GroupService(Database& db) : db_(db) {}
 
 bool GroupService::createGroup(const std::string& owner_id,
                                const std::string& name,
+                               bool ephemeral,
+                               int64_t message_ttl,
                                std::string* group_id,
                                std::string* error) {
   if (!group_id) {
@@ -33,6 +35,12 @@ bool GroupService::createGroup(const std::string& owner_id,
     }
     return false;
   }
+  if (message_ttl < 0) {
+    if (error) {
+      *error = "message_ttl must not be negative";
+    }
+    return false;
+  }
 
   *group_id = generateId();
   if (!db_.execute("BEGIN;", error)) {
@@ -42,7 +50,7 @@ bool GroupService::createGroup(const std::string& owner_id,
   bool ok = false;
   do {
     const std::string insert_group =
-        "INSERT INTO groups(group_id, name, owner_id, created_at) VALUES(?,?,?,?);";
+        "INSERT INTO groups(group_id, name, owner_id, created_at, ephemeral, message_ttl) VALUES(?,?,?,?,?,?);";
     Statement group_stmt(db_.handle(), insert_group, error);
     if (!group_stmt.valid()) {
       break;
@@ -51,6 +59,8 @@ bool GroupService::createGroup(const std::string& owner_id,
     sqlite3_bind_text(group_stmt.get(), 2, name.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(group_stmt.get(), 3, owner_id.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_int64(group_stmt.get(), 4, nowSeconds());
+    sqlite3_bind_int(group_stmt.get(), 5, ephemeral ? 1 : 0);
+    sqlite3_bind_int64(group_stmt.get(), 6, message_ttl);
     if (sqlite3_step(group_stmt.get()) != SQLITE_DONE) {
       if (error) {
         *error = sqlite3_errmsg(db_.handle());
@@ -229,35 +239,23 @@ bool GroupService::dissolveGroup(const std::string& actor_id, const std::string&
     return false;
   }
 
+  // Only the tombstone and the member list are touched here; messages, targets
+  // and files are purged in bounded batches by the server's maintenance tick.
   if (!db_.execute("BEGIN;", error)) {
     return false;
   }
 
   bool ok = false;
   do {
-    const std::string delete_targets =
-        "DELETE FROM message_targets WHERE message_id IN "
-        "(SELECT message_id FROM messages WHERE conversation_type = 'group' AND conversation_id = ?);";
-    Statement target_stmt(db_.handle(), delete_targets, error);
-    if (!target_stmt.valid()) {
-      break;
-    }
-    sqlite3_bind_text(target_stmt.get(), 1, group_id.c_str(), -1, SQLITE_TRANSIENT);
-    if (sqlite3_step(target_stmt.get()) != SQLITE_DONE) {
-      if (error) {
-        *error = sqlite3_errmsg(db_.handle());
-      }
-      break;
-    }
-
-    const std::string delete_messages =
-        "DELETE FROM messages WHERE conversation_type = 'group' AND conversation_id = ?;";
-    Statement message_stmt(db_.handle(), delete_messages, error);
-    if (!message_stmt.valid()) {
+    const std::string mark_group =
+        "UPDATE groups SET dissolved_at = ? WHERE group_id = ? AND dissolved_at IS NULL;";
+    Statement group_stmt(db_.handle(), mark_group, error);
+    if (!group_stmt.valid()) {
       break;
     }
-    sqlite3_bind_text(message_stmt.get(), 1, group_id.c_str(), -1, SQLITE_TRANSIENT);
-    if (sqlite3_step(message_stmt.get()) != SQLITE_DONE) {
+    sqlite3_bind_int64(group_stmt.get(), 1, nowSeconds());
+    sqlite3_bind_text(group_stmt.get(), 2, group_id.c_str(), -1, SQLITE_TRANSIENT);
+    if (sqlite3_step(group_stmt.get()) != SQLITE_DONE) {
       if (error) {
         *error = sqlite3_errmsg(db_.handle());
       }
@@ -277,19 +275,6 @@ bool GroupService::dissolveGroup(const std::string& actor_id, const std::string&
       break;
     }
 
-    const std::string delete_group = "DELETE FROM groups WHERE group_id = ?;";
-    Statement group_stmt(db_.handle(), delete_group, error);
-    if (!group_stmt.valid()) {
-      break;
-    }
-    sqlite3_bind_text(group_stmt.get(), 1, group_id.c_str(), -1, SQLITE_TRANSIENT);
-    if (sqlite3_step(group_stmt.get()) != SQLITE_DONE) {
-      if (error) {
-        *error = sqlite3_errmsg(db_.handle());
-      }
-      break;
-    }
-
     ok = true;
   } while (false);
 
@@ -299,6 +284,53 @@ bool GroupService::dissolveGroup(const std::string& actor_id, const std::string&
   return ok;
 }
 
+bool GroupService::nextDissolvedGroup(std::string* group_id, std::string* error) {
+  if (!group_id) {
+    if (error) {
+      *error = "group_id output is null";
+    }
+    return false;
+  }
+  group_id->clear();
+  const std::string sql =
+      "SELECT group_id FROM groups WHERE dissolved_at IS NOT NULL ORDER BY dissolved_at ASC LIMIT 1;";
+  Statement stmt(db_.handle(), sql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  const int rc = sqlite3_step(stmt.get());
+  if (rc == SQLITE_ROW) {
+    const auto value = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 0));
+    if (value) {
+      *group_id = value;
+    }
+    return true;
+  }
+  if (rc == SQLITE_DONE) {
+    return true;
+  }
+  if (error) {
+    *error = sqlite3_errmsg(db_.handle());
+  }
+  return false;
+}
+
+bool GroupService::removeDissolvedGroup(const std::string& group_id, std::string* error) {
+  const std::string sql = "DELETE FROM groups WHERE group_id = ? AND dissolved_at IS NOT NULL;";
+  Statement stmt(db_.handle(), sql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  sqlite3_bind_text(stmt.get(), 1, group_id.c_str(), -1, SQLITE_TRANSIENT);
+  if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+    if (error) {
+      *error = sqlite3_errmsg(db_.handle());
+    }
+    return false;
+  }
+  return true;
+}
+
 bool GroupService::setAdmin(const std::string& actor_id,
                             const std::string& group_id,
                             const std::string& target_user_id,
@@ -413,8 +445,59 @@ bool GroupService::getUserRole(const std::string& user_id,
   return false;
 }
 
+bool GroupService::getUserRoles(const std::string& user_id,
+                                const std::vector<std::string>& group_ids,
+                                std::unordered_map<std::string, std::string>* roles,
+                                std::string* error) {
+  if (!roles) {
+    if (error) {
+      *error = "roles output is null";
+    }
+    return false;
+  }
+  roles->clear();
+  if (group_ids.empty()) {
+    return true;
+  }
+  const std::string sql =
+      "SELECT group_id, role FROM group_members WHERE user_id = ? AND group_id IN (" +
+      sqlPlaceholders(group_ids.size()) + ");";
+  Statement stmt(db_.handle(), sql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  sqlite3_bind_text(stmt.get(), 1, user_id.c_str(), -1, SQLITE_TRANSIENT);
+  for (size_t i = 0; i < group_ids.size(); ++i) {
+    sqlite3_bind_text(stmt.get(), static_cast<int>(i + 2), group_ids[i].c_str(), -1, SQLITE_TRANSIENT);
+  }
+  while (true) {
+    const int rc = sqlite3_step(stmt.get());
+    if (rc == SQLITE_ROW) {
+      const auto group_id = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 0));
+      const auto role = reinterpret_cast<const char*>(sqlite3_column_text(stmt.get(), 1));
+      if (group_id && role) {
+        (*roles)[group_id] = role;
+      }
+      continue;
+    }
+    if (rc == SQLITE_DONE) {
+      return true;
+    }
+    if (error) {
+      *error = sqlite3_errmsg(db_.handle());
+    }
+    return false;
+  }
+}
+
+bool GroupService::getGroupInfo(const std::string& group_id, GroupInfo* info, std::string* error) {
+  return groupExists(group_id, info, error);
+}
+
 bool GroupService::groupExists(const std::string& group_id, GroupInfo* info, std::string* error) {
-  const std::string sql = "SELECT group_id, name, owner_id FROM groups WHERE group_id = ?;";
+  const std::string sql =
+      "SELECT group_id, name, owner_id, ephemeral, message_ttl FROM groups "
+      "WHERE group_id = ? AND dissolved_at IS NULL;";
   Statement stmt(db_.handle(), sql, error);
   if (!stmt.valid()) {
     return false;
@@ -429,6 +512,8 @@ bool GroupService::groupExists(const std::string& group_id, GroupInfo* info, std
       if (gid) info->group_id = gid;
       if (name) info->name = name;
       if (owner) info->owner_id = owner;
+      info->ephemeral = sqlite3_column_int(stmt.get(), 3) != 0;
+      info->message_ttl = sqlite3_column_int64(stmt.get(), 4);
     }
     return true;
   }
@@ -1,6 +1,8 @@
 #pragma once
 
+#include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "server/storage/database.h"
@@ -11,6 +13,8 @@ struct GroupInfo {
   std::string group_id;
   std::string name;
   std::string owner_id;
+  bool ephemeral = false;
+  int64_t message_ttl = 0;
 };
 
 class GroupService {
@@ -19,6 +23,8 @@ class GroupService {
 
   bool createGroup(const std::string& owner_id,
                    const std::string& name,
+                   bool ephemeral,
+                   int64_t message_ttl,
                    std::string* group_id,
                    std::string* error);
   bool joinGroup(const std::string& user_id, const std::string& group_id, std::string* error);
@@ -32,13 +38,20 @@ class GroupService {
                 const std::string& target_user_id,
                 std::string* error);
   bool dissolveGroup(const std::string& actor_id, const std::string& group_id, std::string* error);
+  bool nextDissolvedGroup(std::string* group_id, std::string* error);
+  bool removeDissolvedGroup(const std::string& group_id, std::string* error);
   bool setAdmin(const std::string& actor_id,
                 const std::string& group_id,
                 const std::string& target_user_id,
                 bool make_admin,
                 std::string* error);
+  bool getGroupInfo(const std::string& group_id, GroupInfo* info, std::string* error);
   bool getGroupMembers(const std::string& group_id, std::vector<std::string>* members, std::string* error);
   bool getUserRole(const std::string& user_id, const std::string& group_id, std::string* role, std::string* error);
+  bool getUserRoles(const std::string& user_id,
+                    const std::vector<std::string>& group_ids,
+                    std::unordered_map<std::string, std::string>* roles,
+                    std::string* error);
 
  private:
   bool groupExists(const std::string& group_id, GroupInfo* info, std::string* error);
@@ -0,0 +1,117 @@
+#include "server/services/login_throttle.h"
+
+#include <algorithm>
+#include <limits>
+
+namespace onlinetalk::server {
+
+namespace {
+
+// Addresses get more slack than accounts since several users can share one.
+constexpr uint32_t kFreeUserAttempts = 5;
+constexpr uint32_t kFreeAddressAttempts = 20;
+constexpr int64_t kBaseBackoffSeconds = 1;
+constexpr int64_t kMaxBackoffSeconds = 15 * 60;
+constexpr int64_t kDecayIntervalSeconds = 10 * 60;
+
+uint64_t fnv1a(const std::string& key, uint64_t seed) {
+  uint64_t hash = 1469598103934665603ULL ^ (seed * 0x9E3779B97F4A7C15ULL);
+  for (const unsigned char ch : key) {
+    hash ^= ch;
+    hash *= 1099511628211ULL;
+  }
+  return hash ^ (hash >> 29);
+}
+
+std::string userKey(const std::string& user_id) {
+  return "u:" + user_id;
+}
+
+std::string peerKey(const std::string& peer_address) {
+  return "a:" + peer_address;
+}
+
+}  // namespace
+
+LoginThrottle::LoginThrottle() : cells_(kDepth * kWidth) {}
+
+bool LoginThrottle::allow(const std::string& user_id,
+                          const std::string& peer_address,
+                          int64_t now,
+                          int64_t* retry_after) {
+  decay(now);
+  ++stats_.checked;
+  const int64_t until = std::max(blockedUntil(userKey(user_id)), blockedUntil(peerKey(peer_address)));
+  if (until <= now) {
+    return true;
+  }
+  ++stats_.rejected;
+  if (retry_after) {
+    *retry_after = until - now;
+  }
+  return false;
+}
+
+void LoginThrottle::recordFailure(const std::string& user_id, const std::string& peer_address, int64_t now) {
+  decay(now);
+  ++stats_.failures;
+  bump(userKey(user_id), kFreeUserAttempts, now);
+  bump(peerKey(peer_address), kFreeAddressAttempts, now);
+}
+
+const LoginThrottleStats& LoginThrottle::stats() const {
+  return stats_;
+}
+
+std::array<size_t, LoginThrottle::kDepth> LoginThrottle::slots(const std::string& key) const {
+  std::array<size_t, kDepth> out{};
+  for (size_t row = 0; row < kDepth; ++row) {
+    out[row] = row * kWidth + static_cast<size_t>(fnv1a(key, row + 1) % kWidth);
+  }
+  return out;
+}
+
+int64_t LoginThrottle::blockedUntil(const std::string& key) const {
+  // Collisions only ever raise a cell, so the minimum across rows is the
+  // tightest estimate for this key.
+  int64_t until = std::numeric_limits<int64_t>::max();
+  for (const auto slot : slots(key)) {
+    until = std::min(until, cells_[slot].blocked_until);
+  }
+  return until;
+}
+
+void LoginThrottle::bump(const std::string& key, uint32_t free_attempts, int64_t now) {
+  const auto key_slots = slots(key);
+  uint32_t failures = std::numeric_limits<uint32_t>::max();
+  for (const auto slot : key_slots) {
+    failures = std::min(failures, cells_[slot].failures);
+  }
+  failures = failures == std::numeric_limits<uint32_t>::max() ? failures : failures + 1;
+
+  int64_t until = 0;
+  if (failures > free_attempts) {
+    const auto exponent = std::min<uint32_t>(failures - free_attempts - 1, 20);
+    until = now + std::min(kMaxBackoffSeconds, kBaseBackoffSeconds << exponent);
+  }
+  // Conservative update: only raise cells that are below the new estimate.
+  for (const auto slot : key_slots) {
+    auto& cell = cells_[slot];
+    cell.failures = std::max(cell.failures, failures);
+    cell.blocked_until = std::max(cell.blocked_until, until);
+  }
+}
+
+void LoginThrottle::decay(int64_t now) {
+  if (now < next_decay_) {
+    return;
+  }
+  if (next_decay_ != 0) {
+    for (auto& cell : cells_) {
+      cell.failures /= 2;
+    }
+  }
+  next_decay_ = now + kDecayIntervalSeconds;
+}
+
+}  // namespace onlinetalk::server
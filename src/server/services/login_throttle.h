@@ -0,0 +1,49 @@
+#pragma once
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <string>
+#include <vector>
+
+namespace onlinetalk::server {
+
+struct LoginThrottleStats {
+  uint64_t checked = 0;
+  uint64_t rejected = 0;
+  uint64_t failures = 0;
+};
+
+// Tracks failed logins per user id and per peer address in a fixed-size
+// count-min sketch, so memory does not grow with the number of keys an
+// attacker can invent. Counts halve every decay interval. After a few free
+// attempts each further failure doubles the backoff window, and requests
+// inside the window are refused before any database or bcrypt work.
+class LoginThrottle {
+ public:
+  LoginThrottle();
+
+  bool allow(const std::string& user_id, const std::string& peer_address, int64_t now, int64_t* retry_after);
+  void recordFailure(const std::string& user_id, const std::string& peer_address, int64_t now);
+  const LoginThrottleStats& stats() const;
+
+ private:
+  static constexpr size_t kDepth = 4;
+  static constexpr size_t kWidth = 4096;
+
+  struct Cell {
+    uint32_t failures = 0;
+    int64_t blocked_until = 0;
+  };
+
+  std::array<size_t, kDepth> slots(const std::string& key) const;
+  int64_t blockedUntil(const std::string& key) const;
+  void bump(const std::string& key, uint32_t free_attempts, int64_t now);
+  void decay(int64_t now);
+
+  std::vector<Cell> cells_;
+  int64_t next_decay_ = 0;
+  LoginThrottleStats stats_;
+};
+
+}  // namespace onlinetalk::server
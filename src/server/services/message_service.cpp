@@ -3,6 +3,10 @@
 #include <chrono>
 #include <limits>
 #include <algorithm>
+#include <sstream>
+
+#include "common/compress/deflate.h"
+#include "common/log.h"
 
 namespace onlinetalk::server {
 
@@ -13,6 +17,33 @@ int64_t nowSeconds() {
   return std::chrono::duration_cast<std::chrono::seconds>(now.time_since_epoch()).count();
 }
 
+constexpr int kCodecRaw = 0;
+constexpr int kCodecDeflate = 1;
+constexpr int kCompressionLevel = 6;
+constexpr size_t kMaxContentSize = 64 * 1024;
+constexpr size_t kMaxDictionarySize = 8 * 1024;
+constexpr int kTrainingSamples = 2000;
+constexpr int kMinTrainingSamples = 500;
+
+// Sender nicknames are resolved from users; the column only keeps a value for
+// rows written before nicknames were normalized.
+const char* const kPrivateHistorySql =
+    "SELECT m.message_id, m.conversation_type, m.conversation_id, m.sender_id, "
+    "COALESCE(NULLIF(m.sender_nickname, ''), u.nickname, ''), m.content, m.created_at, "
+    "m.conversation_seq, m.content_codec, m.dict_id "
+    "FROM messages m LEFT JOIN users u ON u.user_id = m.sender_id "
+    "WHERE m.conversation_type = 'private' AND m.message_id < ? AND "
+    "((m.sender_id = ? AND m.conversation_id = ?) OR (m.sender_id = ? AND m.conversation_id = ?)) "
+    "ORDER BY m.message_id DESC LIMIT ?;";
+
+const char* const kGroupHistorySql =
+    "SELECT m.message_id, m.conversation_type, m.conversation_id, m.sender_id, "
+    "COALESCE(NULLIF(m.sender_nickname, ''), u.nickname, ''), m.content, m.created_at, "
+    "m.conversation_seq, m.content_codec, m.dict_id "
+    "FROM messages m LEFT JOIN users u ON u.user_id = m.sender_id "
+    "WHERE m.conversation_type = ? AND m.conversation_id = ? AND m.message_id < ? "
+    "ORDER BY m.message_id DESC LIMIT ?;";
+
 std::string textOrEmpty(sqlite3_stmt* stmt, int col) {
   const auto text = reinterpret_cast<const char*>(sqlite3_column_text(stmt, col));
   return text ? text : "";
@@ -22,6 +53,318 @@ std::string textOrEmpty(sqlite3_stmt* stmt, int col) {
 
 MessageService::MessageService(Database& db) : db_(db) {}
 
+void MessageService::setCompression(bool enabled) {
+  compression_enabled_ = enabled;
+}
+
+bool MessageService::loadDictionaries(std::string* error) {
+  dictionary_ids_.clear();
+  dictionaries_.clear();
+  Statement stmt(db_.handle(), "SELECT dict_id, conversation_key FROM compression_dicts;", error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  while (true) {
+    const int rc = sqlite3_step(stmt.get());
+    if (rc == SQLITE_ROW) {
+      dictionary_ids_[textOrEmpty(stmt.get(), 1)] = sqlite3_column_int64(stmt.get(), 0);
+      continue;
+    }
+    if (rc == SQLITE_DONE) {
+      return true;
+    }
+    if (error) {
+      *error = sqlite3_errmsg(db_.handle());
+    }
+    return false;
+  }
+}
+
+bool MessageService::contentText(const StoredMessage& msg, std::string* text, std::string* error) {
+  if (!text) {
+    if (error) {
+      *error = "text output is null";
+    }
+    return false;
+  }
+  if (msg.content_codec == kCodecRaw) {
+    *text = msg.content;
+    return true;
+  }
+  if (msg.content_codec != kCodecDeflate) {
+    if (error) {
+      *error = "unknown content codec " + std::to_string(msg.content_codec);
+    }
+    return false;
+  }
+  const std::string* dict = nullptr;
+  if (!dictionary(msg.dict_id, &dict, error)) {
+    return false;
+  }
+  std::vector<uint8_t> plain;
+  if (!onlinetalk::common::inflateRaw(reinterpret_cast<const uint8_t*>(msg.content.data()),
+                                      msg.content.size(),
+                                      *dict,
+                                      kMaxContentSize,
+                                      &plain,
+                                      error)) {
+    return false;
+  }
+  text->assign(plain.begin(), plain.end());
+  return true;
+}
+
+bool MessageService::trainDictionary(bool* trained, std::string* error) {
+  if (!trained) {
+    if (error) {
+      *error = "trained output is null";
+    }
+    return false;
+  }
+  *trained = false;
+
+  // Busy conversations get their own dictionary; everything else shares the
+  // global one stored under the empty key.
+  std::string key;
+  bool found = false;
+  {
+    const std::string sql =
+        "SELECT h.conversation_key FROM conversation_heads h "
+        "LEFT JOIN compression_dicts d ON d.conversation_key = h.conversation_key "
+        "WHERE d.dict_id IS NULL AND h.last_seq >= ? LIMIT 1;";
+    Statement stmt(db_.handle(), sql, error);
+    if (!stmt.valid()) {
+      return false;
+    }
+    sqlite3_bind_int(stmt.get(), 1, kMinTrainingSamples);
+    const int rc = sqlite3_step(stmt.get());
+    if (rc == SQLITE_ROW) {
+      key = textOrEmpty(stmt.get(), 0);
+      found = true;
+    } else if (rc != SQLITE_DONE) {
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      return false;
+    }
+  }
+  if (!found && dictionary_ids_.count("") == 0) {
+    Statement stmt(db_.handle(), "SELECT 1 FROM messages LIMIT 1 OFFSET ?;", error);
+    if (!stmt.valid()) {
+      return false;
+    }
+    sqlite3_bind_int(stmt.get(), 1, kMinTrainingSamples - 1);
+    const int rc = sqlite3_step(stmt.get());
+    if (rc == SQLITE_ROW) {
+      found = true;
+    } else if (rc != SQLITE_DONE) {
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      return false;
+    }
+  }
+  if (!found) {
+    return true;
+  }
+
+  std::vector<std::string> samples;
+  if (!sampleContents(key, &samples, error)) {
+    return false;
+  }
+  const auto dict = buildDictionary(samples);
+
+  const std::string sql =
+      "INSERT INTO compression_dicts(conversation_key, dictionary, created_at) VALUES(?,?,?);";
+  Statement stmt(db_.handle(), sql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  sqlite3_bind_text(stmt.get(), 1, key.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_blob(stmt.get(), 2, dict.data(), static_cast<int>(dict.size()), SQLITE_TRANSIENT);
+  sqlite3_bind_int64(stmt.get(), 3, nowSeconds());
+  if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+    if (error) {
+      *error = sqlite3_errmsg(db_.handle());
+    }
+    return false;
+  }
+  const auto dict_id = sqlite3_last_insert_rowid(db_.handle());
+  dictionary_ids_[key] = dict_id;
+  dictionaries_[dict_id] = dict;
+  onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
+                                  "trained " + std::to_string(dict.size()) + " byte dictionary for " +
+                                      (key.empty() ? std::string("global messages") : key));
+  *trained = true;
+  return true;
+}
+
+bool MessageService::compactMessages(int64_t after_message_id,
+                                     int limit,
+                                     int64_t* next_message_id,
+                                     std::string* error) {
+  if (!next_message_id) {
+    if (error) {
+      *error = "next id output is null";
+    }
+    return false;
+  }
+  *next_message_id = after_message_id;
+  if (limit <= 0) {
+    limit = 1;
+  }
+
+  struct Rewrite {
+    int64_t message_id = 0;
+    std::string content;
+    int content_codec = kCodecRaw;
+    int64_t dict_id = 0;
+  };
+  std::vector<Rewrite> rewrites;
+  {
+    const std::string sql =
+        "SELECT message_id, conversation_key, content, content_codec, dict_id "
+        "FROM messages WHERE message_id > ? ORDER BY message_id LIMIT ?;";
+    Statement stmt(db_.handle(), sql, error);
+    if (!stmt.valid()) {
+      return false;
+    }
+    sqlite3_bind_int64(stmt.get(), 1, after_message_id);
+    sqlite3_bind_int(stmt.get(), 2, limit);
+    while (true) {
+      const int rc = sqlite3_step(stmt.get());
+      if (rc == SQLITE_ROW) {
+        Rewrite row;
+        row.message_id = sqlite3_column_int64(stmt.get(), 0);
+        *next_message_id = row.message_id;
+        const auto content = static_cast<const char*>(sqlite3_column_blob(stmt.get(), 2));
+        row.content.assign(content ? content : "", static_cast<size_t>(sqlite3_column_bytes(stmt.get(), 2)));
+        row.content_codec = sqlite3_column_int(stmt.get(), 3);
+        row.dict_id = sqlite3_column_int64(stmt.get(), 4);
+        if (row.content_codec == kCodecRaw &&
+            encodeContent(textOrEmpty(stmt.get(), 1), row.content, &row.content, &row.content_codec,
+                          &row.dict_id)) {
+          rewrites.push_back(std::move(row));
+        }
+        continue;
+      }
+      if (rc == SQLITE_DONE) {
+        break;
+      }
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      return false;
+    }
+  }
+  if (rewrites.empty()) {
+    return true;
+  }
+
+  if (!db_.execute("BEGIN;", error)) {
+    return false;
+  }
+  bool ok = false;
+  do {
+    const std::string sql =
+        "UPDATE messages SET content = ?, content_codec = ?, dict_id = ? WHERE message_id = ?;";
+    Statement stmt(db_.handle(), sql, error);
+    if (!stmt.valid()) {
+      break;
+    }
+    bool updated = true;
+    for (const auto& row : rewrites) {
+      sqlite3_reset(stmt.get());
+      sqlite3_clear_bindings(stmt.get());
+      if (row.content_codec == kCodecRaw) {
+        sqlite3_bind_text(stmt.get(), 1, row.content.c_str(), -1, SQLITE_TRANSIENT);
+      } else {
+        sqlite3_bind_blob(stmt.get(), 1, row.content.data(), static_cast<int>(row.content.size()),
+                          SQLITE_TRANSIENT);
+      }
+      sqlite3_bind_int(stmt.get(), 2, row.content_codec);
+      sqlite3_bind_int64(stmt.get(), 3, row.dict_id);
+      sqlite3_bind_int64(stmt.get(), 4, row.message_id);
+      if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+        if (error) {
+          *error = sqlite3_errmsg(db_.handle());
+        }
+        updated = false;
+        break;
+      }
+    }
+    if (!updated) {
+      break;
+    }
+    ok = true;
+  } while (false);
+
+  if (!db_.execute(ok ? "COMMIT;" : "ROLLBACK;", error)) {
+    return false;
+  }
+  return ok;
+}
+
+bool MessageService::normalizeNicknames(int64_t after_message_id,
+                                        int limit,
+                                        int64_t* next_message_id,
+                                        std::string* error) {
+  if (!next_message_id) {
+    if (error) {
+      *error = "next id output is null";
+    }
+    return false;
+  }
+  *next_message_id = after_message_id;
+  if (limit <= 0) {
+    limit = 1;
+  }
+  int64_t last_id = after_message_id;
+  {
+    const std::string sql =
+        "SELECT MAX(message_id) FROM "
+        "(SELECT message_id FROM messages WHERE message_id > ? ORDER BY message_id LIMIT ?);";
+    Statement stmt(db_.handle(), sql, error);
+    if (!stmt.valid()) {
+      return false;
+    }
+    sqlite3_bind_int64(stmt.get(), 1, after_message_id);
+    sqlite3_bind_int(stmt.get(), 2, limit);
+    if (sqlite3_step(stmt.get()) != SQLITE_ROW) {
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      return false;
+    }
+    if (sqlite3_column_type(stmt.get(), 0) == SQLITE_NULL) {
+      return true;
+    }
+    last_id = sqlite3_column_int64(stmt.get(), 0);
+  }
+
+  // Rows written before nicknames were normalized repeat the sender's
+  // current nickname; readers fall back to the users table for ''.
+  const std::string sql =
+      "UPDATE messages SET sender_nickname = '' WHERE message_id IN "
+      "(SELECT m.message_id FROM messages m JOIN users u ON u.user_id = m.sender_id "
+      "WHERE m.message_id > ? AND m.message_id <= ? AND m.sender_nickname <> '' "
+      "AND m.sender_nickname = u.nickname);";
+  Statement stmt(db_.handle(), sql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  sqlite3_bind_int64(stmt.get(), 1, after_message_id);
+  sqlite3_bind_int64(stmt.get(), 2, last_id);
+  if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
+    if (error) {
+      *error = sqlite3_errmsg(db_.handle());
+    }
+    return false;
+  }
+  *next_message_id = last_id;
+  return true;
+}
+
 bool MessageService::storeMessage(const MessageInput& input,
                                   const std::vector<std::string>& recipients,
                                   StoredMessage* stored,
@@ -42,11 +385,37 @@ bool MessageService::storeMessage(const MessageInput& input,
     return false;
   }
 
+  const auto conversation_key = conversationKey(input.conversation_type, input.sender_id, input.conversation_id);
   bool ok = false;
   do {
+    const std::string bump_head =
+        "INSERT INTO conversation_heads(conversation_key, last_seq) VALUES(?, 1) "
+        "ON CONFLICT(conversation_key) DO UPDATE SET last_seq = last_seq + 1;";
+    Statement head_stmt(db_.handle(), bump_head, error);
+    if (!head_stmt.valid()) {
+      break;
+    }
+    sqlite3_bind_text(head_stmt.get(), 1, conversation_key.c_str(), -1, SQLITE_TRANSIENT);
+    if (sqlite3_step(head_stmt.get()) != SQLITE_DONE) {
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      break;
+    }
+    int64_t conversation_seq = 0;
+    if (!headSeq(conversation_key, &conversation_seq, error)) {
+      break;
+    }
+
+    std::string stored_content;
+    int content_codec = kCodecRaw;
+    int64_t dict_id = 0;
+    encodeContent(conversation_key, input.content, &stored_content, &content_codec, &dict_id);
+
     const std::string insert_message =
-        "INSERT INTO messages(conversation_type, conversation_id, sender_id, sender_nickname, content, created_at) "
-        "VALUES(?,?,?,?,?,?);";
+        "INSERT INTO messages(conversation_type, conversation_id, sender_id, sender_nickname, content, created_at, "
+        "conversation_key, conversation_seq, content_codec, dict_id) "
+        "VALUES(?,?,?,'',?,?,?,?,?,?);";
     Statement stmt(db_.handle(), insert_message, error);
     if (!stmt.valid()) {
       break;
@@ -54,10 +423,18 @@ bool MessageService::storeMessage(const MessageInput& input,
     sqlite3_bind_text(stmt.get(), 1, input.conversation_type.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(stmt.get(), 2, input.conversation_id.c_str(), -1, SQLITE_TRANSIENT);
     sqlite3_bind_text(stmt.get(), 3, input.sender_id.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt.get(), 4, input.sender_nickname.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt.get(), 5, input.content.c_str(), -1, SQLITE_TRANSIENT);
+    if (content_codec == kCodecRaw) {
+      sqlite3_bind_text(stmt.get(), 4, stored_content.c_str(), -1, SQLITE_TRANSIENT);
+    } else {
+      sqlite3_bind_blob(stmt.get(), 4, stored_content.data(), static_cast<int>(stored_content.size()),
+                        SQLITE_TRANSIENT);
+    }
     const auto created_at = nowSeconds();
-    sqlite3_bind_int64(stmt.get(), 6, created_at);
+    sqlite3_bind_int64(stmt.get(), 5, created_at);
+    sqlite3_bind_text(stmt.get(), 6, conversation_key.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt.get(), 7, conversation_seq);
+    sqlite3_bind_int(stmt.get(), 8, content_codec);
+    sqlite3_bind_int64(stmt.get(), 9, dict_id);
     if (sqlite3_step(stmt.get()) != SQLITE_DONE) {
       if (error) {
         *error = sqlite3_errmsg(db_.handle());
@@ -91,11 +468,14 @@ bool MessageService::storeMessage(const MessageInput& input,
     }
 
     stored->message_id = message_id;
+    stored->conversation_seq = conversation_seq;
     stored->conversation_type = input.conversation_type;
     stored->conversation_id = input.conversation_id;
     stored->sender_id = input.sender_id;
     stored->sender_nickname = input.sender_nickname;
     stored->content = input.content;
+    stored->content_codec = kCodecRaw;
+    stored->dict_id = 0;
     stored->created_at = created_at;
     ok = true;
   } while (false);
@@ -119,10 +499,13 @@ bool MessageService::fetchUndelivered(const std::string& user_id,
   out->clear();
   const std::string sql =
       "SELECT m.message_id, m.conversation_type, m.conversation_id, m.sender_id, "
-      "m.sender_nickname, m.content, m.created_at "
+      "COALESCE(NULLIF(m.sender_nickname, ''), u.nickname, ''), m.content, m.created_at, "
+      "m.conversation_seq, m.content_codec, m.dict_id "
       "FROM message_targets t "
       "JOIN messages m ON t.message_id = m.message_id "
-      "WHERE t.user_id = ? AND t.delivered_at IS NULL "
+      "LEFT JOIN users u ON u.user_id = m.sender_id "
+      "LEFT JOIN groups g ON m.conversation_type = 'group' AND g.group_id = m.conversation_id "
+      "WHERE t.user_id = ? AND t.delivered_at IS NULL AND g.dissolved_at IS NULL "
       "ORDER BY m.message_id ASC LIMIT ?;";
   Statement stmt(db_.handle(), sql, error);
   if (!stmt.valid()) {
@@ -130,29 +513,7 @@ bool MessageService::fetchUndelivered(const std::string& user_id,
   }
   sqlite3_bind_text(stmt.get(), 1, user_id.c_str(), -1, SQLITE_TRANSIENT);
   sqlite3_bind_int(stmt.get(), 2, limit);
-  while (true) {
-    const int rc = sqlite3_step(stmt.get());
-    if (rc == SQLITE_ROW) {
-      StoredMessage msg;
-      msg.message_id = sqlite3_column_int64(stmt.get(), 0);
-      msg.conversation_type = textOrEmpty(stmt.get(), 1);
-      msg.conversation_id = textOrEmpty(stmt.get(), 2);
-      msg.sender_id = textOrEmpty(stmt.get(), 3);
-      msg.sender_nickname = textOrEmpty(stmt.get(), 4);
-      msg.content = textOrEmpty(stmt.get(), 5);
-      msg.created_at = sqlite3_column_int64(stmt.get(), 6);
-      out->push_back(std::move(msg));
-      continue;
-    }
-    if (rc == SQLITE_DONE) {
-      break;
-    }
-    if (error) {
-      *error = sqlite3_errmsg(db_.handle());
-    }
-    return false;
-  }
-  return true;
+  return readMessages(stmt.get(), out, error);
 }
 
 bool MessageService::markDelivered(const std::string& user_id,
@@ -212,73 +573,420 @@ bool MessageService::fetchHistory(const std::string& user_id,
     return false;
   }
   out->clear();
+  const HistoryQuery query{conversation_type, conversation_id, before_message_id, limit};
+  Statement stmt(db_.handle(), conversation_type == "private" ? kPrivateHistorySql : kGroupHistorySql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  bindHistoryQuery(stmt.get(), user_id, query);
+  if (!readMessages(stmt.get(), out, error)) {
+    return false;
+  }
+  std::reverse(out->begin(), out->end());
+  return true;
+}
+
+bool MessageService::fetchHistoryBatch(const std::string& user_id,
+                                       const std::vector<HistoryQuery>& queries,
+                                       std::vector<std::vector<StoredMessage>>* out,
+                                       std::string* error) {
+  if (!out) {
+    if (error) {
+      *error = "output list is null";
+    }
+    return false;
+  }
+  out->clear();
+  out->resize(queries.size());
+  if (queries.empty()) {
+    return true;
+  }
+
+  // One read transaction keeps every page in the batch on the same snapshot,
+  // and each statement is prepared once and rebound per conversation.
+  if (!db_.execute("BEGIN;", error)) {
+    return false;
+  }
+  bool ok = false;
+  do {
+    Statement private_stmt(db_.handle(), kPrivateHistorySql, error);
+    Statement group_stmt(db_.handle(), kGroupHistorySql, error);
+    if (!private_stmt.valid() || !group_stmt.valid()) {
+      break;
+    }
+    bool queries_ok = true;
+    for (size_t i = 0; i < queries.size(); ++i) {
+      auto* stmt = queries[i].conversation_type == "private" ? private_stmt.get() : group_stmt.get();
+      sqlite3_reset(stmt);
+      sqlite3_clear_bindings(stmt);
+      bindHistoryQuery(stmt, user_id, queries[i]);
+      auto& page = (*out)[i];
+      if (!readMessages(stmt, &page, error)) {
+        queries_ok = false;
+        break;
+      }
+      std::reverse(page.begin(), page.end());
+    }
+    if (!queries_ok) {
+      break;
+    }
+    ok = true;
+  } while (false);
+
+  if (!db_.execute(ok ? "COMMIT;" : "ROLLBACK;", error)) {
+    return false;
+  }
+  return ok;
+}
+
+bool MessageService::fetchSince(const std::string& conversation_key,
+                                int64_t after_seq,
+                                int limit,
+                                std::vector<StoredMessage>* out,
+                                std::string* error) {
+  if (!out) {
+    if (error) {
+      *error = "output list is null";
+    }
+    return false;
+  }
+  out->clear();
   if (limit <= 0) {
     limit = 1;
   }
-  const auto before_id = before_message_id > 0
-                             ? before_message_id
-                             : std::numeric_limits<int64_t>::max();
+  const std::string sql =
+      "SELECT m.message_id, m.conversation_type, m.conversation_id, m.sender_id, "
+      "COALESCE(NULLIF(m.sender_nickname, ''), u.nickname, ''), m.content, m.created_at, "
+      "m.conversation_seq, m.content_codec, m.dict_id "
+      "FROM messages m LEFT JOIN users u ON u.user_id = m.sender_id "
+      "WHERE m.conversation_key = ? AND m.conversation_seq > ? "
+      "ORDER BY m.conversation_seq ASC LIMIT ?;";
+  Statement stmt(db_.handle(), sql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  sqlite3_bind_text(stmt.get(), 1, conversation_key.c_str(), -1, SQLITE_TRANSIENT);
+  sqlite3_bind_int64(stmt.get(), 2, std::max<int64_t>(0, after_seq));
+  sqlite3_bind_int(stmt.get(), 3, limit);
+  return readMessages(stmt.get(), out, error);
+}
 
-  std::string sql;
-  if (conversation_type == "private") {
-    sql =
-        "SELECT message_id, conversation_type, conversation_id, sender_id, sender_nickname, content, created_at "
-        "FROM messages "
-        "WHERE conversation_type = 'private' AND message_id < ? AND "
-        "((sender_id = ? AND conversation_id = ?) OR (sender_id = ? AND conversation_id = ?)) "
-        "ORDER BY message_id DESC LIMIT ?;";
-  } else {
-    sql =
-        "SELECT message_id, conversation_type, conversation_id, sender_id, sender_nickname, content, created_at "
-        "FROM messages "
-        "WHERE conversation_type = ? AND conversation_id = ? AND message_id < ? "
-        "ORDER BY message_id DESC LIMIT ?;";
+bool MessageService::headSeq(const std::string& conversation_key, int64_t* seq, std::string* error) {
+  if (!seq) {
+    if (error) {
+      *error = "seq output is null";
+    }
+    return false;
+  }
+  const std::string sql = "SELECT last_seq FROM conversation_heads WHERE conversation_key = ?;";
+  Statement stmt(db_.handle(), sql, error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  sqlite3_bind_text(stmt.get(), 1, conversation_key.c_str(), -1, SQLITE_TRANSIENT);
+  const int rc = sqlite3_step(stmt.get());
+  if (rc == SQLITE_ROW) {
+    *seq = sqlite3_column_int64(stmt.get(), 0);
+    return true;
+  }
+  if (rc == SQLITE_DONE) {
+    *seq = 0;
+    return true;
   }
+  if (error) {
+    *error = sqlite3_errmsg(db_.handle());
+  }
+  return false;
+}
 
+bool MessageService::purgeConversation(const std::string& conversation_type,
+                                       const std::string& conversation_id,
+                                       int limit,
+                                       int* removed,
+                                       std::string* error) {
+  if (!removed) {
+    if (error) {
+      *error = "removed output is null";
+    }
+    return false;
+  }
+  *removed = 0;
+  if (limit <= 0) {
+    limit = 1;
+  }
+  if (!db_.execute("BEGIN;", error)) {
+    return false;
+  }
+  bool ok = false;
+  do {
+    const std::string delete_targets =
+        "DELETE FROM message_targets WHERE message_id IN "
+        "(SELECT message_id FROM messages WHERE conversation_type = ? AND conversation_id = ? "
+        "ORDER BY message_id LIMIT ?);";
+    Statement target_stmt(db_.handle(), delete_targets, error);
+    if (!target_stmt.valid()) {
+      break;
+    }
+    sqlite3_bind_text(target_stmt.get(), 1, conversation_type.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(target_stmt.get(), 2, conversation_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(target_stmt.get(), 3, limit);
+    if (sqlite3_step(target_stmt.get()) != SQLITE_DONE) {
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      break;
+    }
+
+    const std::string delete_messages =
+        "DELETE FROM messages WHERE message_id IN "
+        "(SELECT message_id FROM messages WHERE conversation_type = ? AND conversation_id = ? "
+        "ORDER BY message_id LIMIT ?);";
+    Statement message_stmt(db_.handle(), delete_messages, error);
+    if (!message_stmt.valid()) {
+      break;
+    }
+    sqlite3_bind_text(message_stmt.get(), 1, conversation_type.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(message_stmt.get(), 2, conversation_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(message_stmt.get(), 3, limit);
+    if (sqlite3_step(message_stmt.get()) != SQLITE_DONE) {
+      if (error) {
+        *error = sqlite3_errmsg(db_.handle());
+      }
+      break;
+    }
+    *removed = sqlite3_changes(db_.handle());
+
+    if (*removed < limit && conversation_type != "private") {
+      const std::string delete_head = "DELETE FROM conversation_heads WHERE conversation_key = ?;";
+      Statement head_stmt(db_.handle(), delete_head, error);
+      if (!head_stmt.valid()) {
+        break;
+      }
+      const auto key = conversationKey(conversation_type, "", conversation_id);
+      sqlite3_bind_text(head_stmt.get(), 1, key.c_str(), -1, SQLITE_TRANSIENT);
+      if (sqlite3_step(head_stmt.get()) != SQLITE_DONE) {
+        if (error) {
+          *error = sqlite3_errmsg(db_.handle());
+        }
+        break;
+      }
+    }
+    ok = true;
+  } while (false);
+
+  if (!db_.execute(ok ? "COMMIT;" : "ROLLBACK;", error)) {
+    return false;
+  }
+  return ok;
+}
+
+std::string MessageService::conversationKey(const std::string& conversation_type,
+                                            const std::string& user_id,
+                                            const std::string& conversation_id) {
+  if (conversation_type != "private") {
+    return conversation_type + ":" + conversation_id;
+  }
+  // Both directions of a private chat share one sequence; the lower id is
+  // length-prefixed so the concatenation cannot collide.
+  const auto& low = std::min(user_id, conversation_id);
+  const auto& high = std::max(user_id, conversation_id);
+  return "private:" + std::to_string(low.size()) + ":" + low + ":" + high;
+}
+
+bool MessageService::encodeContent(const std::string& conversation_key,
+                                   const std::string& text,
+                                   std::string* stored,
+                                   int* codec,
+                                   int64_t* dict_id) {
+  *stored = text;
+  *codec = kCodecRaw;
+  *dict_id = 0;
+  if (!compression_enabled_ || text.empty()) {
+    return false;
+  }
+  auto it = dictionary_ids_.find(conversation_key);
+  if (it == dictionary_ids_.end()) {
+    it = dictionary_ids_.find("");
+  }
+  const std::string* dict = nullptr;
+  const int64_t id = it == dictionary_ids_.end() ? 0 : it->second;
+  std::string error;
+  if (!dictionary(id, &dict, &error)) {
+    return false;
+  }
+  std::vector<uint8_t> packed;
+  if (!onlinetalk::common::deflateRaw(reinterpret_cast<const uint8_t*>(text.data()), text.size(), *dict,
+                                      kCompressionLevel, &packed, &error) ||
+      packed.size() >= text.size()) {
+    return false;
+  }
+  stored->assign(packed.begin(), packed.end());
+  *codec = kCodecDeflate;
+  *dict_id = id;
+  return true;
+}
+
+bool MessageService::dictionary(int64_t dict_id, const std::string** out, std::string* error) {
+  static const std::string kEmpty;
+  if (dict_id == 0) {
+    *out = &kEmpty;
+    return true;
+  }
+  auto it = dictionaries_.find(dict_id);
+  if (it != dictionaries_.end()) {
+    *out = &it->second;
+    return true;
+  }
+  Statement stmt(db_.handle(), "SELECT dictionary FROM compression_dicts WHERE dict_id = ?;", error);
+  if (!stmt.valid()) {
+    return false;
+  }
+  sqlite3_bind_int64(stmt.get(), 1, dict_id);
+  const int rc = sqlite3_step(stmt.get());
+  if (rc == SQLITE_ROW) {
+    const auto data = static_cast<const char*>(sqlite3_column_blob(stmt.get(), 0));
+    const auto size = static_cast<size_t>(sqlite3_column_bytes(stmt.get(), 0));
+    auto inserted = dictionaries_.emplace(dict_id, std::string(data ? data : "", size));
+    *out = &inserted.first->second;
+    return true;
+  }
+  if (error) {
+    *error = rc == SQLITE_DONE ? "dictionary not found" : sqlite3_errmsg(db_.handle());
+  }
+  return false;
+}
+
+bool MessageService::sampleContents(const std::string& conversation_key,
+                                    std::vector<std::string>* texts,
+                                    std::string* error) {
+  texts->clear();
+  const std::string sql = conversation_key.empty()
+                              ? "SELECT content, content_codec, dict_id FROM messages "
+                                "ORDER BY message_id DESC LIMIT ?;"
+                              : "SELECT content, content_codec, dict_id FROM messages "
+                                "WHERE conversation_key = ? ORDER BY conversation_seq DESC LIMIT ?;";
   Statement stmt(db_.handle(), sql, error);
   if (!stmt.valid()) {
     return false;
   }
+  int index = 1;
+  if (!conversation_key.empty()) {
+    sqlite3_bind_text(stmt.get(), index++, conversation_key.c_str(), -1, SQLITE_TRANSIENT);
+  }
+  sqlite3_bind_int(stmt.get(), index, kTrainingSamples);
+  while (true) {
+    const int rc = sqlite3_step(stmt.get());
+    if (rc == SQLITE_ROW) {
+      StoredMessage msg;
+      const auto content = static_cast<const char*>(sqlite3_column_blob(stmt.get(), 0));
+      msg.content.assign(content ? content : "", static_cast<size_t>(sqlite3_column_bytes(stmt.get(), 0)));
+      msg.content_codec = sqlite3_column_int(stmt.get(), 1);
+      msg.dict_id = sqlite3_column_int64(stmt.get(), 2);
+      std::string text;
+      if (contentText(msg, &text, nullptr)) {
+        texts->push_back(std::move(text));
+      }
+      continue;
+    }
+    if (rc == SQLITE_DONE) {
+      return true;
+    }
+    if (error) {
+      *error = sqlite3_errmsg(db_.handle());
+    }
+    return false;
+  }
+}
 
-  if (conversation_type == "private") {
-    sqlite3_bind_int64(stmt.get(), 1, before_id);
-    sqlite3_bind_text(stmt.get(), 2, user_id.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt.get(), 3, conversation_id.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt.get(), 4, conversation_id.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt.get(), 5, user_id.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int(stmt.get(), 6, limit);
+std::string MessageService::buildDictionary(const std::vector<std::string>& samples) {
+  // Count words and word pairs that recur across samples and keep the ones
+  // that save the most bytes. DEFLATE reaches the end of the dictionary with
+  // the shortest distance codes, so the most valuable entries go last.
+  std::unordered_map<std::string, int> counts;
+  for (const auto& sample : samples) {
+    std::istringstream stream(sample);
+    std::string previous;
+    std::string word;
+    while (stream >> word) {
+      ++counts[word + " "];
+      if (!previous.empty()) {
+        ++counts[previous + word + " "];
+      }
+      previous = word + " ";
+    }
+  }
+  std::vector<std::pair<int64_t, const std::string*>> scored;
+  for (const auto& entry : counts) {
+    if (entry.second < 2 || entry.first.size() < 3) {
+      continue;
+    }
+    scored.emplace_back(static_cast<int64_t>(entry.second - 1) * static_cast<int64_t>(entry.first.size()),
+                        &entry.first);
+  }
+  std::sort(scored.begin(), scored.end(), [](const auto& lhs, const auto& rhs) {
+    return lhs.first != rhs.first ? lhs.first > rhs.first : *lhs.second < *rhs.second;
+  });
+  size_t total = 0;
+  size_t keep = 0;
+  while (keep < scored.size() && total + scored[keep].second->size() <= kMaxDictionarySize) {
+    total += scored[keep].second->size();
+    ++keep;
+  }
+  std::string dict;
+  dict.reserve(total);
+  for (size_t i = keep; i > 0; --i) {
+    dict += *scored[i - 1].second;
+  }
+  return dict;
+}
+
+void MessageService::bindHistoryQuery(sqlite3_stmt* stmt, const std::string& user_id, const HistoryQuery& query) {
+  const int limit = query.limit > 0 ? query.limit : 1;
+  const auto before_id = query.before_message_id > 0
+                             ? query.before_message_id
+                             : std::numeric_limits<int64_t>::max();
+  if (query.conversation_type == "private") {
+    sqlite3_bind_int64(stmt, 1, before_id);
+    sqlite3_bind_text(stmt, 2, user_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 3, query.conversation_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 4, query.conversation_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 5, user_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int(stmt, 6, limit);
   } else {
-    sqlite3_bind_text(stmt.get(), 1, conversation_type.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_text(stmt.get(), 2, conversation_id.c_str(), -1, SQLITE_TRANSIENT);
-    sqlite3_bind_int64(stmt.get(), 3, before_id);
-    sqlite3_bind_int(stmt.get(), 4, limit);
+    sqlite3_bind_text(stmt, 1, query.conversation_type.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_text(stmt, 2, query.conversation_id.c_str(), -1, SQLITE_TRANSIENT);
+    sqlite3_bind_int64(stmt, 3, before_id);
+    sqlite3_bind_int(stmt, 4, limit);
   }
+}
 
+bool MessageService::readMessages(sqlite3_stmt* stmt, std::vector<StoredMessage>* out, std::string* error) {
   while (true) {
-    const int rc = sqlite3_step(stmt.get());
+    const int rc = sqlite3_step(stmt);
     if (rc == SQLITE_ROW) {
       StoredMessage msg;
-      msg.message_id = sqlite3_column_int64(stmt.get(), 0);
-      msg.conversation_type = textOrEmpty(stmt.get(), 1);
-      msg.conversation_id = textOrEmpty(stmt.get(), 2);
-      msg.sender_id = textOrEmpty(stmt.get(), 3);
-      msg.sender_nickname = textOrEmpty(stmt.get(), 4);
-      msg.content = textOrEmpty(stmt.get(), 5);
-      msg.created_at = sqlite3_column_int64(stmt.get(), 6);
+      msg.message_id = sqlite3_column_int64(stmt, 0);
+      msg.conversation_type = textOrEmpty(stmt, 1);
+      msg.conversation_id = textOrEmpty(stmt, 2);
+      msg.sender_id = textOrEmpty(stmt, 3);
+      msg.sender_nickname = textOrEmpty(stmt, 4);
+      const auto content = static_cast<const char*>(sqlite3_column_blob(stmt, 5));
+      msg.content.assign(content ? content : "", static_cast<size_t>(sqlite3_column_bytes(stmt, 5)));
+      msg.created_at = sqlite3_column_int64(stmt, 6);
+      msg.conversation_seq = sqlite3_column_int64(stmt, 7);
+      msg.content_codec = sqlite3_column_int(stmt, 8);
+      msg.dict_id = sqlite3_column_int64(stmt, 9);
       out->push_back(std::move(msg));
       continue;
     }
     if (rc == SQLITE_DONE) {
-      break;
+      return true;
     }
     if (error) {
       *error = sqlite3_errmsg(db_.handle());
     }
     return false;
   }
-
-  std::reverse(out->begin(), out->end());
-  return true;
 }
 
 }  // namespace onlinetalk::server
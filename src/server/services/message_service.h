@@ -2,6 +2,7 @@
 
 #include <cstdint>
 #include <string>
+#include <unordered_map>
 #include <vector>
 
 #include "server/storage/database.h"
@@ -18,18 +19,39 @@ struct MessageInput {
 
 struct StoredMessage {
   int64_t message_id = 0;
+  int64_t conversation_seq = 0;
   std::string conversation_type;
   std::string conversation_id;
   std::string sender_id;
   std::string sender_nickname;
+  // Stored bytes; decode with MessageService::contentText when content_codec
+  // is not raw.
   std::string content;
+  int content_codec = 0;
+  int64_t dict_id = 0;
   int64_t created_at = 0;
 };
 
+struct HistoryQuery {
+  std::string conversation_type;
+  std::string conversation_id;
+  int64_t before_message_id = 0;
+  int limit = 0;
+};
+
 class MessageService {
  public:
   explicit MessageService(Database& db);
 
+  void setCompression(bool enabled);
+  bool loadDictionaries(std::string* error);
+  bool contentText(const StoredMessage& msg, std::string* text, std::string* error);
+  bool trainDictionary(bool* trained, std::string* error);
+  bool compactMessages(int64_t after_message_id, int limit, int64_t* next_message_id, std::string* error);
+  // One batch of clearing stored nicknames that match the sender's current
+  // one; `next_message_id` stays put once the table is done.
+  bool normalizeNicknames(int64_t after_message_id, int limit, int64_t* next_message_id, std::string* error);
+
   bool storeMessage(const MessageInput& input,
                     const std::vector<std::string>& recipients,
                     StoredMessage* stored,
@@ -48,9 +70,42 @@ class MessageService {
                     int limit,
                     std::vector<StoredMessage>* out,
                     std::string* error);
+  bool fetchHistoryBatch(const std::string& user_id,
+                         const std::vector<HistoryQuery>& queries,
+                         std::vector<std::vector<StoredMessage>>* out,
+                         std::string* error);
+  bool fetchSince(const std::string& conversation_key,
+                  int64_t after_seq,
+                  int limit,
+                  std::vector<StoredMessage>* out,
+                  std::string* error);
+  bool headSeq(const std::string& conversation_key, int64_t* seq, std::string* error);
+  bool purgeConversation(const std::string& conversation_type,
+                         const std::string& conversation_id,
+                         int limit,
+                         int* removed,
+                         std::string* error);
+
+  static std::string conversationKey(const std::string& conversation_type,
+                                     const std::string& user_id,
+                                     const std::string& conversation_id);
 
  private:
+  static void bindHistoryQuery(sqlite3_stmt* stmt, const std::string& user_id, const HistoryQuery& query);
+  bool readMessages(sqlite3_stmt* stmt, std::vector<StoredMessage>* out, std::string* error);
+  bool encodeContent(const std::string& conversation_key,
+                     const std::string& text,
+                     std::string* stored,
+                     int* codec,
+                     int64_t* dict_id);
+  bool dictionary(int64_t dict_id, const std::string** out, std::string* error);
+  bool sampleContents(const std::string& conversation_key, std::vector<std::string>* texts, std::string* error);
+  static std::string buildDictionary(const std::vector<std::string>& samples);
+
   Database& db_;
+  bool compression_enabled_ = false;
+  std::unordered_map<std::string, int64_t> dictionary_ids_;
+  std::unordered_map<int64_t, std::string> dictionaries_;
 };
 
 }  // namespace onlinetalk::server
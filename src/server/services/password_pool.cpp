@@ -0,0 +1,115 @@
+#include "server/services/password_pool.h"
+
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "server/services/auth_service.h"
+
+namespace onlinetalk::server {
+
+PasswordPool::~PasswordPool() {
+  stop();
+}
+
+bool PasswordPool::start(size_t threads, size_t max_queued, std::string* error) {
+  event_fd_ = ::eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  if (event_fd_ < 0) {
+    if (error) {
+      *error = "eventfd failed";
+    }
+    return false;
+  }
+  max_queued_ = max_queued;
+  stopping_ = false;
+  workers_.reserve(threads);
+  for (size_t i = 0; i < threads; ++i) {
+    workers_.emplace_back([this] { workerLoop(); });
+  }
+  return true;
+}
+
+void PasswordPool::stop() {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    stopping_ = true;
+    queue_.clear();
+    low_queue_.clear();
+  }
+  cv_.notify_all();
+  for (auto& worker : workers_) {
+    if (worker.joinable()) {
+      worker.join();
+    }
+  }
+  workers_.clear();
+  if (event_fd_ >= 0) {
+    ::close(event_fd_);
+    event_fd_ = -1;
+  }
+}
+
+int PasswordPool::notifyFd() const {
+  return event_fd_;
+}
+
+bool PasswordPool::submit(PasswordJob job, bool low_priority) {
+  {
+    std::lock_guard<std::mutex> lock(mutex_);
+    auto& queue = low_priority ? low_queue_ : queue_;
+    if (stopping_ || workers_.empty() || queue.size() >= max_queued_) {
+      return false;
+    }
+    queue.push_back(std::move(job));
+  }
+  cv_.notify_one();
+  return true;
+}
+
+std::vector<PasswordResult> PasswordPool::takeResults() {
+  uint64_t counter = 0;
+  while (::read(event_fd_, &counter, sizeof(counter)) > 0) {
+  }
+  std::vector<PasswordResult> out;
+  std::lock_guard<std::mutex> lock(mutex_);
+  out.swap(results_);
+  return out;
+}
+
+void PasswordPool::workerLoop() {
+  while (true) {
+    PasswordJob job;
+    {
+      std::unique_lock<std::mutex> lock(mutex_);
+      cv_.wait(lock, [this] { return stopping_ || !queue_.empty() || !low_queue_.empty(); });
+      if (stopping_) {
+        return;
+      }
+      auto& queue = queue_.empty() ? low_queue_ : queue_;
+      job = std::move(queue.front());
+      queue.pop_front();
+    }
+
+    PasswordResult result;
+    result.job_id = job.job_id;
+    if (job.kind == PasswordJobKind::Hash) {
+      result.hash = AuthService::hashPassword(job.password, job.cost, &result.error);
+      result.ok = !result.hash.empty();
+    } else {
+      result.ok = AuthService::verifyPassword(job.password, job.hash);
+      if (!result.ok) {
+        result.error = "password mismatch";
+      } else {
+        result.stale_cost = AuthService::hashCost(job.hash) != job.cost;
+      }
+    }
+
+    {
+      std::lock_guard<std::mutex> lock(mutex_);
+      results_.push_back(std::move(result));
+    }
+    const uint64_t one = 1;
+    [[maybe_unused]] const auto written = ::write(event_fd_, &one, sizeof(one));
+  }
+}
+
+}  // namespace onlinetalk::server
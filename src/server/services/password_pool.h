@@ -0,0 +1,69 @@
+#pragma once
+
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+namespace onlinetalk::server {
+
+enum class PasswordJobKind {
+  Hash,
+  Verify,
+};
+
+struct PasswordJob {
+  uint64_t job_id = 0;
+  PasswordJobKind kind = PasswordJobKind::Verify;
+  std::string password;
+  std::string hash;  // stored hash to verify against
+  int cost = 0;      // bcrypt cost for new hashes
+};
+
+struct PasswordResult {
+  uint64_t job_id = 0;
+  bool ok = false;
+  bool stale_cost = false;  // Verify matched a hash below the requested cost
+  std::string hash;         // new hash from a Hash job
+  std::string error;
+};
+
+// Fixed set of worker threads that run bcrypt off the event loop. Jobs are
+// served strictly in submission order; once `max_queued` jobs are waiting,
+// submit() refuses new ones so callers can reject early. Low-priority jobs
+// (background rehashes) have their own queue of the same bound and only run
+// when no regular job is waiting. Finished results are signalled through an
+// eventfd that the event loop polls with its sockets.
+class PasswordPool {
+ public:
+  PasswordPool() = default;
+  ~PasswordPool();
+
+  PasswordPool(const PasswordPool&) = delete;
+  PasswordPool& operator=(const PasswordPool&) = delete;
+
+  bool start(size_t threads, size_t max_queued, std::string* error);
+  void stop();
+  int notifyFd() const;
+  bool submit(PasswordJob job, bool low_priority = false);
+  std::vector<PasswordResult> takeResults();
+
+ private:
+  void workerLoop();
+
+  std::mutex mutex_;
+  std::condition_variable cv_;
+  std::deque<PasswordJob> queue_;
+  std::deque<PasswordJob> low_queue_;
+  std::vector<PasswordResult> results_;
+  std::vector<std::thread> workers_;
+  size_t max_queued_ = 0;
+  bool stopping_ = false;
+  int event_fd_ = -1;
+};
+
+}  // namespace onlinetalk::server
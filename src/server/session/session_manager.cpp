@@ -2,6 +2,12 @@
 
 namespace onlinetalk::server {
 
+namespace {
+
+constexpr size_t kMaxDataConnections = 4;
+
+}  // namespace
+
 void SessionManager::addConnection(int fd) {
   Session session;
   session.fd = fd;
@@ -13,9 +19,12 @@ void SessionManager::removeConnection(int fd) {
   if (it == sessions_.end()) {
     return;
   }
-  if (it->second.logged_in && !it->second.user_id.empty()) {
+  if (it->second.control_fd < 0 && it->second.logged_in && !it->second.user_id.empty()) {
     user_to_fd_.erase(it->second.user_id);
   }
+  if (!it->second.data_token.empty()) {
+    token_to_fd_.erase(it->second.data_token);
+  }
   sessions_.erase(it);
 }
 
@@ -27,6 +36,12 @@ bool SessionManager::login(int fd, const std::string& user_id, const std::string
     }
     return false;
   }
+  if (it->second.control_fd >= 0) {
+    if (error) {
+      *error = "data connection cannot log in";
+    }
+    return false;
+  }
   auto existing = user_to_fd_.find(user_id);
   if (existing != user_to_fd_.end() && existing->second != fd) {
     if (error) {
@@ -49,9 +64,58 @@ void SessionManager::logout(int fd) {
   if (it->second.logged_in && !it->second.user_id.empty()) {
     user_to_fd_.erase(it->second.user_id);
   }
+  if (!it->second.data_token.empty()) {
+    token_to_fd_.erase(it->second.data_token);
+  }
   it->second.logged_in = false;
   it->second.user_id.clear();
   it->second.nickname.clear();
+  it->second.data_token.clear();
+}
+
+void SessionManager::setDataToken(int fd, const std::string& token) {
+  auto it = sessions_.find(fd);
+  if (it == sessions_.end() || !it->second.logged_in) {
+    return;
+  }
+  if (!it->second.data_token.empty()) {
+    token_to_fd_.erase(it->second.data_token);
+  }
+  it->second.data_token = token;
+  token_to_fd_[token] = fd;
+}
+
+bool SessionManager::attachData(int fd, const std::string& token, std::string* error) {
+  auto it = sessions_.find(fd);
+  auto owner = token_to_fd_.find(token);
+  if (it == sessions_.end() || owner == token_to_fd_.end() || it->second.logged_in) {
+    if (error) {
+      *error = "invalid data token";
+    }
+    return false;
+  }
+  if (dataConnections(owner->second).size() >= kMaxDataConnections) {
+    if (error) {
+      *error = "too many data connections";
+    }
+    return false;
+  }
+  const auto& control = sessions_.at(owner->second);
+  it->second.logged_in = true;
+  it->second.user_id = control.user_id;
+  it->second.nickname = control.nickname;
+  it->second.control_fd = owner->second;
+  return true;
+}
+
+std::vector<int> SessionManager::dataConnections(int control_fd) const {
+  std::vector<int> fds;
+  for (const auto& [fd, session] : sessions_) {
+    if (session.control_fd == control_fd) {
+      fds.push_back(fd);
+    }
+  }
+  return fds;
 }
 
 bool SessionManager::isLoggedIn(int fd) const {
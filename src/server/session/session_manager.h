@@ -11,6 +11,10 @@ struct Session {
   bool logged_in = false;
   std::string user_id;
   std::string nickname;
+  // Control connections hand out a token; a data connection presenting it
+  // carries file traffic for the same user and records its control fd here.
+  std::string data_token;
+  int control_fd = -1;
 };
 
 struct OnlineUser {
@@ -24,6 +28,11 @@ class SessionManager {
   void removeConnection(int fd);
   bool login(int fd, const std::string& user_id, const std::string& nickname, std::string* error);
   void logout(int fd);
+  void setDataToken(int fd, const std::string& token);
+  // Binds a fresh connection to the session owning `token`; a session keeps
+  // only a few data connections.
+  bool attachData(int fd, const std::string& token, std::string* error);
+  std::vector<int> dataConnections(int control_fd) const;
   bool isLoggedIn(int fd) const;
   bool tryGetFd(const std::string& user_id, int* fd) const;
   std::vector<OnlineUser> onlineUsers() const;
@@ -32,6 +41,7 @@ class SessionManager {
  private:
   std::unordered_map<int, Session> sessions_;
   std::unordered_map<std::string, int> user_to_fd_;
+  std::unordered_map<std::string, int> token_to_fd_;
 };
 
 }  // namespace onlinetalk::server
@@ -36,6 +36,18 @@ bool Statement::valid() const {
   return stmt_ != nullptr;
 }
 
+std::string sqlPlaceholders(size_t count) {
+  std::string out;
+  out.reserve(count * 2);
+  for (size_t i = 0; i < count; ++i) {
+    if (i > 0) {
+      out += ',';
+    }
+    out += '?';
+  }
+  return out;
+}
+
 Database::~Database() {
   close();
 }
@@ -127,6 +139,18 @@ CREATE TABLE IF NOT EXISTS messages (
   created_at INTEGER NOT NULL
 );
 
+CREATE TABLE IF NOT EXISTS conversation_heads (
+  conversation_key TEXT PRIMARY KEY,
+  last_seq INTEGER NOT NULL
+);
+
+CREATE TABLE IF NOT EXISTS compression_dicts (
+  dict_id INTEGER PRIMARY KEY AUTOINCREMENT,
+  conversation_key TEXT NOT NULL UNIQUE,
+  dictionary BLOB NOT NULL,
+  created_at INTEGER NOT NULL
+);
+
 CREATE TABLE IF NOT EXISTS message_targets (
   message_id INTEGER NOT NULL,
   user_id TEXT NOT NULL,
@@ -156,6 +180,14 @@ CREATE TABLE IF NOT EXISTS file_uploads (
   updated_at INTEGER NOT NULL
 );
 
+CREATE TABLE IF NOT EXISTS file_blobs (
+  sha256 TEXT PRIMARY KEY,
+  file_size INTEGER NOT NULL,
+  storage_path TEXT NOT NULL,
+  ref_count INTEGER NOT NULL,
+  created_at INTEGER NOT NULL
+);
+
 CREATE TABLE IF NOT EXISTS file_targets (
   file_id TEXT NOT NULL,
   user_id TEXT NOT NULL,
@@ -167,6 +199,7 @@ CREATE INDEX IF NOT EXISTS idx_group_members_user ON group_members(user_id);
 CREATE INDEX IF NOT EXISTS idx_messages_conversation ON messages(conversation_type, conversation_id);
 CREATE INDEX IF NOT EXISTS idx_targets_user ON message_targets(user_id, delivered_at);
 CREATE INDEX IF NOT EXISTS idx_files_conversation ON files(conversation_type, conversation_id);
+CREATE INDEX IF NOT EXISTS idx_files_uploader ON files(uploader_id);
 CREATE INDEX IF NOT EXISTS idx_file_targets_user ON file_targets(user_id, delivered_at);
 )SQL";
 
@@ -191,6 +224,89 @@ CREATE INDEX IF NOT EXISTS idx_file_targets_user ON file_targets(user_id, delive
   if (!addColumnIfMissing("ALTER TABLE files ADD COLUMN uploader_nickname TEXT NOT NULL DEFAULT '';")) {
     return false;
   }
+  if (!addColumnIfMissing("ALTER TABLE messages ADD COLUMN conversation_key TEXT NOT NULL DEFAULT '';")) {
+    return false;
+  }
+  if (!addColumnIfMissing("ALTER TABLE messages ADD COLUMN conversation_seq INTEGER NOT NULL DEFAULT 0;")) {
+    return false;
+  }
+  if (!execute("CREATE INDEX IF NOT EXISTS idx_messages_seq ON messages(conversation_key, conversation_seq);", error)) {
+    return false;
+  }
+  if (!addColumnIfMissing("ALTER TABLE messages ADD COLUMN content_codec INTEGER NOT NULL DEFAULT 0;")) {
+    return false;
+  }
+  if (!addColumnIfMissing("ALTER TABLE messages ADD COLUMN dict_id INTEGER NOT NULL DEFAULT 0;")) {
+    return false;
+  }
+  if (!addColumnIfMissing("ALTER TABLE groups ADD COLUMN dissolved_at INTEGER;")) {
+    return false;
+  }
+  if (!execute("CREATE INDEX IF NOT EXISTS idx_groups_dissolved ON groups(dissolved_at);", error)) {
+    return false;
+  }
+  if (!addColumnIfMissing("ALTER TABLE file_uploads ADD COLUMN hash_state BLOB;")) {
+    return false;
+  }
+  if (!addColumnIfMissing("ALTER TABLE groups ADD COLUMN ephemeral INTEGER NOT NULL DEFAULT 0;")) {
+    return false;
+  }
+  if (!addColumnIfMissing("ALTER TABLE groups ADD COLUMN message_ttl INTEGER NOT NULL DEFAULT 0;")) {
+    return false;
+  }
+  if (!addColumnIfMissing("ALTER TABLE file_uploads ADD COLUMN manifest BLOB;")) {
+    return false;
+  }
+  if (!addColumnIfMissing("ALTER TABLE file_blobs ADD COLUMN manifest BLOB;")) {
+    return false;
+  }
+  return backfillConversationSeq(error);
+}
+
+bool Database::backfillConversationSeq(std::string* error) {
+  Statement probe(db_, "SELECT 1 FROM messages WHERE conversation_seq = 0 LIMIT 1;", error);
+  if (!probe.valid()) {
+    return false;
+  }
+  const int rc = sqlite3_step(probe.get());
+  if (rc == SQLITE_DONE) {
+    return true;
+  }
+  if (rc != SQLITE_ROW) {
+    if (error) {
+      *error = sqlite3_errmsg(db_);
+    }
+    return false;
+  }
+
+  onlinetalk::common::Logger::log(onlinetalk::common::LogLevel::Info,
+                                  "backfilling per-conversation message sequence numbers");
+
+  // Keys must match MessageService::conversationKey(): private conversations are
+  // keyed by the unordered user pair, with the lower id length-prefixed so the
+  // concatenation stays unambiguous.
+  const char* backfill_sql = R"SQL(
+BEGIN;
+UPDATE messages SET conversation_key = CASE conversation_type
+  WHEN 'private' THEN 'private:' || length(CAST(min(sender_id, conversation_id) AS BLOB)) || ':' ||
+                      min(sender_id, conversation_id) || ':' || max(sender_id, conversation_id)
+  ELSE conversation_type || ':' || conversation_id
+END
+WHERE conversation_key = '';
+UPDATE messages SET conversation_seq = ranked.seq
+FROM (SELECT message_id,
+             ROW_NUMBER() OVER (PARTITION BY conversation_key ORDER BY message_id) AS seq
+      FROM messages) AS ranked
+WHERE messages.message_id = ranked.message_id;
+INSERT OR REPLACE INTO conversation_heads(conversation_key, last_seq)
+  SELECT conversation_key, MAX(conversation_seq) FROM messages GROUP BY conversation_key;
+COMMIT;
+)SQL";
+  if (!execute(backfill_sql, error)) {
+    std::string rollback_error;
+    execute("ROLLBACK;", &rollback_error);
+    return false;
+  }
   return true;
 }
 
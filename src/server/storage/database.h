@@ -17,6 +17,9 @@ class Statement {
   sqlite3_stmt* stmt_ = nullptr;
 };
 
+// Returns "?,?,...,?" with `count` placeholders for building IN (...) lists.
+std::string sqlPlaceholders(size_t count);
+
 class Database {
  public:
   Database() = default;
@@ -30,6 +33,8 @@ class Database {
   bool execute(const std::string& sql, std::string* error);
 
  private:
+  bool backfillConversationSeq(std::string* error);
+
   sqlite3* db_ = nullptr;
 };
 
@@ -0,0 +1,26 @@
+#pragma once
+
+#include <unistd.h>
+
+namespace onlinetalk::server {
+
+// Owns a file descriptor and closes it on destruction.
+class FileHandle {
+ public:
+  explicit FileHandle(int fd) : fd_(fd) {}
+  ~FileHandle() {
+    if (fd_ >= 0) {
+      ::close(fd_);
+    }
+  }
+
+  FileHandle(const FileHandle&) = delete;
+  FileHandle& operator=(const FileHandle&) = delete;
+
+  int fd() const { return fd_; }
+
+ private:
+  int fd_ = -1;
+};
+
+}  // namespace onlinetalk::server